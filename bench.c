@@ -0,0 +1,452 @@
+/*
+ * Microbenchmarks of server's hot functions. Server is included whole,
+ * so its static functions may be called directly. Every benchmark runs
+ * on synthetic data generated from fixed seed and reports time and
+ * number of allocations (counted by malloc wrappers below) per operation.
+ */
+#include "server.c"
+
+#define	BENCH_SEED 42
+#define	BENCH_OPS 1000000		// Operations of cheap benchmarks
+#define	BENCH_USERS 1000
+
+struct conf *conf;
+char conf_file[DFINGER_FILENAME_SIZE];
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static long long allocations;
+
+static long long now_nsecs(void);
+static void timer_start(void);
+static void timer_stop(void);
+static void report(const char *name, int param, long long ops);
+static void random_login(struct login *login, int line);
+static struct machine * fill_machine(const char *hostname, int sessions,
+					struct login *logins);
+static void clear_past(struct machine *machine);
+
+static void bench_fetch_line(void);
+static void bench_fetch_login(void);
+static void bench_update_login(int sessions);
+static void bench_delete_logins(int sessions);
+static void bench_find_user(int size);
+static void bench_find_machine(int size);
+static void bench_sprint_login(void);
+static void bench_json_login(void);
+static void bench_format_timediff(void);
+static void bench_qsort(int size);
+static void bench_top_n(int size, int limit);
+static void bench_dump(int machines, int sessions);
+
+static unsigned int seed = BENCH_SEED;
+static long long timer_begin, timer_allocs;
+static long long elapsed, allocated;
+
+void *malloc(size_t size) {
+	allocations++;
+	return (__libc_malloc(size));
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	allocations++;
+	return (__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size) {
+	allocations++;
+	return (__libc_realloc(ptr, size));
+}
+
+static long long now_nsecs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+static void timer_start(void) {
+	timer_allocs = allocations;
+	timer_begin = now_nsecs();
+}
+
+static void timer_stop(void) {
+	elapsed += now_nsecs() - timer_begin;
+	allocated += allocations - timer_allocs;
+}
+
+static void report(const char *name, int param, long long ops) {
+	char label[DFINGER_LINE_SIZE];
+	if (param) {
+		snprintf(label, DFINGER_LINE_SIZE, "%s/%d", name, param);
+	} else {
+		snprintf(label, DFINGER_LINE_SIZE, "%s", name);
+	}
+
+	printf("%-32s %12.1f ns/op %10.2f allocs/op\n", label,
+		(double) elapsed / ops, (double) allocated / ops);
+	fflush(stdout);
+	elapsed = 0;
+	allocated = 0;
+}
+
+static void random_login(struct login *login, int line) {
+	memset(login, 0, sizeof (struct login));
+	snprintf(login->user, UT_NAMESIZE, "user%d",
+		rand_r(&seed) % BENCH_USERS);
+	snprintf(login->line, UT_LINESIZE, "pts/%d", line);
+	snprintf(login->host, UT_HOSTSIZE, "10.0.%d.%d", rand_r(&seed) % 256,
+		rand_r(&seed) % 256);
+	login->login_time = 1600000000 + rand_r(&seed) % 10000000;
+	login->idle_time = rand_r(&seed) % 3600;
+}
+
+static struct machine * fill_machine(const char *hostname, int sessions,
+					struct login *logins) {
+	char name[UT_HOSTSIZE];
+	snprintf(name, UT_HOSTSIZE, "%s", hostname);
+	struct machine *machine = add_machine(name);
+	for (int i = 0; i < sessions; i++) {
+		random_login(&logins[i], i);
+		update_login(machine, &logins[i]);
+	}
+
+	return (machine);
+}
+
+static void clear_past(struct machine *machine) {
+	while (machine->past_logins) {
+		clear_login(machine->past_logins, NULL);
+	}
+}
+
+static void bench_fetch_line(void) {
+	struct growing_buffer input;
+	init_buffer(&input, 1024 * 1024);
+	char line[DFINGER_LINE_SIZE];
+	int lines = 1000;
+	for (int i = 0; i < lines; i++) {
+		int len = snprintf(line, DFINGER_LINE_SIZE,
+				"user%d pts/%d %d %d 10.0.%d.%d \n",
+				rand_r(&seed) % BENCH_USERS, i,
+				1600000000 + rand_r(&seed), rand_r(&seed) % 3600,
+				rand_r(&seed) % 256, rand_r(&seed) % 256);
+		append_buffer(&input, line, len);
+	}
+	append_buffer(&input, "", 1);
+
+	size_t offset = 0;
+	timer_start();
+	for (long long i = 0; i < BENCH_OPS; i++) {
+		if (fetch_line(input.buffer, input.len - 1, &offset, line,
+		    DFINGER_LINE_SIZE - 1) == RTL_WANT_MORE) {
+			offset = 0;
+			i--;
+		}
+	}
+	timer_stop();
+	report("fetch_line", 0, BENCH_OPS);
+
+	free_buffer(&input);
+}
+
+static void bench_fetch_login(void) {
+	char lines[100][DFINGER_LINE_SIZE];
+	for (int i = 0; i < 100; i++) {
+		snprintf(lines[i], DFINGER_LINE_SIZE,
+			"user%d pts/%d %d %d 10.0.%d.%d ",
+			rand_r(&seed) % BENCH_USERS, i,
+			1600000000 + rand_r(&seed), rand_r(&seed) % 3600,
+			rand_r(&seed) % 256, rand_r(&seed) % 256);
+	}
+
+	struct login login;
+	timer_start();
+	for (long long i = 0; i < BENCH_OPS; i++) {
+		fetch_login(lines[i % 100], &login);
+	}
+	timer_stop();
+	report("fetch_login", 0, BENCH_OPS);
+}
+
+static void bench_update_login(int sessions) {
+	struct login *logins = malloc(sessions * sizeof (struct login));
+	if (!logins) {
+		exit(ENOMEM);
+	}
+	struct machine *machine = fill_machine("bench", sessions, logins);
+
+	long long ops = BENCH_OPS / sessions * 10;
+	timer_start();
+	for (long long i = 0; i < ops; i++) {
+		struct login *login = &logins[rand_r(&seed) % sessions];
+		login->idle_time = i;
+		update_login(machine, login);
+	}
+	timer_stop();
+	report("update_login", sessions, ops);
+
+	clear_store();
+	free(logins);
+}
+
+static void bench_delete_logins(int sessions) {
+	struct login *logins = malloc(sessions * sizeof (struct login));
+	if (!logins) {
+		exit(ENOMEM);
+	}
+	struct machine *machine = fill_machine("bench", sessions, logins);
+
+	// Each round retires all sessions and logs them in again
+	int rounds = BENCH_OPS / 10 / sessions;
+	for (int i = 0; i < rounds; i++) {
+		timer_start();
+		delete_logins(machine, 1);
+		timer_stop();
+
+		clear_past(machine);
+		for (int j = 0; j < sessions; j++) {
+			update_login(machine, &logins[j]);
+		}
+	}
+	report("delete_logins", sessions, (long long) rounds * sessions);
+
+	clear_store();
+	free(logins);
+}
+
+static void bench_find_user(int size) {
+	char name[UT_NAMESIZE];
+	for (int i = 0; i < size; i++) {
+		snprintf(name, UT_NAMESIZE, "user%d", i);
+		add_user(name);
+	}
+
+	long long ops = BENCH_OPS / size * 100;
+	timer_start();
+	for (long long i = 0; i < ops; i++) {
+		snprintf(name, UT_NAMESIZE, "user%d", rand_r(&seed) % size);
+		find_user(name);
+	}
+	timer_stop();
+	report("find_user", size, ops);
+
+	clear_store();
+}
+
+static void bench_find_machine(int size) {
+	char name[UT_HOSTSIZE];
+	for (int i = 0; i < size; i++) {
+		snprintf(name, UT_HOSTSIZE, "host%d", i);
+		add_machine(name);
+	}
+
+	long long ops = BENCH_OPS / size * 100;
+	timer_start();
+	for (long long i = 0; i < ops; i++) {
+		snprintf(name, UT_HOSTSIZE, "host%d", rand_r(&seed) % size);
+		find_machine(name);
+	}
+	timer_stop();
+	report("find_machine", size, ops);
+
+	clear_store();
+}
+
+static void bench_sprint_login(void) {
+	struct login logins[100];
+	struct machine *machine = fill_machine("bench", 100, logins);
+	struct login_data *data[100];
+	struct login_data *login = machine->logins;
+	for (int i = 0; login; i++) {
+		data[i] = login;
+		login = login->next_by_machine;
+	}
+
+	char buffer[DFINGER_BUFFER_SIZE];
+	timer_start();
+	for (long long i = 0; i < BENCH_OPS; i++) {
+		sprint_login(data[i % 100], buffer, DFINGER_BUFFER_SIZE);
+	}
+	timer_stop();
+	report("sprint_login", 0, BENCH_OPS);
+
+	clear_store();
+}
+
+/*
+ * Encodes the same sessions as bench_sprint_login into reused buffer, as
+ * they are appended to the answer.
+ */
+static void bench_json_login(void) {
+	struct login logins[100];
+	struct machine *machine = fill_machine("bench", 100, logins);
+	struct login_data *data[100];
+	struct login_data *login = machine->logins;
+	for (int i = 0; login; i++) {
+		data[i] = login;
+		login = login->next_by_machine;
+	}
+
+	struct growing_buffer response;
+	init_buffer(&response, 1024 * 1024);
+	timer_start();
+	for (long long i = 0; i < BENCH_OPS; i++) {
+		if (i % 100 == 0) {
+			response.len = 0;
+		}
+		json_login(data[i % 100], &response);
+	}
+	timer_stop();
+	report("json_login", 0, BENCH_OPS);
+
+	free_buffer(&response);
+	clear_store();
+}
+
+static void bench_format_timediff(void) {
+	timer_start();
+	for (long long i = 0; i < BENCH_OPS; i++) {
+		free(format_timediff(i * 37 % 1000000));
+	}
+	timer_stop();
+	report("format_timediff", 0, BENCH_OPS);
+}
+
+static void bench_qsort(int size) {
+	struct login *logins = malloc(size * sizeof (struct login));
+	struct login_data **sorted = malloc(size * sizeof (void *));
+	struct login_data **original = malloc(size * sizeof (void *));
+	if (!logins || !sorted || !original) {
+		exit(ENOMEM);
+	}
+	struct machine *machine = fill_machine("bench", size, logins);
+	struct login_data *login = machine->logins;
+	for (int i = 0; login; i++) {
+		original[i] = login;
+		login = login->next_by_machine;
+	}
+
+	long long ops = BENCH_OPS / size;
+	for (long long i = 0; i < ops; i++) {
+		memcpy(sorted, original, size * sizeof (void *));
+		timer_start();
+		qsort(sorted, size, sizeof (struct login_data *),
+			cmp_logins_by_name);
+		timer_stop();
+	}
+	report("qsort_by_name", size, ops);
+
+	clear_store();
+	free(original);
+	free(sorted);
+	free(logins);
+}
+
+static void bench_top_n(int size, int limit) {
+	struct login *logins = malloc(size * sizeof (struct login));
+	if (!logins) {
+		exit(ENOMEM);
+	}
+	struct machine *machine = fill_machine("bench", size, logins);
+
+	struct finger_request request;
+	memset(&request, 0, sizeof (struct finger_request));
+	request.sort = SORT_IDLE;
+	request.limit = limit;
+
+	long long ops = BENCH_OPS / size;
+	timer_start();
+	for (long long i = 0; i < ops; i++) {
+		struct login_stack stack;
+		stack_init(&stack, 0);
+		stack_order(&stack, &request);
+		get_logins_machine(&stack, machine);
+		stack_sort(&stack);
+		stack_free(&stack);
+	}
+	timer_stop();
+	report("top_n_by_idle", size, ops);
+
+	clear_store();
+	free(logins);
+}
+
+static void bench_dump(int machines, int sessions) {
+	struct login *logins = malloc(sessions * sizeof (struct login));
+	if (!logins) {
+		exit(ENOMEM);
+	}
+	char name[UT_HOSTSIZE];
+	for (int i = 0; i < machines; i++) {
+		snprintf(name, UT_HOSTSIZE, "host%d", i);
+		fill_machine(name, sessions, logins);
+	}
+
+	char dump[] = "/tmp/dfinger-bench-XXXXXX";
+	int fd = mkstemp(dump);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create dump file\n");
+		exit(EINVAL);
+	}
+	close(fd);
+	free(conf->dump_file);
+	conf->dump_file = dump;
+
+	int rounds = 20;
+	long long read_time = 0, read_allocs = 0;
+	for (int i = 0; i < rounds; i++) {
+		timer_start();
+		write_data();
+		timer_stop();
+
+		clear_store();
+		long long write_time = elapsed, write_allocs = allocated;
+		timer_start();
+		read_data();
+		timer_stop();
+		read_time += elapsed - write_time;
+		read_allocs += allocated - write_allocs;
+		elapsed = write_time;
+		allocated = write_allocs;
+	}
+	report("write_data", machines * sessions, rounds);
+	elapsed = read_time;
+	allocated = read_allocs;
+	report("read_data", machines * sessions, rounds);
+
+	unlink(dump);
+	conf->dump_file = NULL;
+	clear_store();
+	free(logins);
+}
+
+int main(void) {
+	conf = malloc(sizeof (struct conf));
+	if (!conf) {
+		return (ENOMEM);
+	}
+	memset(conf, 0, sizeof (struct conf));
+	conf_set_defaults(conf);
+
+	bench_fetch_line();
+	bench_fetch_login();
+	for (int sessions = 10; sessions <= 1000; sessions *= 10) {
+		bench_update_login(sessions);
+		bench_delete_logins(sessions);
+	}
+	for (int size = 100; size <= 10000; size *= 10) {
+		bench_find_user(size);
+		bench_find_machine(size);
+	}
+	bench_sprint_login();
+	bench_json_login();
+	bench_format_timediff();
+	bench_qsort(1000);
+	bench_top_n(1000, 20);
+	bench_dump(100, 20);
+
+	return (0);
+}
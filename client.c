@@ -12,6 +12,7 @@
 #include "client.h"
 #include "conf.h"
 #include "utils.h"
+#include "shard.h"
 
 extern struct conf *conf;
 
@@ -77,47 +78,35 @@ static void process_online_users(int s, void *(f)(char *)) {
 }
 
 void client_run(void) {
-	int sock = -1;
-	struct addrinfo *r, *rorig, hints;
-	memset(&hints, 0, sizeof (hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
 	char hoststr[DFINGER_HOST_SIZE];
+	int port = conf->port;
 	if (conf->host_addr) {
 		snprintf(hoststr, DFINGER_HOST_SIZE, "%s", conf->host_addr);
 	} else {
 		snprintf(hoststr, DFINGER_HOST_SIZE, "%s", "localhost");
 	}
-	char portstr[PORT_SIZE];
-	snprintf(portstr, PORT_SIZE, "%d", conf->port);
-	int ret = getaddrinfo(hoststr, portstr, &hints, &r);
-	if (ret != 0) {
-		fprintf(stderr, "Could not identify host\n");
-		exit(EINVAL);
-	}
 
-	for (rorig = r; r != NULL; r = r->ai_next) {
-		sock = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
-		if (sock < 0) {
-			fprintf(stderr, "Could not open socket to host\n");
-			exit(EINVAL);
+	if (shard_count()) {
+		// Machine reports to the server owning its hostname
+		char hostname[DFINGER_HOST_SIZE];
+		gethostname(hostname, DFINGER_HOST_SIZE);
+		hostname[DFINGER_HOST_SIZE-1] = 0;
+		char *dot = strchr(hostname, '.');
+		if (dot) {
+			*dot = 0;
 		}
 
-		if (connect(sock, (struct sockaddr *) r->ai_addr,
-				r->ai_addrlen) == 0) {
-			break;
-		} else {
-			close(sock);
-		}
+		struct shard *shard = shard_get(shard_owner(hostname));
+		snprintf(hoststr, DFINGER_HOST_SIZE, "%s", shard->host);
+		port = shard->port;
 	}
 
-	if (!r) {
+	int sock = connect_host(hoststr, port);
+	if (sock < 0) {
 		fprintf(stderr, "Could not connect to server\n");
 		exit(EINVAL);
 	}
 
-	freeaddrinfo(rorig);
-
 	char update_start[] = "!!! UPDATE\n";
 	char update_end[] = "\n";
 	while (1) {
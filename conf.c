@@ -19,13 +19,35 @@ void conf_set_defaults(struct conf *conf) {
 	conf->max_msg_size = 2000;
 	conf->timeout_update = 10;
 	conf->timeout_dump = 60 * 5;
+	conf->dump_full_interval = 60 * 60;
 	conf->timeout_clear = 60 * 60 * 12;
 	conf->timeout_cut = 60 * 60;
 	conf->client_lifetime = 60 * 15;
 	conf->dump_file = malloc(1024);
 	snprintf(conf->dump_file, 1024, "serverdump");
 	conf->max_clients = 128;
+	conf->max_fingers = 64;
+	conf->max_replicas = 8;
+	conf->finger_read_timeout = 5000;
+	conf->finger_idle_timeout = 60000;
+	conf->query_rate = 1000;
+	conf->query_burst = 2000;
 	conf->num_records = 100;
+	conf->archive_time = 60 * 60 * 24 * 90;
+	conf->distinct_days = 90;
+	conf->relay_port = 8000;
+	conf->relay_batch = 200;
+	conf->forwarding = 0;
+	conf->forward_port = 79;
+	conf->forward_timeout = 5000;
+	conf->shard_self = -1;
+	conf->shard_timeout = 2000;
+	conf->watch_backlog = 1024 * 1024;
+	conf->trace_file = malloc(1024);
+	snprintf(conf->trace_file, 1024, "dfinger-trace.json");
+	conf->slow_threshold = 100;
+	conf->slow_log_file = malloc(1024);
+	snprintf(conf->slow_log_file, 1024, "dfinger-slow.log");
 }
 
 static char *find_spaces(char *ptr) {
@@ -111,6 +133,30 @@ static void set_option(char *line, struct conf *conf) {
 		conf->max_clients = strtol(value, NULL, 10);
 	}
 
+	if (strncmp(key, "MAX_FINGERS", 11) == 0) {
+		conf->max_fingers = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "MAX_REPLICAS", 12) == 0) {
+		conf->max_replicas = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "FINGER_READ_TIMEOUT", 19) == 0) {
+		conf->finger_read_timeout = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "FINGER_IDLE_TIMEOUT", 19) == 0) {
+		conf->finger_idle_timeout = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "QUERY_RATE", 10) == 0) {
+		conf->query_rate = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "QUERY_BURST", 11) == 0) {
+		conf->query_burst = strtol(value, NULL, 10);
+	}
+
 	if (strncmp(key, "TIMEOUT_UPDATE", 14) == 0) {
 		conf->timeout_update = strtol(value, NULL, 10);
 	}
@@ -119,14 +165,30 @@ static void set_option(char *line, struct conf *conf) {
 		conf->timeout_dump = strtol(value, NULL, 10);
 	}
 
+	if (strncmp(key, "DUMP_SEGMENTS", 13) == 0) {
+		conf->dump_segments = strtol(value, NULL, 10);
+		if (conf->dump_segments < 0) {
+			conf->dump_segments = 0;
+		} else if (conf->dump_segments > DFINGER_DUMP_MAXSEGMENTS) {
+			conf->dump_segments = DFINGER_DUMP_MAXSEGMENTS;
+		}
+	}
+
+	if (strncmp(key, "DUMP_FULL_INTERVAL", 18) == 0) {
+		conf->dump_full_interval = strtol(value, NULL, 10);
+	}
+
 	if (strncmp(key, "CLIENT_LIFETIME", 12) == 0) {
 		conf->client_lifetime = strtol(value, NULL, 10);
 	}
 
 	if (strncmp(key, "SERVER_ADDR", 11) == 0) {
 		free(conf->host_addr);
-		conf->host_addr = malloc(strlen(value));
-		strncpy(conf->host_addr, value, strlen(value));
+		conf->host_addr = malloc(strlen(value)+1);
+		if (!conf->host_addr) {
+			exit(ENOMEM);
+		}
+		strncpy(conf->host_addr, value, strlen(value)+1);
 	}
 
 	if (strncmp(key, "IS_CLIENT", 9) == 0) {
@@ -137,6 +199,116 @@ static void set_option(char *line, struct conf *conf) {
 		conf->is_server = strtol(value, NULL, 10);
 	}
 
+	if (strncmp(key, "FORWARDING", 10) == 0) {
+		conf->forwarding = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "FORWARD_PORT", 12) == 0) {
+		conf->forward_port = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "FORWARD_TIMEOUT", 15) == 0) {
+		conf->forward_timeout = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "WATCH_BACKLOG", 13) == 0) {
+		conf->watch_backlog = strtoll(value, NULL, 10);
+	}
+
+	if (strncmp(key, "IO_URING", 8) == 0) {
+		conf->io_uring = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "TRACING", 7) == 0) {
+		conf->tracing = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "TRACE_FILE", 10) == 0) {
+		free(conf->trace_file);
+		conf->trace_file = malloc(strlen(value)+1);
+		if (!conf->trace_file) {
+			exit(ENOMEM);
+		}
+		strncpy(conf->trace_file, value, strlen(value)+1);
+	}
+
+	if (strncmp(key, "SLOW_THRESHOLD", 14) == 0) {
+		conf->slow_threshold = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "SLOW_LOG_FILE", 13) == 0) {
+		free(conf->slow_log_file);
+		conf->slow_log_file = malloc(strlen(value)+1);
+		if (!conf->slow_log_file) {
+			exit(ENOMEM);
+		}
+		strncpy(conf->slow_log_file, value, strlen(value)+1);
+	}
+
+	if (strncmp(key, "SHARD_SERVERS", 13) == 0) {
+		free(conf->shard_servers);
+		conf->shard_servers = malloc(strlen(value)+1);
+		if (!conf->shard_servers) {
+			exit(ENOMEM);
+		}
+		strncpy(conf->shard_servers, value, strlen(value)+1);
+	}
+
+	if (strncmp(key, "SHARD_TOKEN", 11) == 0) {
+		free(conf->shard_token);
+		conf->shard_token = malloc(strlen(value)+1);
+		if (!conf->shard_token) {
+			exit(ENOMEM);
+		}
+		strncpy(conf->shard_token, value, strlen(value)+1);
+	}
+
+	if (strncmp(key, "SHARD_SELF", 10) == 0) {
+		conf->shard_self = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "SHARD_TIMEOUT", 13) == 0) {
+		conf->shard_timeout = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "IS_REPLICA", 10) == 0) {
+		conf->is_replica = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "REPL_PORT", 9) == 0) {
+		conf->repl_port = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "REPL_ADDR", 9) == 0) {
+		free(conf->repl_addr);
+		conf->repl_addr = malloc(strlen(value)+1);
+		if (!conf->repl_addr) {
+			exit(ENOMEM);
+		}
+		strncpy(conf->repl_addr, value, strlen(value)+1);
+	}
+
+	if (strncmp(key, "IS_RELAY", 8) == 0) {
+		conf->is_relay = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "RELAY_PORT", 10) == 0) {
+		conf->relay_port = strtol(value, NULL, 10);
+	}
+
+	if (strncmp(key, "RELAY_HOSTS", 11) == 0) {
+		free(conf->relay_hosts);
+		conf->relay_hosts = malloc(strlen(value)+1);
+		if (!conf->relay_hosts) {
+			exit(ENOMEM);
+		}
+		strncpy(conf->relay_hosts, value, strlen(value)+1);
+	}
+
+	if (strncmp(key, "RELAY_BATCH", 11) == 0) {
+		conf->relay_batch = strtol(value, NULL, 10);
+	}
+
 	if (strncmp(key, "NUM_RECORDS", 11) == 0) {
 		conf->num_records = strtol(value, NULL, 10);
 	}
@@ -144,6 +316,13 @@ static void set_option(char *line, struct conf *conf) {
 	if (strncmp(key, "ARCHIVE_TIME", 13) == 0) {
 		conf->archive_time = strtol(value, NULL, 10);
 	}
+
+	if (strncmp(key, "DISTINCT_DAYS", 13) == 0) {
+		conf->distinct_days = strtol(value, NULL, 10);
+		if (conf->distinct_days < 1) {
+			conf->distinct_days = 1;
+		}
+	}
 }
 
 void parse_config(char *filename, struct conf *conf) {
@@ -153,14 +332,17 @@ void parse_config(char *filename, struct conf *conf) {
 	memset(buffer, 0, DFINGER_BUFFER_SIZE);
 	char line[DFINGER_LINE_SIZE];
 	memset(line, 0, DFINGER_LINE_SIZE);
-	size_t blen = DFINGER_BUFFER_SIZE;
+	size_t blen = 0;
 	size_t boffset = 0;
-	size_t llen = DFINGER_LINE_SIZE;
+	size_t llen = DFINGER_LINE_SIZE - 1;
 
 	int ret;
 	int num_read;
-	while ((num_read = read(conf_file, buffer, DFINGER_BUFFER_SIZE) > 0)) {
+	while ((num_read = read(conf_file, buffer + blen,
+				DFINGER_BUFFER_SIZE - blen - 1)) > 0) {
 		blen += num_read;
+		buffer[blen] = 0;
+		boffset = 0;
 		while ((ret = fetch_line(buffer, blen, &boffset, line, llen)) !=
 			RTL_WANT_MORE) {
 			switch (ret) {
@@ -170,10 +352,12 @@ void parse_config(char *filename, struct conf *conf) {
 				case RTL_BLANK_LINE:
 					break;
 				default:
+					close(conf_file);
 					return;
 			}
 		}
 		move_buffer(buffer, blen, &boffset);
+		blen = boffset;
 	}
 
 	close(conf_file);
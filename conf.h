@@ -5,23 +5,68 @@ struct conf {
 	int finger_port;	// Port for finger requests
 	int timeout_update;	// Timeout for client updates, in secs
 	int timeout_dump;	// Timeout for server dump fo file [s]
+	int dump_segments;	// Segment files of the dump, 0 = one file
+	int dump_full_interval;	// Time between rewrites of all segments [s]
 	int timeout_clear;	// Timeout for clearing old records [s]
 	int timeout_cut;	// Timeout for cutting records [s]
 	int client_lifetime;	// Timeout before logging out machine [s]
 	int archive_time;	// Time after machines/users may be cleared [s]
+	int distinct_days;	// Days of sketches of distinct users
 	int num_records;	// Number of records kept for machine/user
-	int max_clients;
+	int max_clients;	// Connections of clients
+	int max_fingers;	// Finger connections, watchers included
+	int max_replicas;
+	int finger_read_timeout;	// Time to send whole query [ms]
+	int finger_idle_timeout;	// Keep-alive finger between queries [ms]
+	int query_rate;		// Query tokens per second, 0 = no limit
+	int query_burst;	// Most query tokens saved up
 	int is_client;
 	int is_server;
+	int is_relay;
+	int is_replica;
+	int repl_port;		// Port replicas connect to the primary on
+	int relay_port;		// Port relay accepts client updates on
+	int relay_batch;	// Delay before relay sends updates upstream [ms]
+	int forwarding;		// Forward user@host@host finger queries
+	int forward_port;	// Finger port of remote hosts
+	int forward_timeout;	// Inactivity timeout of forwarding [ms]
+	int shard_self;		// Index of this server in shard_servers
+	int shard_timeout;	// Timeout for answers of other shards [ms]
+	long long watch_backlog;	// Max unsent events of watcher [B]
+	int tracing;		// Record hot path phases
+	int io_uring;		// Use io_uring instead of poll
+	int slow_threshold;	// Operations logged as slow, 0 = off [ms]
 	size_t max_msg_size;
 	char *dump_file;
 	char *host_addr;
+	char *shard_servers;	// List of host:port:finger_port
+	char *shard_token;	// Secret shards prove their /L queries by
+	char *relay_hosts;	// Clients allowed to name their machines
+	char *repl_addr;	// Address of the primary
+	char *trace_file;	// Chrome trace written when tracing stops
+	char *slow_log_file;	// File slow log is appended to
 };
 
 #define	DFINGER_BUFFER_SIZE 4096
+#define	DFINGER_INPUT_MAXSIZE (64 * 1024)
+#define	DFINGER_COST_QUERY 1		// Tokens of query about a user or host
+#define	DFINGER_COST_LISTING 10		// Tokens of listing of all machines
 #define	DFINGER_STACK_MAXSIZE 4096
+#define	DFINGER_STATS_TOP 10		// Busiest machines listed by /STATS
+#define	DFINGER_DAY (60 * 60 * 24)
 #define	DFINGER_GBUFFER_MAXSIZE 8192
 #define	DFINGER_LINE_SIZE 1000
+#define	DFINGER_RELAY_BUFFER_SIZE (1024 * 1024)
+#define	DFINGER_REPL_BUFFER_SIZE (16 * 1024 * 1024)
+#define	DFINGER_REPL_HEARTBEAT 1000
+#define	DFINGER_REPL_CHUNK (256 * 1024)	// Snapshot waiting to be sent
+#define	DFINGER_RESOLVE_POLL 10
+#define	DFINGER_FRAME_SIZE 32
+#define	DFINGER_FRAME_ROOM (DFINGER_FRAME_SIZE + 9)	// Header and end
+#define	DFINGER_WATCH_LOG_SIZE (16 * 1024 * 1024)
+#define	DFINGER_WATCH_IOV 64
+#define	DFINGER_METRICS_BUFFER_SIZE (256 * 1024)
+#define	DFINGER_SLOW_QUERY_SIZE 64
 
 #ifndef	UT_LINESIZE
 #define	UT_LINESIZE 32
@@ -42,7 +87,9 @@ struct conf {
 
 #define	DFINGER_FILENAME_SIZE 256
 #define	DFINGER_TIME_SIZE 20
-#define	DFINGER_UINFO_SIZE 50
+#define	DFINGER_UINFO_SIZE 70
+#define	DFINGER_DUMP_MANIFEST "!!! SEGMENTS "	// First line of manifest
+#define	DFINGER_DUMP_MAXSEGMENTS 4096
 
 void parse_config(char *filename, struct conf *conf);
 void conf_set_defaults(struct conf *conf);
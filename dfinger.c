@@ -4,6 +4,10 @@
 #include "conf.h"
 #include "server.h"
 #include "client.h"
+#include "relay.h"
+#include "shard.h"
+#include "import.h"
+#include "export.h"
 
 void prt(char *msg) {
 	printf("%s\n", msg);
@@ -11,12 +15,31 @@ void prt(char *msg) {
 
 static void print_usage(void) {
 	printf("Run as dfinger [config filename]\n");
+	printf("or dfinger -i dump_file [host=]wtmp_file... to import "
+		"wtmp files\n");
+	printf("or dfinger -e dump_file output_file to export sessions\n");
 }
 
 struct conf *conf;
 char conf_file[DFINGER_FILENAME_SIZE];
 
 int main(int argc, char **argv) {
+	if (argc >= 2 && strcmp(argv[1], "-i") == 0) {
+		if (argc < 4) {
+			print_usage();
+			return (EINVAL);
+		}
+		return (import_run(argv[2], argc - 3, argv + 3));
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "-e") == 0) {
+		if (argc != 4) {
+			print_usage();
+			return (EINVAL);
+		}
+		return (export_run(argv[2], argv[3]));
+	}
+
 	if (argc > 2) {
 		print_usage();
 		return (EINVAL);
@@ -37,17 +60,25 @@ int main(int argc, char **argv) {
 	conf_set_defaults(conf);
 
 	parse_config(conf_file, conf);
+	shard_load(conf->shard_servers);
 
-	if (conf->is_server) {
+	int is_server = conf->is_server || conf->is_replica;
+
+	if (is_server) {
 		server_run();
 	}
 
-	if (!conf->is_server && conf->is_client) {
+	if (!is_server && conf->is_relay) {
+		relay_run();
+	}
+
+	if (!is_server && !conf->is_relay && conf->is_client) {
 		client_run();
 	}
 
-	if (!conf->is_server && !conf->is_client) {
-		fprintf(stderr, "Neither server nor client run specified\n");
+	if (!is_server && !conf->is_relay && !conf->is_client) {
+		fprintf(stderr,
+			"Neither server, relay nor client run specified\n");
 		return (EINVAL);
 	}
 
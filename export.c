@@ -0,0 +1,408 @@
+#define	_XOPEN_SOURCE 600
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "export.h"
+#include "conf.h"
+#include "utils.h"
+#include "hll.h"
+
+/*
+ * Columnar export of sessions from the dump file. Server replaces the
+ * dump atomically, so it may be exported while the server runs.
+ *
+ * File starts with EXPORT_MAGIC, number of columns and for each of them
+ * its name and type ('d' dictionary encoded string, 'i' delta encoded
+ * integer), followed by row groups of at most EXPORT_GROUP_ROWS rows.
+ * Group is number of rows and then every column as its byte length and
+ * data, so readers may skip columns they don't need. Dictionary column
+ * is number of entries, entries (length and bytes) and index of entry
+ * for each row; integer column is difference from the previous row
+ * (from zero for the first one). All numbers are LEB128 varints, signed
+ * ones zigzag encoded. Group of zero rows ends the file.
+ *
+ * Each group has its own dictionaries, so memory needed is bounded by
+ * the group size rather than by the size of the dump. Segmented dump is
+ * exported segment by segment as listed by its manifest.
+ */
+
+enum column_type {
+	COLUMN_DICT = 'd',
+	COLUMN_INT = 'i'
+};
+
+struct dict_slot {
+	size_t offset;			// Offset of the string in entries
+	size_t len;
+	uint32_t id;
+	int used;
+};
+
+struct column {
+	const char *name;
+	enum column_type type;
+	struct growing_buffer data;	// Encoded rows
+	struct growing_buffer entries;	// Encoded dictionary
+	uint32_t num_entries;
+	struct dict_slot *slots;
+	size_t size;
+	long long last;			// Previous value of integer column
+};
+
+enum {
+	COL_MACHINE,
+	COL_USER,
+	COL_LINE,
+	COL_HOST,
+	COL_LOGIN,
+	COL_LOGOUT,
+	COL_IDLE,
+	NUM_COLUMNS
+};
+
+static size_t put_varint(char *buffer, uint64_t value);
+static void append_varint(struct growing_buffer *buffer, uint64_t value);
+static uint64_t zigzag(long long value);
+static uint32_t hash_str(const char *str, size_t len);
+
+static void column_init(struct column *column, const char *name,
+			enum column_type type);
+static void column_reset(struct column *column);
+static void column_free(struct column *column);
+static void column_add_str(struct column *column, const char *str);
+static void column_add_int(struct column *column, long long value);
+
+static void write_header(FILE *out);
+static void write_group(FILE *out, size_t rows);
+static int add_row(const char *machine, char *line);
+static int export_file(const char *dump_file, FILE *out, size_t *rows,
+			size_t *total, int segment);
+
+static struct column columns[NUM_COLUMNS];
+
+static size_t put_varint(char *buffer, uint64_t value) {
+	size_t len = 0;
+	while (value >= 0x80) {
+		buffer[len++] = (char) (value | 0x80);
+		value >>= 7;
+	}
+	buffer[len++] = (char) value;
+
+	return (len);
+}
+
+static void append_varint(struct growing_buffer *buffer, uint64_t value) {
+	char varint[10];
+	append_buffer(buffer, varint, put_varint(varint, value));
+}
+
+static uint64_t zigzag(long long value) {
+	return (((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+// FNV-1a
+static uint32_t hash_str(const char *str, size_t len) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) str[i];
+		hash *= 16777619u;
+	}
+
+	return (hash);
+}
+
+static void column_init(struct column *column, const char *name,
+			enum column_type type) {
+	memset(column, 0, sizeof (struct column));
+	column->name = name;
+	column->type = type;
+	init_buffer(&column->data, EXPORT_COLUMN_MAXSIZE);
+	init_buffer(&column->entries, EXPORT_COLUMN_MAXSIZE);
+
+	if (type == COLUMN_DICT) {
+		column->size = EXPORT_DICT_SIZE;
+		column->slots = calloc(column->size, sizeof (struct dict_slot));
+		if (!column->slots) {
+			exit(ENOMEM);
+		}
+	}
+}
+
+static void column_reset(struct column *column) {
+	column->data.len = 0;
+	column->entries.len = 0;
+	column->num_entries = 0;
+	column->last = 0;
+	if (column->slots) {
+		memset(column->slots, 0, column->size *
+			sizeof (struct dict_slot));
+	}
+}
+
+static void column_free(struct column *column) {
+	free_buffer(&column->data);
+	free_buffer(&column->entries);
+	free(column->slots);
+}
+
+static void column_add_str(struct column *column, const char *str) {
+	if (column->num_entries * 2 >= column->size) {
+		struct dict_slot *old = column->slots;
+		size_t old_size = column->size;
+		column->size *= 2;
+		column->slots = calloc(column->size, sizeof (struct dict_slot));
+		if (!column->slots) {
+			exit(ENOMEM);
+		}
+
+		for (size_t i = 0; i < old_size; i++) {
+			if (!old[i].used) {
+				continue;
+			}
+			size_t j = hash_str(column->entries.buffer +
+					old[i].offset, old[i].len) &
+					(column->size - 1);
+			while (column->slots[j].used) {
+				j = (j + 1) & (column->size - 1);
+			}
+			column->slots[j] = old[i];
+		}
+		free(old);
+	}
+
+	size_t len = strlen(str);
+	size_t i = hash_str(str, len) & (column->size - 1);
+	while (column->slots[i].used) {
+		struct dict_slot *slot = &column->slots[i];
+		if (slot->len == len && memcmp(column->entries.buffer +
+		    slot->offset, str, len) == 0) {
+			append_varint(&column->data, slot->id);
+			return;
+		}
+		i = (i + 1) & (column->size - 1);
+	}
+
+	append_varint(&column->entries, len);
+	column->slots[i].offset = column->entries.len;
+	column->slots[i].len = len;
+	column->slots[i].id = column->num_entries++;
+	column->slots[i].used = 1;
+	append_buffer(&column->entries, (char *) str, len);
+
+	append_varint(&column->data, column->slots[i].id);
+}
+
+static void column_add_int(struct column *column, long long value) {
+	append_varint(&column->data, zigzag(value - column->last));
+	column->last = value;
+}
+
+static void write_header(FILE *out) {
+	char varint[10];
+
+	fwrite(EXPORT_MAGIC, 1, strlen(EXPORT_MAGIC), out);
+	fwrite(varint, 1, put_varint(varint, NUM_COLUMNS), out);
+	for (int i = 0; i < NUM_COLUMNS; i++) {
+		size_t len = strlen(columns[i].name);
+		fwrite(varint, 1, put_varint(varint, len), out);
+		fwrite(columns[i].name, 1, len, out);
+		fputc(columns[i].type, out);
+	}
+}
+
+static void write_group(FILE *out, size_t rows) {
+	char varint[10];
+	char count[10];
+
+	fwrite(varint, 1, put_varint(varint, rows), out);
+	if (!rows) {
+		return;
+	}
+
+	for (int i = 0; i < NUM_COLUMNS; i++) {
+		struct column *column = &columns[i];
+		size_t len = column->data.len;
+		size_t count_len = 0;
+
+		if (column->type == COLUMN_DICT) {
+			count_len = put_varint(count, column->num_entries);
+			len += count_len + column->entries.len;
+		}
+
+		fwrite(varint, 1, put_varint(varint, len), out);
+		if (column->type == COLUMN_DICT) {
+			fwrite(count, 1, count_len, out);
+			fwrite(column->entries.buffer, 1, column->entries.len,
+				out);
+		}
+		fwrite(column->data.buffer, 1, column->data.len, out);
+
+		column_reset(column);
+	}
+}
+
+/*
+ * Adds login line of the dump (user line login idle host [logout]).
+ */
+static int add_row(const char *machine, char *line) {
+	char *fields[6] = { NULL, NULL, NULL, NULL, NULL, "0" };
+	char *ptr = line;
+
+	for (int i = 0; i < 6; i++) {
+		char *sep = strchr(ptr, ' ');
+		if (!sep) {
+			if (i < 5) {
+				return (1);
+			}
+			break;
+		}
+		*sep = 0;
+		fields[i] = ptr;
+		ptr = sep + 1;
+	}
+
+	column_add_str(&columns[COL_MACHINE], machine);
+	column_add_str(&columns[COL_USER], fields[0]);
+	column_add_str(&columns[COL_LINE], fields[1]);
+	column_add_str(&columns[COL_HOST], fields[4]);
+	column_add_int(&columns[COL_LOGIN], atoll(fields[2]));
+	column_add_int(&columns[COL_LOGOUT], atoll(fields[5]));
+	column_add_int(&columns[COL_IDLE], atoll(fields[3]));
+
+	return (0);
+}
+
+/*
+ * Exports logins of one file of the dump, or of segments listed by its
+ * manifest unless it is a segment itself. Full row groups are written
+ * as they fill, rows counts those not written yet.
+ */
+static int export_file(const char *dump_file, FILE *out, size_t *rows,
+			size_t *total, int segment) {
+	int dump = open(dump_file, O_RDONLY);
+	if (dump < 0) {
+		fprintf(stderr, "Could not open %s\n", dump_file);
+		return (EINVAL);
+	}
+
+	// Dump has sections of machines and users and then block of logins
+	// for each machine, all of them ended by blank line
+	enum {
+		SKIP_MACHINES,
+		SKIP_USERS,
+		MACHNAME,
+		LOGINS,
+		SEGMENTS
+	} state = SKIP_MACHINES;
+
+	char buffer[DFINGER_BUFFER_SIZE];
+	char line[DFINGER_LINE_SIZE];
+	char machine[DFINGER_LINE_SIZE];
+	size_t blen = 0, boffset;
+	ssize_t num_read;
+	int first = 1;
+	int ret = 0;
+
+	while (!ret && (num_read = read(dump, buffer + blen,
+				DFINGER_BUFFER_SIZE - blen - 1)) > 0) {
+		blen += num_read;
+		buffer[blen] = 0;
+		boffset = 0;
+
+		enum ret_fetch_line fetched;
+		while (!ret && (fetched = fetch_line(buffer, blen, &boffset, line,
+				DFINGER_LINE_SIZE - 1)) != RTL_WANT_MORE) {
+			if (fetched == RTL_BLANK_LINE) {
+				state = (state == MACHNAME ? MACHNAME :
+					state == SKIP_MACHINES ? SKIP_USERS :
+					state == SEGMENTS ? SEGMENTS :
+					MACHNAME);
+				continue;
+			}
+
+			if (fetched != RTL_LINE_FETCHED) {
+				ret = EINVAL;
+				break;
+			}
+
+			if (first && !segment &&
+			    strncmp(line, DFINGER_DUMP_MANIFEST,
+			    strlen(DFINGER_DUMP_MANIFEST)) == 0) {
+				state = SEGMENTS;
+			} else if (state == SEGMENTS) {
+				ret = export_file(line, out, rows, total, 1);
+			} else if (state == MACHNAME) {
+				strcpy(machine, line);
+				state = LOGINS;
+			} else if (state == LOGINS && strncmp(line,
+			    HLL_DUMP_PREFIX, strlen(HLL_DUMP_PREFIX)) == 0) {
+				// Sketch of distinct users, not a session
+			} else if (state == LOGINS) {
+				if (add_row(machine, line) != 0) {
+					ret = EINVAL;
+					break;
+				}
+				if (++*rows == EXPORT_GROUP_ROWS) {
+					write_group(out, *rows);
+					*total += *rows;
+					*rows = 0;
+				}
+			}
+			first = 0;
+		}
+
+		move_buffer(buffer, blen, &boffset);
+		blen = boffset;
+	}
+	close(dump);
+
+	return (ret);
+}
+
+/*
+ * Exports logins of the dump file to output, returns 0 or error code.
+ */
+int export_run(const char *dump_file, const char *output) {
+	FILE *out = fopen(output, "w");
+	if (!out) {
+		fprintf(stderr, "Could not open %s\n", output);
+		return (EINVAL);
+	}
+
+	column_init(&columns[COL_MACHINE], "machine", COLUMN_DICT);
+	column_init(&columns[COL_USER], "user", COLUMN_DICT);
+	column_init(&columns[COL_LINE], "line", COLUMN_DICT);
+	column_init(&columns[COL_HOST], "host", COLUMN_DICT);
+	column_init(&columns[COL_LOGIN], "login_time", COLUMN_INT);
+	column_init(&columns[COL_LOGOUT], "logout_time", COLUMN_INT);
+	column_init(&columns[COL_IDLE], "idle_time", COLUMN_INT);
+	write_header(out);
+
+	size_t rows = 0, total = 0;
+	int ret = export_file(dump_file, out, &rows, &total, 0);
+
+	if (rows) {
+		write_group(out, rows);
+		total += rows;
+	}
+	write_group(out, 0);
+
+	for (int i = 0; i < NUM_COLUMNS; i++) {
+		column_free(&columns[i]);
+	}
+
+	if (fclose(out) != 0 || ret) {
+		fprintf(stderr, "Could not export %s\n", dump_file);
+		return (EINVAL);
+	}
+
+	printf("Exported %zu sessions\n", total);
+
+	return (0);
+}
@@ -0,0 +1,10 @@
+#ifndef __EXPORT_H
+#define	__EXPORT_H
+
+#define	EXPORT_MAGIC "DFCOL1\n"
+#define	EXPORT_GROUP_ROWS 65536		// Rows of one row group
+#define	EXPORT_COLUMN_MAXSIZE (64 * 1024 * 1024)
+#define	EXPORT_DICT_SIZE 1024		// Initial size of dictionary table
+
+int export_run(const char *dump_file, const char *output);
+#endif
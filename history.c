@@ -0,0 +1,187 @@
+#include "history.h"
+
+#include <errno.h>
+#include <limits.h>
+
+/*
+ * History index: every user and machine keeps all its logins, current
+ * and past, in array sorted by login time. Logins come mostly in time
+ * order, so adding one is usually just an append, and time range
+ * queries binary search their start instead of walking login chains.
+ *
+ * Sessions which started before the range are found by a max-tree of
+ * their ends over the array: node n covers what its children 2n and
+ * 2n+1 do, leaf of login i is node size + i. Subtrees all sessions of
+ * which ended before the range are skipped, so however long some
+ * session was, only sessions overlapping the range are visited.
+ */
+
+#define	HISTORY_INITIAL_SIZE 16
+
+static long long history_end(struct login_data *login);
+static void history_update(struct history *history, size_t from, size_t to);
+static size_t history_pos(struct history *history, struct login_data *login);
+static size_t history_prev_node(struct history *history, size_t node,
+				size_t lo, size_t hi, size_t i, long long time);
+
+void history_init(struct history *history) {
+	history->logins = NULL;
+	history->ends = NULL;
+	history->len = 0;
+	history->size = 0;
+}
+
+void history_free(struct history *history) {
+	free(history->logins);
+	free(history->ends);
+	history_init(history);
+}
+
+/*
+ * Returns end of session for the tree, current sessions never end.
+ */
+static long long history_end(struct login_data *login) {
+	if (login->idle_time >= 0) {
+		return (LLONG_MAX);
+	}
+
+	return (login->logout_time > 0 ? login->logout_time :
+		login->login_time);
+}
+
+/*
+ * Sets leaves of logins from up to to (inclusive, those past len are
+ * empty) and the nodes above them.
+ */
+static void history_update(struct history *history, size_t from, size_t to) {
+	long long *ends = history->ends;
+	for (size_t i = from; i <= to && i < history->size; i++) {
+		ends[history->size + i] = (i < history->len ?
+				history_end(history->logins[i]) : LLONG_MIN);
+	}
+
+	size_t lo = (history->size + from) / 2;
+	size_t hi = (history->size + (to < history->size ? to :
+					history->size - 1)) / 2;
+	while (lo > 0) {
+		for (size_t node = lo; node <= hi; node++) {
+			ends[node] = (ends[2 * node] > ends[2 * node + 1] ?
+					ends[2 * node] : ends[2 * node + 1]);
+		}
+		lo /= 2;
+		hi /= 2;
+	}
+}
+
+/*
+ * Returns index of the first login which started after time.
+ */
+size_t history_find(struct history *history, long long time) {
+	size_t lo = 0, hi = history->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (history->logins[mid]->login_time <= time) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return (lo);
+}
+
+/*
+ * Returns index of login, len if it isn't in the history.
+ */
+static size_t history_pos(struct history *history, struct login_data *login) {
+	size_t pos = history_find(history, login->login_time - 1);
+	while (pos < history->len && history->logins[pos] != login) {
+		pos++;
+	}
+
+	return (pos);
+}
+
+static size_t history_prev_node(struct history *history, size_t node,
+				size_t lo, size_t hi, size_t i, long long time) {
+	if (lo >= i || history->ends[node] < time) {
+		return (0);
+	}
+	if (hi - lo == 1) {
+		return (hi);
+	}
+
+	size_t mid = lo + (hi - lo) / 2;
+	size_t found = history_prev_node(history, 2 * node + 1, mid, hi, i,
+					time);
+	if (!found) {
+		found = history_prev_node(history, 2 * node, lo, mid, i, time);
+	}
+
+	return (found);
+}
+
+/*
+ * Returns one past index of the last login before index i which lasted
+ * until time or later, 0 if there isn't any.
+ */
+size_t history_prev(struct history *history, size_t i, long long time) {
+	if (!history->len) {
+		return (0);
+	}
+
+	return (history_prev_node(history, 1, 0, history->size, i, time));
+}
+
+void history_add(struct history *history, struct login_data *login) {
+	int grown = 0;
+	if (history->len == history->size) {
+		history->size = (history->size ? history->size * 2 :
+					HISTORY_INITIAL_SIZE);
+		history->logins = realloc(history->logins,
+				history->size * sizeof (struct login_data *));
+		history->ends = realloc(history->ends,
+				2 * history->size * sizeof (long long));
+		if (!history->logins || !history->ends) {
+			exit(ENOMEM);
+		}
+		grown = 1;
+	}
+
+	size_t pos = history->len;
+	if (pos && history->logins[pos-1]->login_time > login->login_time) {
+		pos = history_find(history, login->login_time);
+		memmove(history->logins + pos + 1, history->logins + pos,
+			(history->len - pos) * sizeof (struct login_data *));
+	}
+	history->logins[pos] = login;
+	history->len++;
+
+	if (grown) {
+		history_update(history, 0, history->size - 1);
+	} else {
+		history_update(history, pos, history->len - 1);
+	}
+}
+
+void history_remove(struct history *history, struct login_data *login) {
+	size_t pos = history_pos(history, login);
+	if (pos == history->len) {
+		return;
+	}
+
+	history->len--;
+	memmove(history->logins + pos, history->logins + pos + 1,
+		(history->len - pos) * sizeof (struct login_data *));
+	history_update(history, pos, history->len);
+}
+
+/*
+ * Notes that login has ended, its end in the tree is set to the logout.
+ */
+void history_logout(struct history *history, struct login_data *login) {
+	size_t pos = history_pos(history, login);
+	if (pos < history->len) {
+		history_update(history, pos, pos);
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef __HISTORY_H
+#define	__HISTORY_H
+
+#include "server.h"
+
+/*
+ * Logins of one user or machine ordered by login time.
+ */
+struct history {
+	struct login_data **logins;
+	long long *ends;		// Max-tree of session ends [s]
+	size_t len;
+	size_t size;
+};
+
+void history_init(struct history *history);
+void history_free(struct history *history);
+void history_add(struct history *history, struct login_data *login);
+void history_remove(struct history *history, struct login_data *login);
+void history_logout(struct history *history, struct login_data *login);
+size_t history_find(struct history *history, long long time);
+size_t history_prev(struct history *history, size_t i, long long time);
+#endif
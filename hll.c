@@ -0,0 +1,356 @@
+#include "hll.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+
+/*
+ * Distinct names (users of a machine or of all of them) are counted by
+ * HyperLogLog sketches, one per day, so counts over any window of days
+ * are estimated by merging the days, with standard error about 4.6 %.
+ * Machine sees few users a day, so its days stay sparse and take tens
+ * of bytes rather than the 512 of all registers.
+ *
+ * In the dump every day is line "!!! HLL day s<entries>" with three
+ * characters for each entry (register in two, rank in one) or "!!! HLL
+ * day d<registers>" with one character for each register, all of them
+ * '0' + value.
+ */
+
+#define	HLL_RANK_BITS 6
+#define	HLL_RANK_MAX ((1 << HLL_RANK_BITS) - 1)
+#define	HLL_ALPHA (0.7213 / (1 + 1.079 / HLL_REGISTERS))
+
+static uint64_t hll_hash(const char *name);
+static struct hll_day * hll_get_day(struct hll *hll, long long day);
+static void hll_set(struct hll_day *day, unsigned int reg,
+			unsigned int rank);
+static void hll_densify(struct hll_day *day);
+
+// FNV-1a, finished by MurmurHash3 mixer so that all bits depend on name
+static uint64_t hll_hash(const char *name) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (; *name; name++) {
+		hash ^= (unsigned char) *name;
+		hash *= 1099511628211ULL;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return (hash);
+}
+
+/*
+ * Returns sketch of the day, added if there isn't any. Logins come
+ * mostly in time order, so the day is usually the last one.
+ */
+static struct hll_day * hll_get_day(struct hll *hll, long long day) {
+	if (hll->len && hll->days[hll->len - 1].day == day) {
+		return (&hll->days[hll->len - 1]);
+	}
+
+	size_t lo = 0, hi = hll->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (hll->days[mid].day < day) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo < hll->len && hll->days[lo].day == day) {
+		return (&hll->days[lo]);
+	}
+
+	if (hll->len == hll->size) {
+		hll->size = (hll->size ? hll->size * 2 : 4);
+		hll->days = realloc(hll->days,
+				hll->size * sizeof (struct hll_day));
+		if (!hll->days) {
+			exit(ENOMEM);
+		}
+	}
+	memmove(hll->days + lo + 1, hll->days + lo,
+		(hll->len - lo) * sizeof (struct hll_day));
+	hll->len++;
+	memset(&hll->days[lo], 0, sizeof (struct hll_day));
+	hll->days[lo].day = day;
+
+	return (&hll->days[lo]);
+}
+
+static void hll_densify(struct hll_day *day) {
+	day->dense = calloc(HLL_REGISTERS, 1);
+	if (!day->dense) {
+		exit(ENOMEM);
+	}
+
+	for (size_t i = 0; i < day->len; i++) {
+		day->dense[day->sparse[i] >> HLL_RANK_BITS] =
+		    day->sparse[i] & HLL_RANK_MAX;
+	}
+	free(day->sparse);
+	day->sparse = NULL;
+	day->len = 0;
+}
+
+static void hll_set(struct hll_day *day, unsigned int reg,
+			unsigned int rank) {
+	if (!rank) {
+		return;
+	}
+
+	if (day->dense) {
+		if (day->dense[reg] < rank) {
+			day->dense[reg] = rank;
+		}
+		return;
+	}
+
+	size_t lo = 0, hi = day->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if ((unsigned int) (day->sparse[mid] >> HLL_RANK_BITS) < reg) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo < day->len &&
+	    (unsigned int) (day->sparse[lo] >> HLL_RANK_BITS) == reg) {
+		if ((unsigned int) (day->sparse[lo] & HLL_RANK_MAX) < rank) {
+			day->sparse[lo] = reg << HLL_RANK_BITS | rank;
+		}
+		return;
+	}
+
+	if (day->len == HLL_SPARSE_MAX) {
+		hll_densify(day);
+		day->dense[reg] = rank;
+		return;
+	}
+
+	// Entries grow one by one, they are few
+	day->sparse = realloc(day->sparse, (day->len + 1) * sizeof (uint16_t));
+	if (!day->sparse) {
+		exit(ENOMEM);
+	}
+	memmove(day->sparse + lo + 1, day->sparse + lo,
+		(day->len - lo) * sizeof (uint16_t));
+	day->sparse[lo] = reg << HLL_RANK_BITS | rank;
+	day->len++;
+}
+
+void hll_init(struct hll *hll) {
+	hll->days = NULL;
+	hll->len = 0;
+	hll->size = 0;
+}
+
+void hll_free(struct hll *hll) {
+	hll_expire(hll, LLONG_MAX);
+	free(hll->days);
+	hll_init(hll);
+}
+
+void hll_add(struct hll *hll, long long day, const char *name) {
+	uint64_t hash = hll_hash(name);
+	unsigned int reg = hash >> (64 - HLL_BITS);
+	uint64_t rest = hash << HLL_BITS;
+	unsigned int rank = (rest ? __builtin_clzll(rest) + 1 :
+				64 - HLL_BITS + 1);
+
+	hll_set(hll_get_day(hll, day), reg, rank);
+}
+
+/*
+ * Adds names of all days of src to dst.
+ */
+void hll_merge(struct hll *dst, struct hll *src) {
+	for (size_t i = 0; i < src->len; i++) {
+		struct hll_day *from = &src->days[i];
+		struct hll_day *to = hll_get_day(dst, from->day);
+		if (from->dense) {
+			if (!to->dense) {
+				hll_densify(to);
+			}
+			for (int reg = 0; reg < HLL_REGISTERS; reg++) {
+				if (to->dense[reg] < from->dense[reg]) {
+					to->dense[reg] = from->dense[reg];
+				}
+			}
+			continue;
+		}
+
+		for (size_t j = 0; j < from->len; j++) {
+			hll_set(to, from->sparse[j] >> HLL_RANK_BITS,
+				from->sparse[j] & HLL_RANK_MAX);
+		}
+	}
+}
+
+/*
+ * Drops days before first_day.
+ */
+void hll_expire(struct hll *hll, long long first_day) {
+	size_t old = 0;
+	while (old < hll->len && hll->days[old].day < first_day) {
+		free(hll->days[old].sparse);
+		free(hll->days[old].dense);
+		old++;
+	}
+
+	if (old) {
+		memmove(hll->days, hll->days + old,
+			(hll->len - old) * sizeof (struct hll_day));
+		hll->len -= old;
+	}
+}
+
+/*
+ * Estimates number of distinct names from first_day to last_day.
+ */
+long long hll_estimate(struct hll *hll, long long first_day,
+			long long last_day) {
+	unsigned char registers[HLL_REGISTERS];
+	memset(registers, 0, HLL_REGISTERS);
+
+	for (size_t i = 0; i < hll->len; i++) {
+		struct hll_day *day = &hll->days[i];
+		if (day->day < first_day || day->day > last_day) {
+			continue;
+		}
+
+		if (day->dense) {
+			for (int reg = 0; reg < HLL_REGISTERS; reg++) {
+				if (registers[reg] < day->dense[reg]) {
+					registers[reg] = day->dense[reg];
+				}
+			}
+			continue;
+		}
+		for (size_t j = 0; j < day->len; j++) {
+			unsigned int reg = day->sparse[j] >> HLL_RANK_BITS;
+			unsigned int rank = day->sparse[j] & HLL_RANK_MAX;
+			if (registers[reg] < rank) {
+				registers[reg] = rank;
+			}
+		}
+	}
+
+	double sum = 0;
+	int zeros = 0;
+	for (int reg = 0; reg < HLL_REGISTERS; reg++) {
+		sum += 1.0 / (1ULL << registers[reg]);
+		zeros += (registers[reg] == 0);
+	}
+
+	double estimate = HLL_ALPHA * HLL_REGISTERS * HLL_REGISTERS / sum;
+	if (estimate <= 2.5 * HLL_REGISTERS && zeros) {
+		// Linear counting is better while many registers are empty
+		estimate = HLL_REGISTERS * log((double) HLL_REGISTERS / zeros);
+	}
+
+	return ((long long) (estimate + 0.5));
+}
+
+/*
+ * Returns memory taken by the sketches.
+ */
+size_t hll_bytes(struct hll *hll) {
+	size_t bytes = hll->size * sizeof (struct hll_day);
+	for (size_t i = 0; i < hll->len; i++) {
+		bytes += (hll->days[i].dense ? HLL_REGISTERS :
+				hll->days[i].len * sizeof (uint16_t));
+	}
+
+	return (bytes);
+}
+
+/*
+ * Writes line of the dump with the day to buffer of HLL_LINE_SIZE bytes,
+ * returns its length.
+ */
+int hll_format(struct hll_day *day, char *buffer) {
+	int len = snprintf(buffer, HLL_LINE_SIZE, "%s%lld %c",
+			HLL_DUMP_PREFIX, day->day, day->dense ? 'd' : 's');
+
+	if (day->dense) {
+		for (int reg = 0; reg < HLL_REGISTERS; reg++) {
+			buffer[len++] = '0' + day->dense[reg];
+		}
+	} else {
+		for (size_t i = 0; i < day->len; i++) {
+			unsigned int reg = day->sparse[i] >> HLL_RANK_BITS;
+			buffer[len++] = '0' + (reg >> HLL_RANK_BITS);
+			buffer[len++] = '0' + (reg & HLL_RANK_MAX);
+			buffer[len++] = '0' + (day->sparse[i] & HLL_RANK_MAX);
+		}
+	}
+	buffer[len++] = '\n';
+	buffer[len] = 0;
+
+	return (len);
+}
+
+/*
+ * Adds day of line of the dump, returns 0 or -1 if it isn't valid.
+ */
+int hll_parse(struct hll *hll, const char *line) {
+	size_t prefix_len = strlen(HLL_DUMP_PREFIX);
+	if (strncmp(line, HLL_DUMP_PREFIX, prefix_len) != 0) {
+		return (-1);
+	}
+
+	char *ptr;
+	long long day = strtoll(line + prefix_len, &ptr, 10);
+	if (*ptr++ != ' ' || (*ptr != 'd' && *ptr != 's')) {
+		return (-1);
+	}
+	char type = *ptr++;
+	size_t len = strcspn(ptr, "\r\n");
+	for (size_t i = 0; i < len; i++) {
+		if (ptr[i] < '0' || ptr[i] > '0' + HLL_RANK_MAX) {
+			return (-1);
+		}
+	}
+
+	if (type == 'd' && len != HLL_REGISTERS) {
+		return (-1);
+	}
+	if (type == 's' && len % 3) {
+		return (-1);
+	}
+	if (type == 's' && len == 0) {
+		return (0);
+	}
+
+	struct hll_day *sketch = hll_get_day(hll, day);
+	if (type == 'd') {
+		if (!sketch->dense) {
+			hll_densify(sketch);
+		}
+		for (int reg = 0; reg < HLL_REGISTERS; reg++) {
+			hll_set(sketch, reg, ptr[reg] - '0');
+		}
+		return (0);
+	}
+
+	for (size_t i = 0; i < len; i += 3) {
+		unsigned int reg = (ptr[i] - '0') << HLL_RANK_BITS |
+					(ptr[i + 1] - '0');
+		if (reg >= HLL_REGISTERS) {
+			return (-1);
+		}
+		hll_set(sketch, reg, ptr[i + 2] - '0');
+	}
+
+	return (0);
+}
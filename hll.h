@@ -0,0 +1,43 @@
+#ifndef __HLL_H
+#define	__HLL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define	HLL_BITS 9			// Registers are picked by 9 bits of hash
+#define	HLL_REGISTERS (1 << HLL_BITS)
+#define	HLL_SPARSE_MAX 128		// Entries before registers are stored
+#define	HLL_LINE_SIZE 560		// Line of the dump with one day
+#define	HLL_DUMP_PREFIX "!!! HLL "
+
+/*
+ * HyperLogLog sketch of one day. Few names are kept as sorted entries
+ * (register << 6 | rank), all registers once entries would take more.
+ */
+struct hll_day {
+	long long day;			// Days since the epoch
+	uint16_t *sparse;
+	size_t len;
+	unsigned char *dense;
+};
+
+/*
+ * Sketches of distinct names by day, ordered by day.
+ */
+struct hll {
+	struct hll_day *days;
+	size_t len;
+	size_t size;
+};
+
+void hll_init(struct hll *hll);
+void hll_free(struct hll *hll);
+void hll_add(struct hll *hll, long long day, const char *name);
+void hll_merge(struct hll *dst, struct hll *src);
+void hll_expire(struct hll *hll, long long first_day);
+long long hll_estimate(struct hll *hll, long long first_day,
+			long long last_day);
+size_t hll_bytes(struct hll *hll);
+int hll_format(struct hll_day *day, char *buffer);
+int hll_parse(struct hll *hll, const char *line);
+#endif
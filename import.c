@@ -0,0 +1,559 @@
+#define	_GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utmpx.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "import.h"
+#include "conf.h"
+#include "utils.h"
+
+/*
+ * Import of wtmp files: each file (of one machine) is split into chunks
+ * of records, which are parsed in parallel. Sessions starting and ending
+ * within a chunk are paired right away; sessions crossing chunk
+ * boundaries are paired once all chunks are done, going through chunks
+ * of all files of the machine in order of time, so that a session also
+ * ends in the next rotated file. The result is written as a dump file
+ * the server loads on start.
+ *
+ * Sessions only point to records of the mapped files, so memory needed
+ * doesn't depend on the length of strings in them.
+ */
+
+struct session {
+	const struct utmpx *login;
+	long long login_time;
+	long long logout_time;		// Zero if still logged in
+};
+
+struct session_list {
+	struct session *items;
+	size_t len;
+	size_t size;
+};
+
+struct line_state {
+	const char *key;		// NULL if the slot is empty
+	const struct utmpx *open;	// Login still in progress
+	long long open_time;
+	long long head_time;		// End of session of previous chunk
+	int seen;			// Line was used in the chunk
+};
+
+struct line_table {
+	struct line_state *slots;
+	size_t size;
+	size_t used;
+	size_t key_size;
+};
+
+struct import_file {
+	char host[DFINGER_HOST_SIZE];
+	const char *path;
+	const struct utmpx *records;
+	size_t num_records;
+	size_t map_size;
+	struct chunk *chunks;
+	size_t num_chunks;
+	size_t first_chunk;		// Index of its first chunk in chunks
+	long long first_time;		// Time of the first record
+	struct session_list sessions;	// Sessions of all files of the host
+	int dup;			// Host has an earlier file
+};
+
+struct chunk {
+	const struct utmpx *records;
+	size_t num_records;
+	struct session_list done;
+	struct line_table lines;
+	long long first_boot;		// Time of the first reboot, -1 if none
+};
+
+static uint32_t hash_key(const char *key, size_t size);
+static void table_init(struct line_table *table, size_t key_size);
+static struct line_state * table_find(struct line_table *table,
+					const char *key, int create);
+static void session_add(struct session_list *list,
+			const struct utmpx *login, long long login_time,
+			long long logout_time);
+static int cmp_sessions(const void *p1, const void *p2);
+static int cmp_files(const void *p1, const void *p2);
+
+static void end_session(struct chunk *chunk, struct line_state *state,
+			long long time);
+static void parse_chunk(size_t idx);
+static void stitch_host(size_t idx);
+
+static int map_file(struct import_file *file, char *arg);
+static void write_machine(FILE *dump, size_t first);
+static int write_dump(const char *output);
+
+static struct import_file *files;
+static size_t num_files;
+static struct chunk **chunks;		// All chunks of all files
+static size_t num_chunks;
+
+// FNV-1a
+static uint32_t hash_key(const char *key, size_t size) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < size && key[i]; i++) {
+		hash ^= (unsigned char) key[i];
+		hash *= 16777619u;
+	}
+
+	return (hash);
+}
+
+static void table_init(struct line_table *table, size_t key_size) {
+	table->size = IMPORT_TABLE_SIZE;
+	table->used = 0;
+	table->key_size = key_size;
+	table->slots = calloc(table->size, sizeof (struct line_state));
+	if (!table->slots) {
+		exit(ENOMEM);
+	}
+}
+
+static struct line_state * table_find(struct line_table *table,
+					const char *key, int create) {
+	if (create && table->used * 2 >= table->size) {
+		struct line_table bigger = *table;
+		bigger.size *= 2;
+		bigger.used = 0;
+		bigger.slots = calloc(bigger.size, sizeof (struct line_state));
+		if (!bigger.slots) {
+			exit(ENOMEM);
+		}
+
+		for (size_t i = 0; i < table->size; i++) {
+			if (table->slots[i].key) {
+				*table_find(&bigger, table->slots[i].key, 1) =
+				    table->slots[i];
+			}
+		}
+		free(table->slots);
+		*table = bigger;
+	}
+
+	size_t i = hash_key(key, table->key_size) & (table->size - 1);
+	while (table->slots[i].key) {
+		if (strncmp(table->slots[i].key, key, table->key_size) == 0) {
+			return (&table->slots[i]);
+		}
+		i = (i + 1) & (table->size - 1);
+	}
+
+	if (!create) {
+		return (NULL);
+	}
+
+	table->used++;
+	table->slots[i].key = key;
+	table->slots[i].open = NULL;
+	table->slots[i].head_time = -1;
+	table->slots[i].seen = 0;
+
+	return (&table->slots[i]);
+}
+
+static void session_add(struct session_list *list,
+			const struct utmpx *login, long long login_time,
+			long long logout_time) {
+	if (list->len == list->size) {
+		list->size = (list->size ? list->size * 2 : IMPORT_TABLE_SIZE);
+		list->items = realloc(list->items,
+				list->size * sizeof (struct session));
+		if (!list->items) {
+			exit(ENOMEM);
+		}
+	}
+
+	list->items[list->len].login = login;
+	list->items[list->len].login_time = login_time;
+	list->items[list->len].logout_time = logout_time;
+	list->len++;
+}
+
+static int cmp_sessions(const void *p1, const void *p2) {
+	const struct session *a = p1;
+	const struct session *b = p2;
+
+	if (a->login_time != b->login_time) {
+		return (a->login_time < b->login_time ? -1 : 1);
+	}
+
+	return (0);
+}
+
+/*
+ * Files of one host go together, the older ones first.
+ */
+static int cmp_files(const void *p1, const void *p2) {
+	const struct import_file *a = p1;
+	const struct import_file *b = p2;
+
+	int ret = strcmp(a->host, b->host);
+	if (ret) {
+		return (ret);
+	}
+
+	if (a->first_time != b->first_time) {
+		return (a->first_time < b->first_time ? -1 : 1);
+	}
+
+	return (0);
+}
+
+/*
+ * Session on the line ends, either by logout or by new login. If it
+ * started in some previous chunk, the time is remembered for stitching.
+ */
+static void end_session(struct chunk *chunk, struct line_state *state,
+			long long time) {
+	if (state->open) {
+		session_add(&chunk->done, state->open, state->open_time, time);
+		state->open = NULL;
+	} else if (!state->seen) {
+		state->head_time = time;
+	}
+	state->seen = 1;
+}
+
+static void parse_chunk(size_t idx) {
+	struct chunk *chunk = chunks[idx];
+
+	for (size_t i = 0; i < chunk->num_records; i++) {
+		const struct utmpx *rec = &chunk->records[i];
+		long long time = rec->ut_tv.tv_sec;
+		struct line_state *state;
+
+		switch (rec->ut_type) {
+			case USER_PROCESS:
+				state = table_find(&chunk->lines, rec->ut_line, 1);
+				end_session(chunk, state, time);
+				state->open = rec;
+				state->open_time = time;
+				break;
+			case DEAD_PROCESS:
+				if (!rec->ut_line[0]) {
+					break;
+				}
+				state = table_find(&chunk->lines, rec->ut_line, 1);
+				end_session(chunk, state, time);
+				break;
+			case RUN_LVL:
+				if (strncmp(rec->ut_user, "shutdown",
+				    sizeof (rec->ut_user)) != 0) {
+					break;
+				}
+				// Fall through
+			case BOOT_TIME:
+				// Nobody survives reboot
+				for (size_t j = 0; j < chunk->lines.size; j++) {
+					state = &chunk->lines.slots[j];
+					if (state->key && state->open) {
+						end_session(chunk, state, time);
+					}
+				}
+				if (chunk->first_boot < 0) {
+					chunk->first_boot = time;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+/*
+ * Pairs sessions crossing chunk boundaries of the files of the host of
+ * files[idx], which follow it in order of time, and sorts sessions by
+ * login time. All sessions of the host are kept by files[idx].
+ */
+static void stitch_host(size_t idx) {
+	struct import_file *file = &files[idx];
+	if (file->dup) {
+		return;
+	}
+
+	struct line_table open;
+	table_init(&open, sizeof (((struct utmpx *) 0)->ut_line));
+
+	// Chunks of the files of one host are next to each other
+	size_t next = idx + 1;
+	while (next < num_files && files[next].dup) {
+		next++;
+	}
+	size_t end = (next < num_files ? files[next].first_chunk : num_chunks);
+
+	for (size_t c = file->first_chunk; c < end; c++) {
+		struct chunk *chunk = chunks[c];
+
+		for (size_t i = 0; i < open.size; i++) {
+			struct line_state *state = &open.slots[i];
+			if (!state->key || !state->open) {
+				continue;
+			}
+
+			long long end = -1;
+			struct line_state *next = table_find(&chunk->lines,
+							state->key, 0);
+			if (next && next->head_time >= 0) {
+				end = next->head_time;
+			}
+			if (chunk->first_boot >= 0 &&
+			    (end < 0 || chunk->first_boot < end)) {
+				end = chunk->first_boot;
+			}
+
+			if (end >= 0) {
+				session_add(&file->sessions, state->open,
+					state->open_time, end);
+				state->open = NULL;
+			}
+		}
+
+		for (size_t i = 0; i < chunk->done.len; i++) {
+			struct session *s = &chunk->done.items[i];
+			session_add(&file->sessions, s->login, s->login_time,
+				s->logout_time);
+		}
+		free(chunk->done.items);
+
+		for (size_t i = 0; i < chunk->lines.size; i++) {
+			struct line_state *state = &chunk->lines.slots[i];
+			if (state->key && state->open) {
+				struct line_state *o = table_find(&open,
+							state->key, 1);
+				o->open = state->open;
+				o->open_time = state->open_time;
+			}
+		}
+		free(chunk->lines.slots);
+	}
+
+	// Sessions still open at the end of the last file are current ones
+	for (size_t i = 0; i < open.size; i++) {
+		if (open.slots[i].key && open.slots[i].open) {
+			session_add(&file->sessions, open.slots[i].open,
+				open.slots[i].open_time, 0);
+		}
+	}
+	free(open.slots);
+
+	qsort(file->sessions.items, file->sessions.len,
+		sizeof (struct session), cmp_sessions);
+}
+
+/*
+ * Maps file given as [host=]path, host defaults to the local one.
+ */
+static int map_file(struct import_file *file, char *arg) {
+	memset(file, 0, sizeof (struct import_file));
+
+	char *sep = strchr(arg, '=');
+	if (sep) {
+		snprintf(file->host, DFINGER_HOST_SIZE, "%.*s",
+			(int) (sep - arg), arg);
+		file->path = sep + 1;
+	} else {
+		gethostname(file->host, DFINGER_HOST_SIZE - 1);
+		file->host[strcspn(file->host, ".")] = 0;
+		file->path = arg;
+	}
+
+	int fd = open(file->path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Could not open %s\n", file->path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return (1);
+	}
+
+	file->num_records = st.st_size / sizeof (struct utmpx);
+	file->map_size = file->num_records * sizeof (struct utmpx);
+	if (file->map_size) {
+		void *map = mmap(NULL, file->map_size, PROT_READ, MAP_PRIVATE,
+				fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "Could not map %s\n", file->path);
+			close(fd);
+			return (1);
+		}
+		posix_madvise(map, file->map_size, POSIX_MADV_SEQUENTIAL);
+		file->records = map;
+		file->first_time = file->records->ut_tv.tv_sec;
+	}
+	close(fd);
+
+	file->num_chunks = (file->num_records + IMPORT_CHUNK_RECORDS - 1) /
+				IMPORT_CHUNK_RECORDS;
+	file->chunks = calloc(file->num_chunks ? file->num_chunks : 1,
+				sizeof (struct chunk));
+	if (!file->chunks) {
+		exit(ENOMEM);
+	}
+
+	for (size_t i = 0; i < file->num_chunks; i++) {
+		struct chunk *chunk = &file->chunks[i];
+		chunk->records = file->records + i * IMPORT_CHUNK_RECORDS;
+		chunk->num_records = file->num_records -
+					i * IMPORT_CHUNK_RECORDS;
+		if (chunk->num_records > IMPORT_CHUNK_RECORDS) {
+			chunk->num_records = IMPORT_CHUNK_RECORDS;
+		}
+		chunk->first_boot = -1;
+		table_init(&chunk->lines, sizeof (chunk->records->ut_line));
+	}
+
+	return (0);
+}
+
+/*
+ * Writes logins of the host of files[first], stitched from all its files,
+ * so that every machine has one section.
+ */
+static void write_machine(FILE *dump, size_t first) {
+	struct session_list *sessions = &files[first].sessions;
+
+	fprintf(dump, "%s\n", files[first].host);
+	for (size_t j = 0; j < sessions->len; j++) {
+		struct session *s = &sessions->items[j];
+		fprintf(dump, "%.*s %.*s %lld %lld %.*s %lld \n",
+			(int) sizeof (s->login->ut_user),
+			s->login->ut_user,
+			(int) sizeof (s->login->ut_line),
+			s->login->ut_line, s->login_time,
+			s->logout_time ? -1LL : 0LL,
+			(int) sizeof (s->login->ut_host),
+			s->login->ut_host, s->logout_time);
+	}
+	fprintf(dump, "\n");
+}
+
+/*
+ * Writes dump in the format of the server: machines, users and then
+ * logins of each machine, sections ended by blank line.
+ */
+static int write_dump(const char *output) {
+	char tmpfile[DFINGER_FILENAME_SIZE + 4];
+	snprintf(tmpfile, sizeof (tmpfile), "%s.tmp", output);
+
+	FILE *dump = fopen(tmpfile, "w");
+	if (!dump) {
+		fprintf(stderr, "Could not open %s\n", tmpfile);
+		return (EINVAL);
+	}
+
+	for (size_t i = 0; i < num_files; i++) {
+		if (!files[i].dup) {
+			fprintf(dump, "%s\n", files[i].host);
+		}
+	}
+	fprintf(dump, "\n");
+
+	struct line_table users;
+	table_init(&users, sizeof (((struct utmpx *) 0)->ut_user));
+	for (size_t i = 0; i < num_files; i++) {
+		for (size_t j = 0; j < files[i].sessions.len; j++) {
+			const struct utmpx *login = files[i].sessions.items[j].login;
+			struct line_state *user = table_find(&users,
+							login->ut_user, 1);
+			if (!user->seen) {
+				user->seen = 1;
+				fprintf(dump, "%.*s\n",
+					(int) sizeof (login->ut_user),
+					login->ut_user);
+			}
+		}
+	}
+	free(users.slots);
+	fprintf(dump, "\n");
+
+	for (size_t i = 0; i < num_files; i++) {
+		if (!files[i].dup) {
+			write_machine(dump, i);
+		}
+	}
+	fprintf(dump, "\n");
+
+	if (fclose(dump) != 0) {
+		fprintf(stderr, "Could not write %s\n", tmpfile);
+		return (EINVAL);
+	}
+	rename(tmpfile, output);
+
+	return (0);
+}
+
+/*
+ * Imports wtmp files given as [host=]path into dump file output,
+ * returns 0 or error code.
+ */
+int import_run(const char *output, int count, char **args) {
+	num_files = count;
+	files = calloc(num_files ? num_files : 1, sizeof (struct import_file));
+	if (!files) {
+		exit(ENOMEM);
+	}
+
+	num_chunks = 0;
+	for (size_t i = 0; i < num_files; i++) {
+		if (map_file(&files[i], args[i]) != 0) {
+			return (EINVAL);
+		}
+		num_chunks += files[i].num_chunks;
+	}
+
+	// Rotated files of one host are stitched in order of time
+	qsort(files, num_files, sizeof (struct import_file), cmp_files);
+	for (size_t i = 1; i < num_files; i++) {
+		files[i].dup = (strcmp(files[i-1].host, files[i].host) == 0);
+	}
+
+	chunks = malloc((num_chunks ? num_chunks : 1) * sizeof (struct chunk *));
+	if (!chunks) {
+		exit(ENOMEM);
+	}
+	size_t c = 0;
+	for (size_t i = 0; i < num_files; i++) {
+		files[i].first_chunk = c;
+		for (size_t j = 0; j < files[i].num_chunks; j++) {
+			chunks[c++] = &files[i].chunks[j];
+		}
+	}
+
+	run_parallel(num_chunks, parse_chunk);
+	run_parallel(num_files, stitch_host);
+
+	int ret = write_dump(output);
+
+	size_t num_sessions = 0;
+	for (size_t i = 0; i < num_files; i++) {
+		num_sessions += files[i].sessions.len;
+		free(files[i].sessions.items);
+		free(files[i].chunks);
+		if (files[i].map_size) {
+			munmap((void *) files[i].records, files[i].map_size);
+		}
+	}
+	free(chunks);
+	free(files);
+
+	if (!ret) {
+		printf("Imported %zu sessions from %zu files\n", num_sessions,
+			num_files);
+	}
+
+	return (ret);
+}
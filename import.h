@@ -0,0 +1,8 @@
+#ifndef __IMPORT_H
+#define	__IMPORT_H
+
+#define	IMPORT_CHUNK_RECORDS 65536	// Records parsed by one job
+#define	IMPORT_TABLE_SIZE 64		// Initial size of line tables
+
+int import_run(const char *output, int num_files, char **files);
+#endif
@@ -0,0 +1,127 @@
+#define	_GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <utmpx.h>
+#include <sys/time.h>
+
+#include "import.h"
+#include "conf.h"
+
+/*
+ * Throughput benchmark of wtmp import. Generates wtmp files of given
+ * number of machines in temporary directory and imports them.
+ * Run as dfinger-import-bench [machines [records_per_machine]]
+ */
+
+#define	BENCH_LINES 20			// Terminals per machine
+#define	BENCH_USERS 500
+
+static void generate(const char *path, long records, unsigned int seed);
+static double now(void);
+
+static void generate(const char *path, long records, unsigned int seed) {
+	FILE *wtmp = fopen(path, "w");
+	if (!wtmp) {
+		fprintf(stderr, "Could not create %s\n", path);
+		exit(EINVAL);
+	}
+
+	int logged_in[BENCH_LINES];
+	memset(logged_in, 0, sizeof (logged_in));
+	long long time = 1600000000;
+	struct utmpx rec;
+
+	for (long i = 0; i < records; i++) {
+		memset(&rec, 0, sizeof (rec));
+		time += rand_r(&seed) % 600;
+		rec.ut_tv.tv_sec = time;
+
+		int line = rand_r(&seed) % BENCH_LINES;
+		if (rand_r(&seed) % 5000 == 0) {
+			rec.ut_type = BOOT_TIME;
+			strcpy(rec.ut_line, "~");
+			strcpy(rec.ut_user, "reboot");
+			memset(logged_in, 0, sizeof (logged_in));
+		} else if (logged_in[line]) {
+			rec.ut_type = DEAD_PROCESS;
+			snprintf(rec.ut_line, sizeof (rec.ut_line), "pts/%d",
+				line);
+			logged_in[line] = 0;
+		} else {
+			rec.ut_type = USER_PROCESS;
+			snprintf(rec.ut_line, sizeof (rec.ut_line), "pts/%d",
+				line);
+			snprintf(rec.ut_user, sizeof (rec.ut_user), "user%d",
+				rand_r(&seed) % BENCH_USERS);
+			snprintf(rec.ut_host, sizeof (rec.ut_host),
+				"10.0.%d.%d", rand_r(&seed) % 256,
+				rand_r(&seed) % 256);
+			logged_in[line] = 1;
+		}
+
+		fwrite(&rec, sizeof (rec), 1, wtmp);
+	}
+
+	fclose(wtmp);
+}
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+int main(int argc, char **argv) {
+	long machines = (argc > 1 ? atol(argv[1]) : 200);
+	long records = (argc > 2 ? atol(argv[2]) : 20000);
+
+	char dir[] = "/tmp/dfinger-bench-XXXXXX";
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Could not create temporary directory\n");
+		return (EINVAL);
+	}
+
+	char **files = malloc(machines * sizeof (char *));
+	if (!files) {
+		return (ENOMEM);
+	}
+
+	for (long i = 0; i < machines; i++) {
+		files[i] = malloc(DFINGER_FILENAME_SIZE);
+		if (!files[i]) {
+			return (ENOMEM);
+		}
+		snprintf(files[i], DFINGER_FILENAME_SIZE, "host%ld=%s/wtmp.%ld",
+			i, dir, i);
+		generate(strchr(files[i], '=') + 1, records, i);
+	}
+
+	char output[DFINGER_FILENAME_SIZE];
+	snprintf(output, DFINGER_FILENAME_SIZE, "%s/dump", dir);
+
+	double start = now();
+	int ret = import_run(output, machines, files);
+	double elapsed = now() - start;
+
+	double total = (double) machines * records;
+	printf("%ld machines, %.0f records (%.1f MB) in %.3f s: "
+		"%.0f records/s, %.1f MB/s\n", machines, total,
+		total * sizeof (struct utmpx) / 1e6, elapsed, total / elapsed,
+		total * sizeof (struct utmpx) / 1e6 / elapsed);
+
+	for (long i = 0; i < machines; i++) {
+		unlink(strchr(files[i], '=') + 1);
+		free(files[i]);
+	}
+	free(files);
+	unlink(output);
+	rmdir(dir);
+
+	return (ret);
+}
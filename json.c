@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "json.h"
+
+/*
+ * Encoder of JSON objects written straight into the output buffer. Room
+ * for exactly the bytes of a member is reserved first, so nothing is
+ * allocated unless the buffer grows and a member doesn't fail while it
+ * would fit. Keys are given by the caller and aren't escaped.
+ */
+
+#define	JSON_ESCAPE_MAX 6		// Longest escape of a byte, \u00XX
+#define	JSON_NUMBER_MAX 21		// Digits and sign of long long, NUL
+
+static const char hex[] = "0123456789abcdef";
+
+static char * json_key(struct growing_buffer *out, const char *key,
+			size_t value_max);
+static size_t utf8_length(const unsigned char *str);
+static size_t escaped_length(const char *value);
+
+/*
+ * Writes separator and key, returns where value of at most value_max
+ * bytes goes or NULL if the buffer is full.
+ */
+static char * json_key(struct growing_buffer *out, const char *key,
+			size_t value_max) {
+	size_t key_len = strlen(key);
+	int comma = (out->len && out->buffer[out->len - 1] != '{');
+	char *ptr = reserve_buffer(out, comma + key_len + value_max + 3);
+	if (!ptr) {
+		return (NULL);
+	}
+
+	if (comma) {
+		*ptr++ = ',';
+	}
+	*ptr++ = '"';
+	memcpy(ptr, key, key_len);
+	ptr += key_len;
+	*ptr++ = '"';
+	*ptr++ = ':';
+
+	return (ptr);
+}
+
+/*
+ * Returns length of well-formed UTF-8 sequence starting at str, 0 if it
+ * isn't one.
+ */
+static size_t utf8_length(const unsigned char *str) {
+	size_t len;
+	unsigned char min = 0x80, max = 0xbf;	// Range of second byte
+	if (*str < 0xc2) {
+		return (0);
+	} else if (*str < 0xe0) {
+		len = 2;
+	} else if (*str < 0xf0) {
+		len = 3;
+		if (*str == 0xe0) {
+			min = 0xa0;		// Overlong
+		} else if (*str == 0xed) {
+			max = 0x9f;		// Surrogates
+		}
+	} else if (*str < 0xf5) {
+		len = 4;
+		if (*str == 0xf0) {
+			min = 0x90;		// Overlong
+		} else if (*str == 0xf4) {
+			max = 0x8f;		// Beyond U+10FFFF
+		}
+	} else {
+		return (0);
+	}
+
+	if (str[1] < min || str[1] > max) {
+		return (0);
+	}
+	for (size_t i = 2; i < len; i++) {
+		if (str[i] < 0x80 || str[i] > 0xbf) {
+			return (0);
+		}
+	}
+
+	return (len);
+}
+
+/*
+ * Returns length of value once escaped by json_string, so that only
+ * the bytes written are reserved.
+ */
+static size_t escaped_length(const char *value) {
+	size_t len = 0;
+	const unsigned char *str = (const unsigned char *) value;
+	while (*str) {
+		unsigned char c = *str;
+		size_t seq;
+		if (c >= 0x80 && (seq = utf8_length(str))) {
+			len += seq;
+			str += seq;
+			continue;
+		}
+
+		if (c == '"' || c == '\\' || c == '\n' || c == '\r' ||
+		    c == '\t') {
+			len += 2;
+		} else if (c < 0x20 || c >= 0x80) {
+			len += JSON_ESCAPE_MAX;
+		} else {
+			len++;
+		}
+		str++;
+	}
+
+	return (len);
+}
+
+void json_begin(struct growing_buffer *out) {
+	append_buffer(out, "{", 1);
+}
+
+/*
+ * Writes string member. Bytes which aren't UTF-8 (utmp doesn't promise
+ * any encoding) are taken for Latin-1, so the output is always valid.
+ */
+void json_string(struct growing_buffer *out, const char *key,
+			const char *value) {
+	char *ptr = json_key(out, key, escaped_length(value) + 2);
+	if (!ptr) {
+		return;
+	}
+
+	*ptr++ = '"';
+	const unsigned char *str = (const unsigned char *) value;
+	while (*str) {
+		unsigned char c = *str;
+		size_t len;
+		if (c >= 0x80 && (len = utf8_length(str))) {
+			memcpy(ptr, str, len);
+			ptr += len;
+			str += len;
+			continue;
+		}
+
+		if (c == '"' || c == '\\') {
+			*ptr++ = '\\';
+			*ptr++ = c;
+		} else if (c == '\n') {
+			*ptr++ = '\\';
+			*ptr++ = 'n';
+		} else if (c == '\r') {
+			*ptr++ = '\\';
+			*ptr++ = 'r';
+		} else if (c == '\t') {
+			*ptr++ = '\\';
+			*ptr++ = 't';
+		} else if (c < 0x20 || c >= 0x80) {
+			memcpy(ptr, "\\u00", 4);
+			ptr[4] = hex[c >> 4];
+			ptr[5] = hex[c & 15];
+			ptr += JSON_ESCAPE_MAX;
+		} else {
+			*ptr++ = c;
+		}
+		str++;
+	}
+	*ptr++ = '"';
+
+	out->len = ptr - out->buffer;
+}
+
+void json_number(struct growing_buffer *out, const char *key,
+			long long value) {
+	char number[JSON_NUMBER_MAX];
+	int len = snprintf(number, JSON_NUMBER_MAX, "%lld", value);
+	char *ptr = json_key(out, key, len);
+	if (!ptr) {
+		return;
+	}
+
+	memcpy(ptr, number, len);
+	out->len = ptr + len - out->buffer;
+}
+
+void json_end(struct growing_buffer *out) {
+	append_buffer(out, "}\n", 2);
+}
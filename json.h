@@ -0,0 +1,12 @@
+#ifndef __JSON_H
+#define	__JSON_H
+
+#include "utils.h"
+
+void json_begin(struct growing_buffer *out);
+void json_string(struct growing_buffer *out, const char *key,
+			const char *value);
+void json_number(struct growing_buffer *out, const char *key,
+			long long value);
+void json_end(struct growing_buffer *out);
+#endif
@@ -0,0 +1,655 @@
+#define	_GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "conf.h"
+#include "utils.h"
+
+/*
+ * Load generator. Simulates machines reporting their sessions to the
+ * server, each over its own connection announced by "!!! MACHINE", and
+ * sends finger queries at a target rate, all from one epoll loop.
+ * Prints one JSON object with ingest throughput (as counted by the
+ * server's /METRICS) and query latency percentiles.
+ */
+
+#define	LOADGEN_EVENTS 256
+#define	LOADGEN_USERS 5000
+#define	LOADGEN_SESSION_SIZE 80		// Max length of session line
+#define	LOADGEN_QUERY_SIZE 64
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_CONNECTING,
+	SLOT_IDLE,			// Machine waiting for its next update
+	SLOT_SENDING,
+	SLOT_READING,			// Query waiting for the answer
+	SLOT_DEAD
+};
+
+struct session {
+	int user;
+	int line;
+	long long login_time;
+	long long idle_time;
+};
+
+struct slot {
+	int fd;
+	enum slot_state state;
+	int is_query;
+	char *out;			// Data to send
+	size_t out_len;
+	size_t out_offset;
+	long long start;		// Query sent [us]
+	struct session *sessions;	// Sessions of machine
+	int num_sessions;
+	int announced;			// Machine sent its name
+};
+
+struct options {
+	const char *host;
+	int port;
+	int finger_port;
+	int clients;
+	int sessions_min;
+	int sessions_max;
+	double interval;		// Between updates of one machine [s]
+	double churn;			// Sessions replaced per update
+	double idle_mean;		// [s]
+	double query_rate;		// Queries per second
+	int query_concurrency;
+	int mix[3];			// Weights of all, user and host queries
+	double duration;		// [s]
+	unsigned int seed;
+};
+
+static void usage(void);
+static void parse_options(int argc, char **argv, struct options *opts);
+static long long fetch_metric(const char *name);
+static double random_unit(void);
+static long long random_idle(void);
+static void new_session(struct session *session, long long now);
+static void build_update(int idx);
+static int open_slot(int idx, struct sockaddr_storage *addr,
+			socklen_t addr_len);
+static void close_slot(int idx, enum slot_state state);
+static void start_query(int idx);
+static void handle_slot(int idx, unsigned int events);
+static void add_latency(long long usecs);
+static int cmp_latency(const void *a, const void *b);
+static long long percentile(double p);
+static int resolve(const char *host, int port, struct sockaddr_storage *addr,
+			socklen_t *addr_len);
+
+static struct options opts;
+static struct slot *slots;
+static int epoll_fd;
+static unsigned int seed;
+
+static struct sockaddr_storage update_addr, finger_addr;
+static socklen_t update_addr_len, finger_addr_len;
+
+static long long updates_sent, updates_late, lines_sent, bytes_sent;
+static long long disconnects, queries_sent, queries_dropped, query_errors;
+static long long *latencies;
+static size_t num_latencies, latencies_size;
+static int queries_running;
+
+static void usage(void) {
+	fprintf(stderr, "Usage: dfinger-loadgen [options]\n"
+		"  -h host        server address (localhost)\n"
+		"  -p port        update port (8000)\n"
+		"  -f port        finger port (8558)\n"
+		"  -c clients     simulated machines (1000)\n"
+		"  -s min:max     sessions per machine (1:20)\n"
+		"  -u seconds     interval between updates of machine (10)\n"
+		"  -r fraction    sessions replaced by new ones per update (0.05)\n"
+		"  -i seconds     mean idle time, exponential (300)\n"
+		"  -q rate        finger queries per second (100)\n"
+		"  -Q number      max concurrent finger queries (64)\n"
+		"  -m a:u:h       weights of all, user and host queries (1:8:1)\n"
+		"  -d seconds     duration of the run (30)\n"
+		"  -S seed        random seed (1)\n");
+	exit(EINVAL);
+}
+
+static void parse_options(int argc, char **argv, struct options *opts) {
+	opts->host = "localhost";
+	opts->port = 8000;
+	opts->finger_port = 8558;
+	opts->clients = 1000;
+	opts->sessions_min = 1;
+	opts->sessions_max = 20;
+	opts->interval = 10;
+	opts->churn = 0.05;
+	opts->idle_mean = 300;
+	opts->query_rate = 100;
+	opts->query_concurrency = 64;
+	opts->mix[0] = 1;
+	opts->mix[1] = 8;
+	opts->mix[2] = 1;
+	opts->duration = 30;
+	opts->seed = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "h:p:f:c:s:u:r:i:q:Q:m:d:S:")) != -1) {
+		switch (opt) {
+			case 'h':
+				opts->host = optarg;
+				break;
+			case 'p':
+				opts->port = atoi(optarg);
+				break;
+			case 'f':
+				opts->finger_port = atoi(optarg);
+				break;
+			case 'c':
+				opts->clients = atoi(optarg);
+				break;
+			case 's':
+				if (sscanf(optarg, "%d:%d", &opts->sessions_min,
+				    &opts->sessions_max) != 2) {
+					usage();
+				}
+				break;
+			case 'u':
+				opts->interval = atof(optarg);
+				break;
+			case 'r':
+				opts->churn = atof(optarg);
+				break;
+			case 'i':
+				opts->idle_mean = atof(optarg);
+				break;
+			case 'q':
+				opts->query_rate = atof(optarg);
+				break;
+			case 'Q':
+				opts->query_concurrency = atoi(optarg);
+				break;
+			case 'm':
+				if (sscanf(optarg, "%d:%d:%d", &opts->mix[0],
+				    &opts->mix[1], &opts->mix[2]) != 3) {
+					usage();
+				}
+				break;
+			case 'd':
+				opts->duration = atof(optarg);
+				break;
+			case 'S':
+				opts->seed = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (opts->clients < 0 || opts->sessions_min < 0 ||
+	    opts->sessions_max < opts->sessions_min || opts->interval <= 0 ||
+	    opts->query_concurrency < 1 || opts->duration <= 0 ||
+	    opts->mix[0] + opts->mix[1] + opts->mix[2] <= 0) {
+		usage();
+	}
+}
+
+/*
+ * Reads counter from the server's /METRICS answer, -1 if not found.
+ */
+static long long fetch_metric(const char *name) {
+	int sock = connect_host(opts.host, opts.finger_port);
+	if (sock < 0) {
+		return (-1);
+	}
+
+	char query[] = "/METRICS\r\n";
+	flush(sock, query, strlen(query));
+
+	struct growing_buffer answer;
+	init_buffer(&answer, DFINGER_METRICS_BUFFER_SIZE);
+	char buffer[DFINGER_BUFFER_SIZE];
+	ssize_t num_read;
+	while ((num_read = read(sock, buffer, DFINGER_BUFFER_SIZE)) > 0) {
+		append_buffer(&answer, buffer, num_read);
+	}
+	close(sock);
+	append_buffer(&answer, "", 1);
+
+	long long value = -1;
+	size_t len = strlen(name);
+	char *line = answer.buffer;
+	while (line && answer.len) {
+		if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+			value = atoll(line + len + 1);
+			break;
+		}
+		line = strchr(line, '\n');
+		if (line) {
+			line++;
+		}
+	}
+	free_buffer(&answer);
+
+	return (value);
+}
+
+static double random_unit(void) {
+	return ((rand_r(&seed) + 0.5) / ((double) RAND_MAX + 1));
+}
+
+static long long random_idle(void) {
+	return ((long long) (-log(random_unit()) * opts.idle_mean));
+}
+
+static void new_session(struct session *session, long long now) {
+	session->user = rand_r(&seed) % LOADGEN_USERS;
+	session->line = rand_r(&seed) % 1000;
+	session->login_time = now;
+	session->idle_time = random_idle();
+}
+
+/*
+ * Replaces part of machine's sessions, draws new idle times and
+ * formats the update the way client_run() does.
+ */
+static void build_update(int idx) {
+	struct slot *slot = &slots[idx];
+	long long now = cur_secs();
+
+	for (int i = 0; i < slot->num_sessions; i++) {
+		if (random_unit() < opts.churn) {
+			new_session(&slot->sessions[i], now);
+		} else {
+			slot->sessions[i].idle_time = random_idle();
+		}
+	}
+
+	size_t len = 0;
+	if (!slot->announced) {
+		len += snprintf(slot->out, DFINGER_HOST_SIZE,
+				"!!! MACHINE loadgen%d\n", idx);
+		slot->announced = 1;
+	}
+	len += snprintf(slot->out + len, DFINGER_LINE_SIZE, "!!! UPDATE\n");
+	for (int i = 0; i < slot->num_sessions; i++) {
+		struct session *session = &slot->sessions[i];
+		len += snprintf(slot->out + len, LOADGEN_SESSION_SIZE,
+				"user%d pts/%d %lld %lld 10.%d.%d.%d \n",
+				session->user, session->line,
+				session->login_time, session->idle_time,
+				idx >> 16 & 255, idx >> 8 & 255, idx & 255);
+	}
+	slot->out[len++] = '\n';
+
+	slot->out_len = len;
+	slot->out_offset = 0;
+	lines_sent += slot->num_sessions + 2;
+}
+
+static int open_slot(int idx, struct sockaddr_storage *addr,
+			socklen_t addr_len) {
+	struct slot *slot = &slots[idx];
+	slot->fd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (slot->fd < 0) {
+		slot->state = SLOT_DEAD;
+		return (1);
+	}
+
+	if (connect(slot->fd, (struct sockaddr *) addr, addr_len) != 0 &&
+	    errno != EINPROGRESS) {
+		close(slot->fd);
+		slot->state = SLOT_DEAD;
+		return (1);
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof (event));
+	event.events = EPOLLOUT;
+	event.data.u32 = idx;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, slot->fd, &event);
+	slot->state = SLOT_CONNECTING;
+
+	return (0);
+}
+
+static void close_slot(int idx, enum slot_state state) {
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, slots[idx].fd, NULL);
+	close(slots[idx].fd);
+	slots[idx].state = state;
+}
+
+static void start_query(int idx) {
+	struct slot *slot = &slots[idx];
+	int kind = rand_r(&seed) % (opts.mix[0] + opts.mix[1] + opts.mix[2]);
+
+	if (kind < opts.mix[0]) {
+		slot->out_len = snprintf(slot->out, LOADGEN_QUERY_SIZE, "\r\n");
+	} else if (kind < opts.mix[0] + opts.mix[1]) {
+		slot->out_len = snprintf(slot->out, LOADGEN_QUERY_SIZE,
+					"user%d\r\n",
+					rand_r(&seed) % LOADGEN_USERS);
+	} else {
+		slot->out_len = snprintf(slot->out, LOADGEN_QUERY_SIZE,
+					"@loadgen%d\r\n", (opts.clients ?
+					rand_r(&seed) % opts.clients : 0));
+	}
+	slot->out_offset = 0;
+	slot->start = cur_usecs();
+	queries_sent++;
+	queries_running++;
+
+	if (open_slot(idx, &finger_addr, finger_addr_len) != 0) {
+		query_errors++;
+		queries_running--;
+		slot->state = SLOT_FREE;
+	}
+}
+
+static void handle_slot(int idx, unsigned int events) {
+	struct slot *slot = &slots[idx];
+	struct epoll_event event;
+	memset(&event, 0, sizeof (event));
+	event.data.u32 = idx;
+
+	if (events & EPOLLERR ||
+	    (!slot->is_query && events & (EPOLLHUP | EPOLLRDHUP))) {
+		if (slot->is_query) {
+			query_errors++;
+			queries_running--;
+			close_slot(idx, SLOT_FREE);
+		} else {
+			disconnects++;
+			close_slot(idx, SLOT_DEAD);
+		}
+		return;
+	}
+
+	if (slot->state == SLOT_CONNECTING) {
+		slot->state = (slot->is_query ? SLOT_SENDING : SLOT_IDLE);
+		if (slot->state == SLOT_IDLE) {
+			event.events = EPOLLRDHUP;
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, slot->fd, &event);
+			return;
+		}
+	}
+
+	if (slot->state == SLOT_SENDING && events & EPOLLOUT) {
+		ssize_t num_written = write(slot->fd,
+					slot->out + slot->out_offset,
+					slot->out_len - slot->out_offset);
+		if (num_written < 0) {
+			if (errno != EAGAIN) {
+				handle_slot(idx, EPOLLERR);
+			}
+			return;
+		}
+
+		slot->out_offset += num_written;
+		if (!slot->is_query) {
+			bytes_sent += num_written;
+		}
+		if (slot->out_offset < slot->out_len) {
+			return;
+		}
+
+		if (slot->is_query) {
+			slot->state = SLOT_READING;
+			event.events = EPOLLIN;
+		} else {
+			slot->state = SLOT_IDLE;
+			updates_sent++;
+			event.events = EPOLLRDHUP;
+		}
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, slot->fd, &event);
+		return;
+	}
+
+	if (slot->state == SLOT_READING && events & (EPOLLIN | EPOLLHUP)) {
+		char buffer[DFINGER_BUFFER_SIZE];
+		ssize_t num_read;
+		while ((num_read = read(slot->fd, buffer,
+					DFINGER_BUFFER_SIZE)) > 0) {
+		}
+
+		if (num_read == 0) {
+			add_latency(cur_usecs() - slot->start);
+			queries_running--;
+			close_slot(idx, SLOT_FREE);
+		} else if (errno != EAGAIN) {
+			handle_slot(idx, EPOLLERR);
+		}
+	}
+}
+
+static void add_latency(long long usecs) {
+	if (num_latencies == latencies_size) {
+		latencies_size = (latencies_size ? latencies_size * 2 : 1024);
+		latencies = realloc(latencies,
+				latencies_size * sizeof (long long));
+		if (!latencies) {
+			exit(ENOMEM);
+		}
+	}
+
+	latencies[num_latencies++] = usecs;
+}
+
+static int cmp_latency(const void *a, const void *b) {
+	long long x = *(const long long *) a;
+	long long y = *(const long long *) b;
+
+	return ((x > y) - (x < y));
+}
+
+static long long percentile(double p) {
+	if (!num_latencies) {
+		return (-1);
+	}
+
+	size_t i = (size_t) ceil(p * num_latencies);
+	if (i > 0) {
+		i--;
+	}
+
+	return (latencies[i]);
+}
+
+static int resolve(const char *host, int port, struct sockaddr_storage *addr,
+			socklen_t *addr_len) {
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	char portstr[PORT_SIZE];
+	snprintf(portstr, PORT_SIZE, "%d", port);
+	if (getaddrinfo(host, portstr, &hints, &res) != 0) {
+		return (1);
+	}
+
+	memcpy(addr, res->ai_addr, res->ai_addrlen);
+	*addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return (0);
+}
+
+int main(int argc, char **argv) {
+	parse_options(argc, argv, &opts);
+	seed = opts.seed;
+
+	if (resolve(opts.host, opts.port, &update_addr, &update_addr_len) ||
+	    resolve(opts.host, opts.finger_port, &finger_addr,
+	    &finger_addr_len)) {
+		fprintf(stderr, "Could not resolve %s\n", opts.host);
+		return (EINVAL);
+	}
+
+	// Every machine and query needs its descriptor
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	int num_slots = opts.clients + opts.query_concurrency;
+	slots = calloc(num_slots, sizeof (struct slot));
+	epoll_fd = epoll_create1(0);
+	if (!slots || epoll_fd < 0) {
+		return (ENOMEM);
+	}
+
+	long long now = cur_secs();
+	size_t update_size = DFINGER_HOST_SIZE + DFINGER_LINE_SIZE +
+				opts.sessions_max * LOADGEN_SESSION_SIZE;
+	for (int i = 0; i < opts.clients; i++) {
+		struct slot *slot = &slots[i];
+		slot->num_sessions = opts.sessions_min + rand_r(&seed) %
+				(opts.sessions_max - opts.sessions_min + 1);
+		slot->sessions = calloc(opts.sessions_max + 1,
+					sizeof (struct session));
+		slot->out = malloc(update_size);
+		if (!slot->sessions || !slot->out) {
+			return (ENOMEM);
+		}
+		for (int j = 0; j < slot->num_sessions; j++) {
+			new_session(&slot->sessions[j], now -
+				rand_r(&seed) % 86400);
+		}
+		if (open_slot(i, &update_addr, update_addr_len) != 0) {
+			disconnects++;
+		}
+	}
+	for (int i = opts.clients; i < num_slots; i++) {
+		slots[i].is_query = 1;
+		slots[i].out = malloc(LOADGEN_QUERY_SIZE);
+		if (!slots[i].out) {
+			return (ENOMEM);
+		}
+	}
+
+	long long lines_before = fetch_metric("dfinger_ingest_lines_total");
+	long long bytes_before = fetch_metric("dfinger_ingest_bytes_total");
+	long long calls_before = fetch_metric("dfinger_io_syscalls_total");
+
+	// Machines update in fixed order spread over the interval
+	long long start = cur_usecs();
+	long long end = start + (long long) (opts.duration * 1e6);
+	long long update_step = (opts.clients ? (long long) (opts.interval *
+				1e6 / opts.clients) : 0);
+	long long next_update = start;
+	int next_machine = 0;
+	long long query_step = (opts.query_rate > 0 ?
+				(long long) (1e6 / opts.query_rate) : 0);
+	long long next_query = start;
+	struct epoll_event events[LOADGEN_EVENTS];
+
+	while ((now = cur_usecs()) < end) {
+		while (opts.clients && next_update <= now) {
+			struct slot *slot = &slots[next_machine];
+			if (slot->state == SLOT_IDLE) {
+				build_update(next_machine);
+				slot->state = SLOT_SENDING;
+				struct epoll_event event;
+				memset(&event, 0, sizeof (event));
+				event.events = EPOLLOUT | EPOLLRDHUP;
+				event.data.u32 = next_machine;
+				epoll_ctl(epoll_fd, EPOLL_CTL_MOD, slot->fd,
+					&event);
+			} else if (slot->state != SLOT_DEAD) {
+				updates_late++;
+			}
+			next_machine = (next_machine + 1) % opts.clients;
+			next_update += update_step;
+		}
+
+		while (query_step && next_query <= now) {
+			next_query += query_step;
+			if (queries_running >= opts.query_concurrency) {
+				queries_dropped++;
+				continue;
+			}
+			for (int i = opts.clients; i < num_slots; i++) {
+				if (slots[i].state == SLOT_FREE) {
+					start_query(i);
+					break;
+				}
+			}
+		}
+
+		long long wake = end;
+		if (opts.clients && next_update < wake) {
+			wake = next_update;
+		}
+		if (query_step && next_query < wake) {
+			wake = next_query;
+		}
+		int timeout = (wake - now + 999) / 1000;
+		int ready = epoll_wait(epoll_fd, events, LOADGEN_EVENTS,
+					timeout);
+		for (int i = 0; i < ready; i++) {
+			handle_slot(events[i].data.u32, events[i].events);
+		}
+	}
+
+	double elapsed = (cur_usecs() - start) / 1e6;
+	long long lines_after = fetch_metric("dfinger_ingest_lines_total");
+	long long bytes_after = fetch_metric("dfinger_ingest_bytes_total");
+	long long calls_after = fetch_metric("dfinger_io_syscalls_total");
+	int uring = (fetch_metric("dfinger_io_backend{backend=\"uring\"}") == 1);
+	long long server_lines = (lines_before >= 0 && lines_after >= 0 ?
+				lines_after - lines_before : -1);
+	long long server_bytes = (bytes_before >= 0 && bytes_after >= 0 ?
+				bytes_after - bytes_before : -1);
+	// Includes the calls answering /METRICS before the run
+	long long server_calls = (calls_before >= 0 && calls_after >= 0 ?
+				calls_after - calls_before : -1);
+
+	qsort(latencies, num_latencies, sizeof (long long), cmp_latency);
+
+	printf("{\"clients\":%d,\"duration\":%.3f,"
+		"\"updates_sent\":%lld,\"updates_late\":%lld,"
+		"\"lines_sent\":%lld,\"bytes_sent\":%lld,\"disconnects\":%lld,"
+		"\"server_lines\":%lld,\"server_bytes\":%lld,"
+		"\"server_lines_per_sec\":%.1f,\"server_bytes_per_sec\":%.1f,"
+		"\"server_backend\":\"%s\",\"server_syscalls\":%lld,"
+		"\"server_syscalls_per_update\":%.3f,"
+		"\"queries\":%lld,\"queries_answered\":%zu,"
+		"\"queries_dropped\":%lld,\"query_errors\":%lld,\"queries_per_sec\":%.1f,"
+		"\"latency_us\":{\"p50\":%lld,\"p99\":%lld,\"p999\":%lld,"
+		"\"max\":%lld}}\n",
+		opts.clients, elapsed, updates_sent, updates_late, lines_sent,
+		bytes_sent, disconnects, server_lines, server_bytes,
+		(server_lines >= 0 ? server_lines / elapsed : -1),
+		(server_bytes >= 0 ? server_bytes / elapsed : -1),
+		(uring ? "uring" : "poll"), server_calls,
+		(server_calls >= 0 && updates_sent ?
+		(double) server_calls / updates_sent : -1),
+		queries_sent, num_latencies, queries_dropped, query_errors,
+		num_latencies / elapsed, percentile(0.5), percentile(0.99),
+		percentile(0.999), (num_latencies ?
+		latencies[num_latencies - 1] : -1));
+
+	for (int i = 0; i < num_slots; i++) {
+		if (slots[i].state != SLOT_FREE &&
+		    slots[i].state != SLOT_DEAD) {
+			close(slots[i].fd);
+		}
+		free(slots[i].sessions);
+		free(slots[i].out);
+	}
+	free(slots);
+	free(latencies);
+	close(epoll_fd);
+
+	return (0);
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "conf.h"
+
+static void metrics_line(struct growing_buffer *out, const char *name,
+			const char *labels, const char *format, double value);
+
+/*
+ * Metrics are printed in Prometheus text format. Server is single
+ * threaded, so the counters are plain integers and observing a duration
+ * is just finding its power of two.
+ */
+
+// Sample without labels has no braces
+static void metrics_line(struct growing_buffer *out, const char *name,
+			const char *labels, const char *format, double value) {
+	char line[DFINGER_LINE_SIZE];
+	int len = snprintf(line, DFINGER_LINE_SIZE, (*labels ? "%s{%s} " :
+				"%s%s "), name, labels);
+	len += snprintf(line + len, DFINGER_LINE_SIZE - len, format, value);
+	line[len++] = '\n';
+	append_buffer(out, line, len);
+}
+
+void histogram_observe(struct histogram *histogram, long long usecs) {
+	if (usecs < 0) {
+		usecs = 0;
+	}
+
+	int bucket = 0;
+	if (usecs) {
+		bucket = 64 - __builtin_clzll((unsigned long long) usecs);
+	}
+	if (bucket >= METRICS_BUCKETS) {
+		bucket = METRICS_BUCKETS - 1;
+	}
+
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->sum += usecs;
+}
+
+void metrics_histogram(struct growing_buffer *out, const char *name,
+			const char *labels, struct histogram *histogram) {
+	char line[DFINGER_LINE_SIZE];
+	const char *sep = (*labels ? "," : "");
+	unsigned long long cumulative = 0;
+	int len;
+
+	for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+		cumulative += histogram->buckets[i];
+		len = snprintf(line, DFINGER_LINE_SIZE,
+				"%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels,
+				sep, (double) (1ULL << i) / 1e6, cumulative);
+		append_buffer(out, line, len);
+	}
+
+	len = snprintf(line, DFINGER_LINE_SIZE,
+			"%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+			histogram->count);
+	append_buffer(out, line, len);
+
+	snprintf(line, DFINGER_LINE_SIZE, "%s_sum", name);
+	metrics_line(out, line, labels, "%.6f", histogram->sum / 1e6);
+	snprintf(line, DFINGER_LINE_SIZE, "%s_count", name);
+	metrics_line(out, line, labels, "%.0f", (double) histogram->count);
+}
+
+void metrics_value(struct growing_buffer *out, const char *name,
+			const char *labels, long long value) {
+	metrics_line(out, name, labels, "%.0f", (double) value);
+}
+
+void metrics_type(struct growing_buffer *out, const char *name,
+			const char *type, const char *help) {
+	char line[DFINGER_LINE_SIZE];
+	int len = snprintf(line, DFINGER_LINE_SIZE,
+				"# HELP %s %s\n# TYPE %s %s\n", name, help, name,
+				type);
+	append_buffer(out, line, len);
+}
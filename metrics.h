@@ -0,0 +1,25 @@
+#ifndef __METRICS_H
+#define	__METRICS_H
+
+#include "utils.h"
+
+#define	METRICS_BUCKETS 26		// Powers of two from 1 us to 16 s
+
+/*
+ * Histogram of durations with fixed buckets, bucket i counts durations
+ * of less than 2^i microseconds.
+ */
+struct histogram {
+	unsigned long long buckets[METRICS_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;		// [us]
+};
+
+void histogram_observe(struct histogram *histogram, long long usecs);
+void metrics_histogram(struct growing_buffer *out, const char *name,
+			const char *labels, struct histogram *histogram);
+void metrics_value(struct growing_buffer *out, const char *name,
+			const char *labels, long long value);
+void metrics_type(struct growing_buffer *out, const char *name,
+			const char *type, const char *help);
+#endif
@@ -0,0 +1,286 @@
+#define	_XOPEN_SOURCE 600
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "relay.h"
+#include "conf.h"
+#include "utils.h"
+
+/*
+ * Relay accepts updates of clients of one rack or site and forwards them
+ * to the server over single connection. Each complete update is prefixed
+ * by "!!! MACHINE hostname" line so the server knows which machine
+ * the records belong to. Updates are collected in one output buffer and
+ * sent together once in conf->relay_batch milliseconds.
+ */
+
+struct relay_client {
+	char hostname[UT_HOSTSIZE];
+	char buffer[DFINGER_BUFFER_SIZE];	// Input buffer
+	size_t offset;				// Current offset in input
+						// buffer
+	struct growing_buffer update;		// Update being received
+};
+
+static void queue_update(struct relay_client *client);
+static void queue_bye(struct relay_client *client);
+static void process_line(struct relay_client *client, char *line);
+static ssize_t read_update(int fd, struct relay_client *client);
+
+static void accept_client(void);
+static void free_client(int idx);
+
+static void connect_upstream(void);
+static void flush_upstream(void);
+
+static struct relay_client *clients;
+static struct pollfd *socks;
+static int clients_size;
+static int clients_used;
+
+static struct growing_buffer upstream;
+static long long next_flush;
+
+extern struct conf *conf;
+
+// First two slots are listening socket and upstream connection
+#define	RELAY_LISTEN 0
+#define	RELAY_UPSTREAM 1
+
+static void queue_update(struct relay_client *client) {
+	if (upstream.len + client->update.len + UT_HOSTSIZE + 16 >
+	    upstream.max_size) {
+		flush_upstream();
+	}
+
+	char tag[UT_HOSTSIZE + 16];
+	int len = snprintf(tag, sizeof (tag), "!!! MACHINE %s\n",
+				client->hostname);
+	append_buffer(&upstream, tag, len);
+	append_buffer(&upstream, client->update.buffer, client->update.len);
+	append_buffer(&upstream, "\n", 1);
+	client->update.len = 0;
+
+	if (!next_flush) {
+		next_flush = cur_msecs() + conf->relay_batch;
+	}
+}
+
+static void queue_bye(struct relay_client *client) {
+	client->update.len = 0;
+	append_buffer(&client->update, "!!! BYE\n", 8);
+	queue_update(client);
+}
+
+static void process_line(struct relay_client *client, char *line) {
+	if (strncmp(line, "!!! UPDATE", 10) == 0) {
+		client->update.len = 0;
+		return;
+	}
+
+	if (strncmp(line, "!!! BYE", 7) == 0) {
+		queue_bye(client);
+		return;
+	}
+
+	if (strncmp(line, "!!! MACHINE", 11) == 0) {
+		// Clients may not pretend to be other machines
+		return;
+	}
+
+	append_buffer(&client->update, line, strlen(line));
+	append_buffer(&client->update, "\n", 1);
+}
+
+static ssize_t read_update(int fd, struct relay_client *client) {
+	ssize_t num_read = read(fd, client->buffer + client->offset,
+				DFINGER_BUFFER_SIZE - client->offset - 1);
+	if (num_read <= 0) {
+		return (num_read);
+	}
+	size_t buf_len = client->offset + num_read;
+	client->buffer[buf_len] = 0;
+	client->offset = 0;
+
+	int ret;
+	char line[DFINGER_LINE_SIZE];
+	size_t line_len = DFINGER_LINE_SIZE - 1;
+
+	while ((ret = fetch_line(client->buffer, buf_len, &(client->offset),
+				line, line_len)) != RTL_WANT_MORE) {
+		switch (ret) {
+			case RTL_LINE_FETCHED:
+				process_line(client, line);
+				break;
+			case RTL_BLANK_LINE:
+				queue_update(client);
+				break;
+			default:
+				// Malformed line is skipped
+				break;
+		}
+	}
+
+	move_buffer(client->buffer, buf_len, &client->offset);
+
+	return (num_read);
+}
+
+static void accept_client(void) {
+	int fd = accept(socks[RELAY_LISTEN].fd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+
+	if (clients_size == clients_used) {
+		if (clients_size >= conf->max_clients) {
+			fprintf(stderr, "Refusing connection\n");
+			close(fd);
+			return;
+		}
+
+		clients_size = (clients_size * 2 < conf->max_clients ?
+				clients_size * 2 : conf->max_clients);
+		clients = realloc(clients,
+				clients_size * sizeof (struct relay_client));
+		socks = realloc(socks, clients_size * sizeof (struct pollfd));
+		if (!clients || !socks) {
+			exit(ENOMEM);
+		}
+	}
+
+	int idx = clients_used++;
+	struct relay_client *client = &clients[idx];
+	memset(client, 0, sizeof (struct relay_client));
+	peer_hostname(fd, client->hostname, sizeof (client->hostname));
+	init_buffer(&client->update, DFINGER_RELAY_BUFFER_SIZE);
+
+	socks[idx].fd = fd;
+	socks[idx].events = POLLIN;
+	socks[idx].revents = 0;
+}
+
+static void free_client(int idx) {
+	queue_bye(&clients[idx]);
+	free_buffer(&clients[idx].update);
+	close(socks[idx].fd);
+	clients_used--;
+
+	if (idx == clients_used) {
+		return;
+	}
+
+	memcpy(&clients[idx], &clients[clients_used],
+		sizeof (struct relay_client));
+	socks[idx] = socks[clients_used];
+}
+
+static void connect_upstream(void) {
+	char hoststr[DFINGER_HOST_SIZE];
+	if (conf->host_addr) {
+		snprintf(hoststr, DFINGER_HOST_SIZE, "%s", conf->host_addr);
+	} else {
+		snprintf(hoststr, DFINGER_HOST_SIZE, "%s", "localhost");
+	}
+
+	socks[RELAY_UPSTREAM].fd = connect_host(hoststr, conf->port);
+	socks[RELAY_UPSTREAM].events = POLLIN;
+	if (socks[RELAY_UPSTREAM].fd < 0) {
+		fprintf(stderr, "Could not connect to server\n");
+	}
+}
+
+static void flush_upstream(void) {
+	next_flush = 0;
+	if (!upstream.len) {
+		return;
+	}
+
+	if (socks[RELAY_UPSTREAM].fd < 0) {
+		connect_upstream();
+	}
+
+	if (socks[RELAY_UPSTREAM].fd < 0 ||
+	    flush(socks[RELAY_UPSTREAM].fd, upstream.buffer,
+		upstream.len) != 0) {
+		// Clients send complete state with every update so nothing
+		// is lost for good by dropping this batch
+		fprintf(stderr, "Dropping %zu bytes of updates\n",
+			upstream.len);
+		if (socks[RELAY_UPSTREAM].fd >= 0) {
+			close(socks[RELAY_UPSTREAM].fd);
+			socks[RELAY_UPSTREAM].fd = -1;
+		}
+	}
+
+	upstream.len = 0;
+}
+
+void relay_run(void) {
+	clients_size = 2;
+	clients_used = 2;
+	clients = malloc(clients_size * sizeof (struct relay_client));
+	socks = malloc(clients_size * sizeof (struct pollfd));
+	if (!clients || !socks) {
+		exit(ENOMEM);
+	}
+	memset(socks, 0, clients_size * sizeof (struct pollfd));
+	signal(SIGPIPE, SIG_IGN);
+
+	// The buffer gets flushed once it holds DFINGER_RELAY_BUFFER_SIZE
+	// bytes, the rest is a reserve for the update being appended
+	init_buffer(&upstream, DFINGER_RELAY_BUFFER_SIZE * 2);
+
+	socks[RELAY_LISTEN].fd = bind_sock(conf->relay_port);
+	socks[RELAY_LISTEN].events = POLLIN;
+	listen(socks[RELAY_LISTEN].fd, conf->max_clients);
+
+	connect_upstream();
+
+	while (1) {
+		int timeout = -1;
+		if (next_flush) {
+			timeout = next_flush - cur_msecs();
+			if (timeout < 0) {
+				timeout = 0;
+			}
+		}
+
+		if (poll(socks, clients_used, timeout) < 0 && errno != EINTR) {
+			fprintf(stderr, "Poll failed\n");
+			exit(EINVAL);
+		}
+
+		if (socks[RELAY_UPSTREAM].fd >= 0 &&
+		    socks[RELAY_UPSTREAM].revents & (POLLIN | POLLHUP)) {
+			// Server never talks to clients, so this is a hangup
+			close(socks[RELAY_UPSTREAM].fd);
+			socks[RELAY_UPSTREAM].fd = -1;
+		}
+
+		for (int i = 2; i < clients_used; i++) {
+			if (socks[i].revents & (POLLIN | POLLHUP)) {
+				if (read_update(socks[i].fd, &clients[i]) <= 0) {
+					free_client(i);
+					i--;
+				}
+			}
+		}
+
+		if (socks[RELAY_LISTEN].revents & POLLIN) {
+			accept_client();
+		}
+
+		if (upstream.len >= DFINGER_RELAY_BUFFER_SIZE ||
+		    (next_flush && cur_msecs() >= next_flush)) {
+			flush_upstream();
+		}
+	}
+}
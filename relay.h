@@ -0,0 +1,5 @@
+#ifndef __RELAY_H
+#define	__RELAY_H
+
+void relay_run(void);
+#endif
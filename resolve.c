@@ -0,0 +1,187 @@
+#define	_GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <netdb.h>
+
+#include "resolve.h"
+#include "conf.h"
+#include "utils.h"
+
+/*
+ * Asynchronous name resolution, so that the server never waits for DNS
+ * while other clients are waiting for it. Recently resolved addresses
+ * are kept in a small cache, frequently queried hosts are then
+ * connected to right away.
+ */
+
+struct resolve {
+	struct gaicb cb;
+	struct addrinfo hints;
+	char host[DFINGER_HOST_SIZE];
+	char service[PORT_SIZE];
+	int port;
+	int cached;			// Answered from cache
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	struct resolve *next;		// In list of abandoned requests
+};
+
+struct cache_entry {
+	char host[DFINGER_HOST_SIZE];
+	int port;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	long long expires;
+	long long last_used;
+};
+
+static struct cache_entry * cache_find(const char *host, int port);
+static void cache_store(struct resolve *req);
+static void reap_abandoned(void);
+
+static struct cache_entry cache[RESOLVE_CACHE_SIZE];
+static struct resolve *abandoned;	// Requests glibc still works on
+
+static struct cache_entry * cache_find(const char *host, int port) {
+	long long now = cur_secs();
+
+	for (int i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+		if (cache[i].port == port && cache[i].expires > now &&
+		    strcmp(cache[i].host, host) == 0) {
+			cache[i].last_used = now;
+			return (&cache[i]);
+		}
+	}
+
+	return (NULL);
+}
+
+static void cache_store(struct resolve *req) {
+	struct cache_entry *entry = &cache[0];
+
+	for (int i = 0; i < RESOLVE_CACHE_SIZE; i++) {
+		if (cache[i].port == req->port &&
+		    strcmp(cache[i].host, req->host) == 0) {
+			entry = &cache[i];
+			break;
+		}
+
+		if (cache[i].last_used < entry->last_used) {
+			entry = &cache[i];
+		}
+	}
+
+	snprintf(entry->host, DFINGER_HOST_SIZE, "%s", req->host);
+	entry->port = req->port;
+	memcpy(&entry->addr, &req->addr, req->addr_len);
+	entry->addr_len = req->addr_len;
+	entry->last_used = cur_secs();
+	entry->expires = entry->last_used + RESOLVE_CACHE_TTL;
+}
+
+static void reap_abandoned(void) {
+	struct resolve **req = &abandoned;
+
+	while (*req) {
+		if (gai_error(&(*req)->cb) == EAI_INPROGRESS) {
+			req = &(*req)->next;
+			continue;
+		}
+
+		struct resolve *done = *req;
+		*req = done->next;
+		if (done->cb.ar_result) {
+			freeaddrinfo(done->cb.ar_result);
+		}
+		free(done);
+	}
+}
+
+/*
+ * Starts resolving host, returns NULL if resolution can't be started.
+ */
+struct resolve * resolve_start(const char *host, int port) {
+	reap_abandoned();
+
+	struct resolve *req = malloc(sizeof (struct resolve));
+	if (!req) {
+		exit(ENOMEM);
+	}
+	memset(req, 0, sizeof (struct resolve));
+	snprintf(req->host, DFINGER_HOST_SIZE, "%s", host);
+	snprintf(req->service, PORT_SIZE, "%d", port);
+	req->port = port;
+
+	struct cache_entry *entry = cache_find(host, port);
+	if (entry) {
+		memcpy(&req->addr, &entry->addr, entry->addr_len);
+		req->addr_len = entry->addr_len;
+		req->cached = 1;
+		return (req);
+	}
+
+	req->hints.ai_family = AF_UNSPEC;
+	req->hints.ai_socktype = SOCK_STREAM;
+	req->cb.ar_name = req->host;
+	req->cb.ar_service = req->service;
+	req->cb.ar_request = &req->hints;
+
+	struct gaicb *list[1] = { &req->cb };
+	if (getaddrinfo_a(GAI_NOWAIT, list, 1, NULL) != 0) {
+		free(req);
+		return (NULL);
+	}
+
+	return (req);
+}
+
+/*
+ * Returns 1 and fills addr once host is resolved, 0 while resolution
+ * is in progress and -1 if it failed.
+ */
+int resolve_done(struct resolve *req, struct sockaddr_storage *addr,
+		socklen_t *addr_len) {
+	if (!req->cached) {
+		int ret = gai_error(&req->cb);
+		if (ret == EAI_INPROGRESS) {
+			return (0);
+		}
+		if (ret != 0 || !req->cb.ar_result) {
+			return (-1);
+		}
+
+		memcpy(&req->addr, req->cb.ar_result->ai_addr,
+			req->cb.ar_result->ai_addrlen);
+		req->addr_len = req->cb.ar_result->ai_addrlen;
+		freeaddrinfo(req->cb.ar_result);
+		req->cb.ar_result = NULL;
+		req->cached = 1;
+		cache_store(req);
+	}
+
+	memcpy(addr, &req->addr, req->addr_len);
+	*addr_len = req->addr_len;
+
+	return (1);
+}
+
+/*
+ * Frees the request, cancelling it if it's still in progress.
+ */
+void resolve_cancel(struct resolve *req) {
+	if (!req->cached && gai_error(&req->cb) == EAI_INPROGRESS &&
+	    gai_cancel(&req->cb) != EAI_CANCELED) {
+		// Can't be freed before glibc is done with it
+		req->next = abandoned;
+		abandoned = req;
+		return;
+	}
+
+	if (req->cb.ar_result) {
+		freeaddrinfo(req->cb.ar_result);
+	}
+	free(req);
+}
@@ -0,0 +1,15 @@
+#ifndef __RESOLVE_H
+#define	__RESOLVE_H
+
+#include <sys/socket.h>
+
+#define	RESOLVE_CACHE_SIZE 32
+#define	RESOLVE_CACHE_TTL (5 * 60)	// [s]
+
+struct resolve;
+
+struct resolve * resolve_start(const char *host, int port);
+int resolve_done(struct resolve *req, struct sockaddr_storage *addr,
+		socklen_t *addr_len);
+void resolve_cancel(struct resolve *req);
+#endif
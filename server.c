@@ -1,22 +1,38 @@
 #include "server.h"
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <signal.h>
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <pwd.h>
+#include <time.h>
 #include <errno.h>
+#include <fnmatch.h>
 
 #include "utils.h"
+#include "shard.h"
+#include "resolve.h"
+#include "history.h"
+#include "metrics.h"
+#include "trace.h"
+#include "slowlog.h"
+#include "uring.h"
+#include "json.h"
+#include "hll.h"
 
 struct user {
 	char username[UT_NAMESIZE];
 	long long least_idle;
 	struct login_data *logins;
 	struct login_data *past_logins;
+	struct history history;
 	struct user *next;
 	char *fullname;			// Full name as parsed from pw_gecos
 	char *add_info;			// Additional info from pw_gecos
+	long long dump_mark;		// Last dump segment listing the user
+	int active;			// Current logins
 };
 
 struct machine {
@@ -25,28 +41,108 @@ struct machine {
 	int connection_id;		// Index in connections (& socks) array
 	struct login_data *logins;
 	struct login_data *past_logins;
+	struct history history;
 	struct machine *next;
 	struct machine *next_in_file;
+	unsigned int dump_hash;		// Picks segment of the dump
+	int dirty;			// Changed since written to the dump
+	int active;			// Current logins
+	size_t stats_pos;		// Index in stats_heap
+	struct hll distinct;		// Users by day of login
 };
 
 enum connection_type {
 	client,				// Persistent connection with updates
-	finger				// Single-query connection
+	finger,				// Finger queries
+	peer,				// Query sent to other shard
+	replica,			// Replica fed with changes
+	primary,			// Link of replica to its primary
+	watcher,			// Finger subscribed to login events
+	NUM_CONNECTION_TYPES
+};
+
+// Listening sockets for updates, finger requests and replicas
+#define	LISTEN_SOCKS 3
+
+// Orders of listed sessions, ties are broken by user, machine and line
+enum sort_key {
+	SORT_NAME,			// By user
+	SORT_LOGIN,			// Newest login first
+	SORT_IDLE,			// Least idle first
+	SORT_HOST,			// By machine
+	NUM_SORT_KEYS
+};
+
+/*
+ * Answers of shards to one finger query, part 0 is the local one.
+ */
+struct fanout {
+	int pending;			// Shards which haven't answered yet
+	int num_parts;
+	enum sort_key sort;
+	long long limit;
+	int json;
+	struct growing_buffer parts[SHARD_MAX];
+	char failed[DFINGER_BUFFER_SIZE];	// Shards which didn't answer
+};
+
+/*
+ * Progress of snapshot sent to replica, machines go by hostname.
+ */
+struct snapshot_cursor {
+	int started;
+	char host[UT_HOSTSIZE];			// The last machine sent
 };
 
 struct connection {
 	int in_use;
-	struct machine *machine;
 	enum connection_type type;
-	char buffer[DFINGER_BUFFER_SIZE];	// Input buffer
+	struct machine *machine;
+	int relay;				// Client may send records of
+						// other machines
+	int shard_peer;				// Finger came from a shard
+	char *buffer;				// Input buffer from the pool,
+						// NULL while there's no input
+	size_t size;				// Size of input buffer
 	size_t offset;				// Current offset in input
 						// buffer
-	struct growing_buffer *response;	// Output buffer
+	int overlong;				// Dropping rest of line longer
+						// than input buffer
+	int keepalive;				// Finger answers more queries
+	struct growing_buffer *response;	// Output buffer, NULL until
+						// connection writes
+	size_t framed;				// Response bytes already framed
+	struct fanout *fanout;			// Finger waiting for shards
+	int owner;				// Finger the peer answers to
+	int part;				// Peer's part of the fanout
+	int connecting;
+	int streaming;				// Finger waiting for forward
+	long long deadline;			// Peer timeout, finger must
+						// send query by then [ms]
+	struct resolve *resolving;		// Peer waiting for DNS
+	int forwarded;				// Bytes got by forward peer
+	int watch_partial;			// Event sent only partly
+	struct finger_request *watch;		// Events the watcher wants
+	struct snapshot_cursor *snapshot;	// Replica getting snapshot
+	long long watch_pos;			// Next event byte to send
+	long long query_start;			// [us]
+	long long query_ready;			// Answer complete [us]
+	int query_kind;
+	char query[DFINGER_SLOW_QUERY_SIZE];	// Query for slow log
+	unsigned int uring_id;			// Tags operations on the ring,
+						// tells apart users of a slot
+	short uring_poll;			// Events armed poll waits for
+	short uring_revents;			// Events completed on the ring
+	int uring_recv;				// Multishot accept/recv armed
+	int uring_sending;			// Send in flight
+	int uring_send_done;			// Send completed, not handled
+	ssize_t uring_sent;			// Result of the send
 };
 
 struct login {
 	long long login_time;
 	long long idle_time;
+	long long logout_time;
 	char user[UT_NAMESIZE];
 	char host[UT_HOSTSIZE];
 	char line[UT_LINESIZE];
@@ -57,21 +153,152 @@ struct login_stack {
 	size_t size;
 	size_t max_size;
 	size_t end;
+	struct finger_request *order;	// Keeps first logins by order of
+					// the request as max-heap
+	size_t dropped;			// Logins over the limit
+};
+
+/*
+ * Position of session in the order, listing continues after the session
+ * it points to. Value is the negated login time or idle time.
+ */
+struct login_cursor {
+	long long value;
+	char user[UT_NAMESIZE];
+	char host[UT_HOSTSIZE];
+	char line[UT_LINESIZE];
+};
+
+struct login_key {
+	long long value;
+	const char *user;
+	const char *host;
+	const char *line;
+};
+
+/*
+ * Login whose user isn't among the users of the dump, the main thread
+ * adds the user.
+ */
+struct dump_unknown {
+	struct login_data *login;
+	char user[UT_NAMESIZE];
+};
+
+/*
+ * File of the dump mapped for loading, sections of machines' logins
+ * start at logins.
+ */
+struct dump_map {
+	char *data;
+	size_t size;
+	char *logins;
+};
+
+/*
+ * User listed by a file of the dump, segments may list the same users.
+ */
+struct dump_name {
+	char *name;
+	size_t len;
+	size_t order;			// Among all users listed
+	int dup;			// Listed by earlier file
+};
+
+/*
+ * Logins of one machine in the dump, loaded by a worker.
+ */
+struct dump_section {
+	struct machine *machine;
+	char *start;			// First line of logins
+	char *end;			// Blank line after the last
+	struct login_data **logins;	// In order of the dump
+	size_t num_logins;
+	struct dump_unknown *unknown;
+	size_t num_unknown;
+	struct dump_section *next;	// Next section of the same machine
+};
+
+enum query_type {
+	QUERY_LOGINS,
+	QUERY_REPL,			// Replication status
+	QUERY_HISTORY,			// Sessions within time range
+	QUERY_LAST,			// Last logins
+	QUERY_METRICS,			// Server metrics
+	QUERY_SLOW,			// Slow log
+	QUERY_STATS,			// Counts of current logins
+	QUERY_DISTINCT,			// Estimate of distinct users
+	NUM_QUERY_TYPES
+};
+
+/*
+ * Operations of io_uring backend. Each is tagged by connection id,
+ * descriptor and operation, so completions of closed connections
+ * are recognized even if the descriptor was reused.
+ */
+enum uring_op {
+	URING_ACCEPT = 1,
+	URING_RECV,
+	URING_POLL,
+	URING_SEND,
+	URING_IGNORE			// Poll updates and cancellations
 };
 
+/*
+ * Response of closed connection which the kernel may still be sending.
+ */
+struct uring_orphan {
+	unsigned long long tag;
+	struct growing_buffer *buffer;
+};
+
+// Queries are measured by type, watch and forward separately
+#define	QUERY_WATCH NUM_QUERY_TYPES
+#define	QUERY_FORWARD (NUM_QUERY_TYPES + 1)
+#define	NUM_QUERY_KINDS (NUM_QUERY_TYPES + 2)
+
 struct finger_request {
+	enum query_type type;
 	char user[DFINGER_BUFFER_SIZE];
 	char host[DFINGER_BUFFER_SIZE];
 	int verbosity;
 	int forward;
+	int local;			// Don't ask other shards
+	int keepalive;			// Keep connection open for more queries
+	int watch;			// Subscribe to login events
+	long long from;			// Time range of history query
+	long long to;
+	long long count;		// Number of last logins
+	enum sort_key sort;
+	long long limit;		// Most sessions listed
+	int after;			// Listing continues after cursor
+	struct login_cursor cursor;
+	int keyed;			// Lines start with their cursors,
+					// shard merges them by those
+	int json;			// Sessions as JSON objects
+	int shard_token;		// /TOKEN is SHARD_TOKEN
 };
 
 static void stack_init(struct login_stack *stack, size_t max_size);
 static void stack_free(struct login_stack *stack);
 static void stack_add(struct login_stack *stack, struct login_data *login);
-
-static void append_buffer(struct growing_buffer *buffer, char *str,
-			size_t str_len);
+static void stack_order(struct login_stack *stack,
+			struct finger_request *request);
+static void stack_sift_down(struct login_stack *stack, size_t i, size_t end);
+static void stack_sort(struct login_stack *stack);
+static struct login_data ** list_logins(struct login_data *login,
+					int by_user, size_t *len);
+
+static void login_key(struct login_data *login, enum sort_key sort,
+			struct login_key *key);
+static void cursor_key(struct login_cursor *cursor, struct login_key *key);
+static int cmp_keys(enum sort_key sort, struct login_key *a,
+			struct login_key *b);
+static int cmp_logins(enum sort_key sort, struct login_data *a,
+			struct login_data *b);
+static int sprint_cursor(struct login_data *login, enum sort_key sort,
+			char *buffer, size_t buffer_size);
+static char * parse_cursor(char *str, struct login_cursor *cursor);
 
 static struct user * fetch_next_user(struct user *initial, char *name);
 static int finger_user_matches(struct user *user, char *username);
@@ -80,7 +307,12 @@ static void get_logins_machine(struct login_stack *stack,
 static void get_logins_user(struct login_stack *stack, struct user *user,
 				char *hostname);
 
-static int finger_complete_request(char *buffer, size_t len);
+static void finger_next(int idx);
+static void finger_respond(int idx, char *query);
+static void frame_response(int idx, int last);
+static int query_cost(struct finger_request *request);
+static int query_admit(int cost);
+static int shard_token_matches(const char *token, size_t len);
 static void finger_parse_request(char *request_str,
 				struct finger_request *request);
 static void finger_process_request(struct finger_request *request,
@@ -88,39 +320,179 @@ static void finger_process_request(struct finger_request *request,
 static void finger_forward_request(struct finger_request *request,
 				struct growing_buffer *response);
 
+static void finger_forward(int idx, struct finger_request *request);
+static void resume_forward(int owner);
+static void peer_resolved(int idx);
+static int finger_fanout(int idx, struct finger_request *request);
+static void open_peer(int owner, int part, struct shard *shard,
+			struct finger_request *request);
+static void peer_done(int idx, int failed);
+static void finish_fanout(int idx);
+static void merge_parts(struct fanout *fanout,
+			struct growing_buffer *response);
+static int next_part_line(struct fanout *fanout, int part, size_t *pos,
+			size_t end, struct login_cursor *cursor, int *more);
+static void handle_peer(int idx, short revents);
+
 static int sprint_login(struct login_data *login, char *buffer,
 				size_t buffer_size);
+static int sprint_history(struct login_data *login, char *buffer,
+				size_t buffer_size);
+static void json_login(struct login_data *login,
+			struct growing_buffer *response);
+static void json_message(const char *key, const char *value, size_t len,
+			struct growing_buffer *response);
+static void history_range(struct login_stack *stack,
+				struct history *history, struct user *user,
+				const char *host, struct finger_request *request);
+static void history_last_machines(struct login_stack *stack,
+					struct user *user,
+					struct finger_request *request);
+static void history_query(struct finger_request *request,
+				struct growing_buffer *response);
+
+static int sprint_event(char type, struct login_data *login, char *buffer);
+static void finger_watch(int idx, struct finger_request *request);
+static void watch_event(char type, struct login_data *login);
+static void watch_trim(size_t len);
+static int watch_matches(struct finger_request *watch, char *event);
+static void watch_flush(void);
+static void handle_watcher(int idx, short revents);
+
+static void metrics_report(struct growing_buffer *out);
+static long long lap(long long *mark);
+static void slow_query(int idx);
+static void slow_update(struct connection *con, long long usecs,
+			long long lines, ssize_t bytes);
+static void slow_tick(long long *phases, long long usecs, int ready);
+static void count_logins(struct login_data *login, long long *current,
+				long long *past);
+
+static void stats_login(struct login_data *login, int delta);
+static void stats_swap(size_t i, size_t j);
+static void stats_fix(size_t pos);
+static void stats_insert(struct machine *machine);
+static void stats_remove(struct machine *machine);
+static void stats_report(struct finger_request *request,
+			struct growing_buffer *response);
+static void stats_top(long long count, struct growing_buffer *response);
+static void stats_top_fix(size_t *next, size_t num_next, size_t pos);
+
+static void distinct_report(struct finger_request *request,
+				struct growing_buffer *response);
+static void distinct_expire(void);
+
+static void repl_event(char type, struct login_data *login);
+static void repl_machine_event(struct machine *machine);
+static void repl_snapshot_machine(struct growing_buffer *out,
+					struct machine *machine);
+static int repl_snapshot_step(int idx);
+static int repl_snapshot_sent(struct snapshot_cursor *cursor,
+				const char *line);
+static void repl_flush(void);
+static void repl_status(struct growing_buffer *response);
+static void handle_replica(int idx, short revents);
+static void connect_primary(void);
+static void process_repl_line(char *line);
+static ssize_t read_primary(int fd, struct connection *con);
+static void clear_store(void);
 
 
 static void read_data(void);
+static char * map_dump(const char *file, size_t *size);
+static struct dump_map * read_manifest(char *data, char *end,
+					size_t *num_maps);
+static void load_maps(struct dump_map *maps, size_t num_maps);
+static char * dump_line(char *pos, char *end, char *line);
+static int cmp_users_by_name(const void *p1, const void *p2);
+static int cmp_machines_by_name(const void *p1, const void *p2);
+static int cmp_dump_names(const void *p1, const void *p2);
+static int cmp_dump_order(const void *p1, const void *p2);
+static int cmp_dump_sections(const void *p1, const void *p2);
+static void load_section(struct dump_section *section);
+static void load_machine(size_t idx);
+static void load_user(size_t idx);
 static char * get_next_field(char *buffer, char *dest, size_t max_size);
 static int fetch_login(char *buffer, struct login *login);
 
 static void write_data(void);
-static void write_machines(int dump_file);
-static void write_users(int dump_file);
-static void write_logins(int dump_file);
+static int write_dump(const char *file, struct machine **machines,
+			size_t num_machines, struct user **users,
+			size_t num_users);
+static void write_machines(int dump_file, struct machine **machines,
+				size_t num_machines);
+static void write_users(int dump_file, struct user **users,
+			size_t num_users);
+static void write_logins(int dump_file, struct machine **machines,
+				size_t num_machines);
+static unsigned int dump_hash(const char *hostname);
+static void write_segments(struct machine **machines,
+				size_t num_machines);
+static int write_segment(const char *file, struct machine **machines,
+				size_t num_machines);
+static int write_manifest(char **names, int num_segments);
+static void drop_segments(void);
 
 
-static int bind_sock(int port);
 static void initial_bind(struct connection *connections, struct pollfd *socks,
 			struct conf *conf);
+static int add_connection(int fd, enum connection_type type);
 static void accept_connection(int sock_id,
 				struct conf *conf, enum connection_type type);
 static void free_connection(int idx);
 
+static void process_update_line(struct connection *con, char *line);
 static ssize_t read_message(int fd, struct connection *con);
 static ssize_t read_request(int fd, struct connection *con);
 static ssize_t write_response(int fd, struct growing_buffer *response);
+static void process_message(struct connection *con, size_t num_read);
+static void receive_message(struct connection *con, char *data, size_t len);
+static void admit_connection(int fd, enum connection_type type);
+static int relay_allowed(const char *host);
+static int class_full(enum connection_type type);
+static void admission_update(void);
+static size_t input_limit(struct connection *con);
+static void input_reserve(struct connection *con, size_t size);
+static void input_release(struct connection *con);
+static void input_set(struct connection *con, const char *str);
+static ssize_t input_fill(int fd, struct connection *con);
+static size_t input_skip(struct connection *con, size_t buf_len);
+static void input_drop_overlong(struct connection *con);
+static void output_init(struct connection *con, size_t max_size);
+
+static void uring_start(void);
+static unsigned long long uring_tag(int idx, enum uring_op op);
+static void uring_arm(long long *timeout);
+static int uring_reap(void);
+static void uring_complete(int idx, enum uring_op op,
+				struct io_uring_cqe *cqe);
+static void uring_stale(enum uring_op op, struct io_uring_cqe *cqe);
+static void uring_deliver(int idx);
+static void uring_forget(int idx);
 
 static struct machine * add_machine(char *hostname);
 static struct machine * find_machine(char *hostname);
+static size_t host_lower_bound(const char *name, size_t len);
+static size_t host_upper_bound(const char *name, size_t len);
+static void host_index_add(struct machine *machine);
+static void host_index_remove(struct machine *machine);
+static int host_is_pattern(const char *host);
+static int host_matches(const char *host, const char *hostname);
+static size_t host_first(const char *host, size_t *end);
+static struct machine * host_next(const char *host, size_t *pos, size_t end);
 static struct user * add_user(char *username);
 static struct user * find_user(char *username);
+static size_t user_lower_bound(const char *name);
+static void user_index_add(struct user *user);
+static void user_index_remove(struct user *user);
 static void get_user_info(struct user *user);
 static void add_login(struct machine *machine, struct login_data *login_data);
 static void add_raw_login(struct machine *machine, struct login *login);
+static struct login_data * find_login(struct machine *machine,
+				struct login *login, struct login_data **prev);
 static void update_login(struct machine *machine, struct login *login);
+static void retire_login(struct machine *machine, struct login_data *login,
+				struct login_data *prev);
 static void delete_logins(struct machine *machine, int all);
 static void update_machine(struct machine *machine);
 static void logout_machine(struct machine *machine);
@@ -144,11 +516,116 @@ static int connections_used;
 static struct user *ulist;
 static struct machine *mlist;
 
+static struct machine **host_index;	// Machines sorted by hostname
+static size_t host_index_len;
+static size_t host_index_size;
+static int host_index_bulk;		// Machines of the dump, sorted after
+
+static struct user **user_index;	// Users sorted by name
+static size_t user_index_len;
+static size_t user_index_size;
+static int user_index_bulk;		// Users of the dump, sorted after
+
+// Dump being loaded by workers
+static struct dump_section *dump_sections;
+static size_t *dump_jobs;		// First section of each machine
+
+// Segments of the dump listed by its manifest
+static char **dump_names;		// Files of segments
+static size_t *dump_sizes;		// Machines of segments when written
+static int dump_num_segments;
+static long long dump_generation;	// Of the manifest, names new files
+static long long dump_next_full;	// Time to write all segments
+static long long dump_mark;		// Segment being written
+static long long segments_written;
+
+static struct growing_buffer watch_log;	// Events not sent to all watchers
+static long long watch_base;		// Position of watch_log start
+static int num_watchers;
+
+static struct growing_buffer repl_log;	// Changes not sent to replicas yet
+static int repl_overflow;		// Changes didn't fit repl_log
+static int num_replicas;
+static long long repl_next_heartbeat;
+
+static int repl_connected;		// State of replica
+static int repl_synced;
+static long long repl_lag;		// [ms]
+static long long repl_heartbeat;	// Time of last heartbeat [ms]
+static long long repl_events;
+
+static const char *query_kinds[NUM_QUERY_KINDS] = {
+	"logins", "repl", "history", "last", "metrics", "slow", "stats",
+	"distinct", "watch", "forward"
+};
+
+// Counts of logins kept as they change, so /STATS doesn't walk lists
+static long long stats_sessions;
+static long long stats_users;
+static long long stats_active_users;
+static long long stats_active_machines;
+static struct machine **stats_heap;	// Max-heap of machines by active
+static size_t stats_heap_len;
+static size_t stats_heap_size;
+
+static struct hll fleet_distinct;	// Users of all machines by day
+
+// Parts of server loop iteration reported in slow log
+enum tick_phase {
+	TICK_EVENTS,			// Sockets
+	TICK_FLUSH,			// Replicas and watchers
+	TICK_DUMP,
+	TICK_CHECK,
+	TICK_CLEAR,
+	TICK_CUT,
+	NUM_TICK_PHASES
+};
+
+static const char *connection_types[NUM_CONNECTION_TYPES] = {
+	"client", "finger", "peer", "replica", "primary", "watcher"
+};
+
+static const char *sort_keys[NUM_SORT_KEYS] = {
+	"name", "login", "idle", "host"
+};
+
+static struct histogram query_latency[NUM_QUERY_KINDS];
+static struct histogram update_latency;
+static struct histogram dump_duration;
+static struct histogram check_duration;
+static struct histogram clear_duration;
+static struct histogram cut_duration;
+static long long ingest_lines;
+static long long ingest_bytes;
+static long long queries;
+static long long io_syscalls;		// Of the poll backend
+
+// Class each listening socket accepts
+static const enum connection_type listen_types[LISTEN_SOCKS] = {
+	client, finger, replica
+};
+static int conns_by_type[NUM_CONNECTION_TYPES];
+static long long refused[NUM_CONNECTION_TYPES];
+static long long shed[NUM_QUERY_KINDS];	// Queries over the token bucket
+static long long reclaimed_read;	// Fingers not sending whole query
+static long long reclaimed_idle;	// Keep-alive fingers silent too long
+static double query_tokens;
+static long long query_refill;		// Time tokens were added [ms]
+
+static struct uring ring;
+static int uring_active;
+static int *uring_fds;			// Connection of each descriptor
+static int uring_fds_size;
+static unsigned int uring_ids;
+static struct uring_orphan *uring_orphans;
+static int uring_num_orphans;
+
 static int rereading_conf = 0;
 static int quitting = 0;
+static volatile sig_atomic_t trace_toggle = 0;
 
 extern struct conf *conf;
-extern char *conf_file;
+extern char conf_file[];
 
 
 static void sighup_handler(int sig) {
@@ -162,6 +639,11 @@ static void sighup_handler(int sig) {
 	rereading_conf = 0;
 }
 
+static void sigusr1_handler(int sig) {
+	UNUSED(sig);
+	trace_toggle = 1;
+}
+
 static void sigterm_handler(int sig) {
 	UNUSED(sig);
 	if (quitting) {
@@ -170,6 +652,8 @@ static void sigterm_handler(int sig) {
 
 	quitting = 1;
 	write_data();
+	slowlog_flush(conf->slow_log_file);
+	trace_switch(0, conf->trace_file);
 
 	for (int i = 0; i < connections_used; i++) {
 		close(socks[i].fd);
@@ -177,31 +661,6 @@ static void sigterm_handler(int sig) {
 	exit(0);
 }
 
-static void init_buffer(struct growing_buffer *buffer, size_t max_size) {
-	if (max_size) {
-		buffer->max_size = max_size;
-	} else {
-		buffer->max_size = DFINGER_GBUFFER_MAXSIZE;
-	}
-
-	if (max_size >= 2) {
-		buffer->size = 2;
-	} else {
-		buffer->size = buffer->max_size;
-	}
-
-	buffer->buffer = malloc(buffer->size);
-	if (!buffer->buffer) {
-		exit(ENOMEM);
-	}
-	buffer->offset = 0;
-	buffer->len = 0;
-}
-
-void free_buffer(struct growing_buffer *buffer) {
-	free(buffer->buffer);
-}
-
 static void stack_init(struct login_stack *stack, size_t max_size) {
 	if (max_size) {
 		stack->max_size = max_size;
@@ -220,22 +679,50 @@ static void stack_init(struct login_stack *stack, size_t max_size) {
 		exit(ENOMEM);
 	}
 	stack->end = 0;
+	stack->order = NULL;
+	stack->dropped = 0;
 }
 
 static void stack_free(struct login_stack *stack) {
 	free(stack->stack);
 }
 
-static int finger_complete_request(char *buffer, size_t len) {
-	if (len < 2) {
-		return (0);
+/*
+ * Answers the next query waiting in input buffer, if the connection isn't
+ * busy with previous one. Keep-alive clients may send more queries at once
+ * without waiting for answers, they are answered one by one in order.
+ */
+static void finger_next(int idx) {
+	struct connection *con = &connections[idx];
+	if (con->fanout || con->streaming || (con->response &&
+	    con->response->offset < con->response->len)) {
+		return;
 	}
 
-	if (buffer[len-1] == 10 && buffer[len-2] == 13) {
-		return (1);
+	char *eol = (con->buffer ? strstr(con->buffer, "\r\n") : NULL);
+	if (!eol) {
+		socks[idx].events = POLLIN;
+		if (!con->deadline) {
+			// Partial query doesn't extend the deadline
+			con->deadline = cur_msecs() + (con->offset ?
+					conf->finger_read_timeout :
+					conf->finger_idle_timeout);
+		}
+		return;
 	}
+	con->deadline = 0;
+
+	char query[DFINGER_BUFFER_SIZE];
+	size_t len = eol + 2 - con->buffer;
+	memcpy(query, con->buffer, len);
+	query[len] = 0;
+	move_buffer(con->buffer, con->offset, &len);
+	con->offset = len;
+	con->buffer[con->offset] = 0;
+	input_release(con);
 
-	return (0);
+	con->framed = 0;
+	finger_respond(idx, query);
 }
 
 static int finger_user_matches(struct user *user, char *username) {
@@ -248,30 +735,61 @@ static int finger_user_matches(struct user *user, char *username) {
 	}
 
 	char *ptr = user->fullname;
+	size_t len = strlen(username);
 	while (*ptr) {
-		if (strcmp(ptr, username) == 0) {
+		if (strncmp(ptr, username, len) == 0 &&
+		    (ptr[len] == ' ' || ptr[len] == '-' || ptr[len] == 0)) {
 			return (1);
 		}
 
 		while (*ptr != ' ' && *ptr != '-' && *ptr != 0) {
 			ptr++;
 		}
+		while (*ptr == ' ' || *ptr == '-') {
+			ptr++;
+		}
 	}
 
 	return (0);
 }
 
 static void stack_add(struct login_stack *stack, struct login_data *login) {
+	struct finger_request *order = stack->order;
+	if (order && order->after) {
+		struct login_key key, after;
+		login_key(login, order->sort, &key);
+		cursor_key(&order->cursor, &after);
+		if (cmp_keys(order->sort, &key, &after) <= 0) {
+			// Listed on previous pages
+			return;
+		}
+	}
+
+	size_t limit = stack->max_size;
+	if (order && order->limit > 0 && (size_t) order->limit < limit) {
+		limit = order->limit;
+	}
+	if (order && stack->end == limit) {
+		// Login replaces the last one kept if it goes before it
+		stack->dropped++;
+		if (cmp_logins(order->sort, login, stack->stack[0]) < 0) {
+			stack->stack[0] = login;
+			stack_sift_down(stack, 0, stack->end);
+		}
+		return;
+	}
+
 	if (stack->end == stack->size) {
 		if (stack->size * 2 <= stack->max_size) {
-			stack->stack = realloc(stack->stack, stack->size*2);
 			stack->size *= 2;
 		} else if (stack->size < stack->max_size) {
-			stack->stack = realloc(stack->stack, stack->max_size);
 			stack->size = stack->max_size;
 		} else {
-			// FIX ME
+			// Listing is cut at max_size logins
+			return;
 		}
+		stack->stack = realloc(stack->stack,
+				stack->size * sizeof (struct login_data *));
 
 		if (!stack->stack) {
 			exit(ENOMEM);
@@ -279,6 +797,139 @@ static void stack_add(struct login_stack *stack, struct login_data *login) {
 	}
 
 	stack->stack[stack->end++] = login;
+
+	for (size_t i = stack->end - 1; order && i > 0; i = (i - 1) / 2) {
+		struct login_data **parent = &stack->stack[(i - 1) / 2];
+		if (cmp_logins(order->sort, *parent, stack->stack[i]) >= 0) {
+			break;
+		}
+		stack->stack[i] = *parent;
+		*parent = login;
+	}
+}
+
+/*
+ * Makes the stack keep only first logins by sort of the request, after
+ * its cursor and at most its limit. Logins form max-heap then, so top-N
+ * of many logins is selected without sorting all of them.
+ */
+static void stack_order(struct login_stack *stack,
+			struct finger_request *request) {
+	stack->order = request;
+}
+
+static void stack_sift_down(struct login_stack *stack, size_t i, size_t end) {
+	enum sort_key sort = stack->order->sort;
+	struct login_data **heap = stack->stack;
+
+	while (2 * i + 1 < end) {
+		size_t child = 2 * i + 1;
+		if (child + 1 < end &&
+		    cmp_logins(sort, heap[child + 1], heap[child]) > 0) {
+			child++;
+		}
+		if (cmp_logins(sort, heap[i], heap[child]) >= 0) {
+			break;
+		}
+
+		struct login_data *tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/*
+ * Sorts heap of ordered stack in place, first login first.
+ */
+static void stack_sort(struct login_stack *stack) {
+	for (size_t end = stack->end; end > 1; end--) {
+		struct login_data *tmp = stack->stack[0];
+		stack->stack[0] = stack->stack[end - 1];
+		stack->stack[end - 1] = tmp;
+		stack_sift_down(stack, 0, end - 1);
+	}
+}
+
+static void login_key(struct login_data *login, enum sort_key sort,
+			struct login_key *key) {
+	key->value = (sort == SORT_LOGIN ? -login->login_time :
+			sort == SORT_IDLE ? login->idle_time : 0);
+	key->user = login->user->username;
+	key->host = login->machine->hostname;
+	key->line = login->line;
+}
+
+static void cursor_key(struct login_cursor *cursor, struct login_key *key) {
+	key->value = cursor->value;
+	key->user = cursor->user;
+	key->host = cursor->host;
+	key->line = cursor->line;
+}
+
+static int cmp_keys(enum sort_key sort, struct login_key *a,
+			struct login_key *b) {
+	if (a->value != b->value) {
+		return (a->value < b->value ? -1 : 1);
+	}
+
+	int cmp;
+	if (sort == SORT_HOST && (cmp = strcmp(a->host, b->host))) {
+		return (cmp);
+	}
+	if ((cmp = strcmp(a->user, b->user))) {
+		return (cmp);
+	}
+	if ((cmp = strcmp(a->host, b->host))) {
+		return (cmp);
+	}
+
+	return (strcmp(a->line, b->line));
+}
+
+static int cmp_logins(enum sort_key sort, struct login_data *a,
+			struct login_data *b) {
+	struct login_key key_a, key_b;
+	login_key(a, sort, &key_a);
+	login_key(b, sort, &key_b);
+
+	return (cmp_keys(sort, &key_a, &key_b));
+}
+
+static int sprint_cursor(struct login_data *login, enum sort_key sort,
+			char *buffer, size_t buffer_size) {
+	struct login_key key;
+	login_key(login, sort, &key);
+
+	return (snprintf(buffer, buffer_size, "%lld,%s,%s,%s", key.value,
+			key.user, key.host, key.line));
+}
+
+/*
+ * Parses cursor "value,user,host,line" ended by space or end of line,
+ * returns pointer after it or NULL if it's malformed.
+ */
+static char * parse_cursor(char *str, struct login_cursor *cursor) {
+	char *end;
+	cursor->value = strtoll(str, &end, 10);
+	if (end == str || *end != ',') {
+		return (NULL);
+	}
+	str = end + 1;
+
+	char *fields[3] = {cursor->user, cursor->host, cursor->line};
+	size_t sizes[3] = {UT_NAMESIZE, UT_HOSTSIZE, UT_LINESIZE};
+	for (int i = 0; i < 3; i++) {
+		size_t len = strcspn(str, (i < 2 ? ", \r\n" : " \r\n"));
+		if (len >= sizes[i] || (i < 2 && str[len] != ',')) {
+			return (NULL);
+		}
+		memcpy(fields[i], str, len);
+		fields[i][len] = 0;
+		str += len + (i < 2);
+	}
+
+	return (str);
 }
 
 static void get_logins_machine(struct login_stack *stack,
@@ -303,7 +954,7 @@ static void get_logins_user(struct login_stack *stack, struct user *user,
 	struct login_data *login = user->logins;
 	while (login) {
 		if (!*hostname ||
-			strcmp(hostname, login->machine->hostname) == 0) {
+			host_matches(hostname, login->machine->hostname)) {
 			stack_add(stack, login);
 		}
 		login = login->next_by_user;
@@ -352,29 +1003,8 @@ static void finger_forward_request(struct finger_request *request,
 				struct growing_buffer *response) {
 	UNUSED(request->forward);
 
-	append_buffer(response, "Finger forwarding service denied", 33);
-}
-
-static void append_buffer(struct growing_buffer *buffer, char *str,
-			size_t str_len) {
-	if (buffer->size - buffer->len < str_len) {
-		if (buffer->size == buffer->max_size) {
-			fprintf(stderr, "Buffer overflow\n");
-			buffer->buffer[0] = 0;
-			buffer->len = 0;
-			return;
-		}
-
-		buffer->size = (buffer->size * 2 < buffer->max_size ?
-				buffer->size * 2 : buffer->max_size);
-		buffer->buffer = realloc(buffer->buffer, buffer->size);
-		if (!buffer->buffer) {
-			exit(ENOMEM);
-		}
-	}
-
-	strncpy(buffer->buffer+buffer->len, str, str_len);
-	buffer->len += str_len;
+	char *msg = "Finger forwarding service denied\r\n";
+	append_buffer(response, msg, strlen(msg));
 }
 
 static int sprint_login(struct login_data *login, char *buffer,
@@ -395,179 +1025,2642 @@ static int sprint_login(struct login_data *login, char *buffer,
 	return (written);
 }
 
-static void finger_respond(int idx) {
-	socks[idx].events = 0;
-	struct finger_request request;
-	memset(&request, 0, sizeof (struct finger_request));
-	finger_parse_request(connections[idx].buffer, &request);
-	finger_process_request(&request, connections[idx].response);
-	connections[idx].response->offset = 0;
-	socks[idx].events = POLLOUT;
+static int sprint_history(struct login_data *login, char *buffer,
+			size_t buffer_size) {
+	char login_time[DFINGER_TIME_SIZE];
+	char logout_time[DFINGER_TIME_SIZE];
+	time_t t = login->login_time;
+	strftime(login_time, DFINGER_TIME_SIZE, "%Y-%m-%d %H:%M:%S",
+		localtime(&t));
+
+	if (login->idle_time >= 0) {
+		strcpy(logout_time, "still logged in");
+	} else if (login->logout_time > 0) {
+		t = login->logout_time;
+		strftime(logout_time, DFINGER_TIME_SIZE, "%Y-%m-%d %H:%M:%S",
+			localtime(&t));
+	} else {
+		strcpy(logout_time, "?");
+	}
+
+	return (snprintf(buffer, buffer_size, "%-15s %-15s %8s %s - %s %s\n",
+			login->user->username, login->machine->hostname,
+			login->line, login_time, logout_time, login->host));
 }
 
-static void finger_process_request(struct finger_request *request,
-					struct growing_buffer *response) {
-	if (request->forward) {
-		finger_forward_request(request, response);
+/*
+ * Writes session as one line of JSON with raw times: idle only while the
+ * session lasts, logout only once it's known.
+ */
+static void json_login(struct login_data *login,
+			struct growing_buffer *response) {
+	json_begin(response);
+	json_string(response, "user", login->user->username);
+	json_string(response, "machine", login->machine->hostname);
+	json_string(response, "line", login->line);
+	json_number(response, "login", login->login_time);
+	if (login->idle_time >= 0) {
+		json_number(response, "idle", login->idle_time);
+	}
+	if (login->logout_time > 0) {
+		json_number(response, "logout", login->logout_time);
+	}
+	json_string(response, "host", login->host);
+	json_end(response);
+}
+
+/*
+ * Writes line of JSON with one string member, len bytes of value.
+ */
+static void json_message(const char *key, const char *value, size_t len,
+			struct growing_buffer *response) {
+	char buffer[DFINGER_BUFFER_SIZE];
+	snprintf(buffer, sizeof (buffer), "%.*s", (int) len, value);
+	json_begin(response);
+	json_string(response, key, buffer);
+	json_end(response);
+}
+
+/*
+ * Collects sessions of history overlapping the requested time range, of
+ * user and on machines matching host if given. Sessions which ended
+ * before the range are skipped by the index, so only the range is read.
+ */
+static void history_range(struct login_stack *stack,
+				struct history *history, struct user *user,
+				const char *host, struct finger_request *request) {
+	size_t i = history_find(history, request->to);
+
+	while ((i = history_prev(history, i, request->from)) > 0) {
+		struct login_data *login = history->logins[--i];
+		if ((user && login->user != user) ||
+		    (host && !host_matches(host, login->machine->hostname))) {
+			continue;
+		}
+		stack_add(stack, login);
+	}
+}
+
+/*
+ * Collects the last logins of machines matching hostname pattern, or of
+ * all machines without host. Stack keeps the newest count of them, each
+ * machine gives at most count.
+ */
+static void history_last_machines(struct login_stack *stack,
+					struct user *user,
+					struct finger_request *request) {
+	if (request->count <= 0) {
 		return;
 	}
 
+	struct finger_request order;
+	memset(&order, 0, sizeof (order));
+	order.sort = SORT_LOGIN;
+	order.limit = request->count;
+	stack_order(stack, &order);
+
+	if (user) {
+		// Logins of the user are fewer than of all matching machines
+		struct history *history = &user->history;
+		for (size_t i = history->len;
+		    i > 0 && (long long) stack->end < request->count; i--) {
+			struct login_data *login = history->logins[i-1];
+			if (host_matches(request->host,
+					login->machine->hostname)) {
+				stack_add(stack, login);
+			}
+		}
+	} else {
+		// Without host all machines match
+		const char *host = (*request->host ? request->host : "*");
+		size_t pos, end;
+		pos = host_first(host, &end);
+		struct machine *machine;
+		while ((machine = host_next(host, &pos, end))) {
+			struct history *history = &machine->history;
+			size_t first = (history->len > (size_t) request->count ?
+					history->len - request->count : 0);
+			for (size_t i = history->len; i > first; i--) {
+				stack_add(stack, history->logins[i-1]);
+			}
+		}
+	}
+
+	stack_sort(stack);
+	stack->order = NULL;
+}
+
+/*
+ * Answers /HIST from to [user][@host] with sessions within the time
+ * range and /LAST n [user][@host] with the last n logins, newest first.
+ */
+static void history_query(struct finger_request *request,
+				struct growing_buffer *response) {
 	struct login_stack stack;
 	stack_init(&stack, 0);
 
-	if (*(request->user)) {
-		struct user *user = ulist;
-		while ((user = fetch_next_user(user, request->user))) {
-			get_logins_user(&stack, user, request->host);
-			user = user->next;
+	struct user *user = NULL;
+	if (*request->user && !(user = find_user(request->user))) {
+		stack_free(&stack);
+		return;
+	}
+
+	int pattern = host_is_pattern(request->host);
+	struct machine *machine = NULL;
+	if (*request->host && !pattern &&
+	    !(machine = find_machine(request->host))) {
+		stack_free(&stack);
+		return;
+	}
+
+	if (request->type == QUERY_LAST && (pattern || (!user && !machine))) {
+		history_last_machines(&stack, user, request);
+	} else if (request->type == QUERY_LAST) {
+		struct history *history = (machine ? &machine->history :
+						&user->history);
+		for (size_t i = history->len;
+		    i > 0 && (long long) stack.end < request->count; i--) {
+			struct login_data *login = history->logins[i-1];
+			if (!user || login->user == user) {
+				stack_add(&stack, login);
+			}
+		}
+	} else if (machine && (!user ||
+			machine->history.len <= user->history.len)) {
+		history_range(&stack, &machine->history, user, NULL, request);
+	} else if (user) {
+		// Sessions of the user are fewer than of the machines
+		history_range(&stack, &user->history, NULL,
+				*request->host ? request->host : NULL, request);
+	} else if (pattern) {
+		size_t pos, end;
+		pos = host_first(request->host, &end);
+		while ((machine = host_next(request->host, &pos, end))) {
+			history_range(&stack, &machine->history, NULL, NULL,
+					request);
 		}
 	} else {
-		if (*(request->host)) {
-			struct machine *machine = find_machine(request->host);
-			get_logins_machine(&stack, machine);
-		} else {
-			struct machine *machine = mlist;
-			while (machine) {
-				get_logins_machine(&stack, machine);
-				machine = machine->next;
-			}
+		machine = mlist;
+		while (machine) {
+			history_range(&stack, &machine->history, NULL, NULL,
+					request);
+			machine = machine->next;
 		}
 	}
 
-	char buffer[DFINGER_BUFFER_SIZE];
-
-	qsort(stack.stack, stack.end, sizeof (struct login_data *),
-		cmp_logins_by_name);
+	if (request->type == QUERY_HISTORY) {
+		qsort(stack.stack, stack.end, sizeof (struct login_data *),
+			cmp_logins_by_logintime);
+	}
 
+	char buffer[DFINGER_BUFFER_SIZE];
 	for (size_t i = 0; i < stack.end; i++) {
-		int len = sprint_login(stack.stack[i], buffer,
+		if (request->json) {
+			json_login(stack.stack[i], response);
+			continue;
+		}
+		int len = sprint_history(stack.stack[i], buffer,
 					DFINGER_BUFFER_SIZE);
 		append_buffer(response, buffer, len);
 	}
 
-	append_buffer(response, "\r\n", 2);
-
 	stack_free(&stack);
 }
 
-static void finger_parse_request(char *request_str,
-				struct finger_request *request) {
-	char *first_at_sign = strchr(request_str, '@');
-	char *last_at_sign = strrchr(request_str, '@');
-	if (first_at_sign != last_at_sign) {
-		request->forward = 1;
+static void finger_respond(int idx, char *query) {
+	socks[idx].events = 0;
+	queries++;
+	connections[idx].query_start = cur_usecs();
+	connections[idx].query_ready = 0;
+
+	struct finger_request request;
+	memset(&request, 0, sizeof (struct finger_request));
+	TRACE_BEGIN("parse");
+	finger_parse_request(query, &request);
+	TRACE_END("parse");
+
+	// Parsing has masked the token of shards
+	int query_len = strcspn(query, "\r\n");
+	snprintf(connections[idx].query, DFINGER_SLOW_QUERY_SIZE, "%.*s",
+		(query_len < DFINGER_SLOW_QUERY_SIZE ? query_len :
+		DFINGER_SLOW_QUERY_SIZE - 1), query);
+	if (request.keepalive) {
+		connections[idx].keepalive = 1;
+	}
+
+	// Kept alive or not, the answer gets the same room, framing its own
+	size_t max_size = (request.type == QUERY_METRICS ||
+			request.type == QUERY_SLOW ||
+			request.type == QUERY_STATS ?
+			DFINGER_METRICS_BUFFER_SIZE : DFINGER_GBUFFER_MAXSIZE);
+	if (connections[idx].keepalive) {
+		max_size += DFINGER_FRAME_ROOM;
+	}
+	output_init(&connections[idx], max_size);
+
+	connections[idx].query_kind = (request.forward ? QUERY_FORWARD :
+					request.watch ? QUERY_WATCH :
+					(int) request.type);
+	if (!(request.local && connections[idx].shard_peer &&
+	    (!conf->shard_token || request.shard_token)) &&
+	    !query_admit(query_cost(&request))) {
+		// Parts of queries of other shards were paid for there
+		shed[connections[idx].query_kind]++;
+		char *msg = "Server busy, try again later\r\n";
+		if (request.json) {
+			json_message("error", msg, strlen(msg) - 2,
+					connections[idx].response);
+			msg = "\r\n";
+		}
+		append_buffer(connections[idx].response, msg, strlen(msg));
+		connections[idx].query_ready = cur_usecs();
+		frame_response(idx, 1);
+		connections[idx].response->offset = 0;
+		socks[idx].events = POLLOUT;
+		return;
+	}
+	if (request.forward && conf->forwarding) {
+		finger_forward(idx, &request);
+		return;
+	}
+	if (request.watch) {
+		finger_watch(idx, &request);
+		return;
+	}
+	if (finger_fanout(idx, &request)) {
+		// Response is sent once other shards answer
 		return;
 	}
+	finger_process_request(&request, connections[idx].response);
+	connections[idx].query_ready = cur_usecs();
+	frame_response(idx, 1);
+	connections[idx].response->offset = 0;
+	socks[idx].events = POLLOUT;
+}
 
-	char *end = strchr(request_str, 13);
-	if (!end) {
-		// Invalid request
+/*
+ * Tokens query takes from the bucket, listings of all machines cost more
+ * than queries about one user or host. Status queries are cheap, so that
+ * overload can be watched.
+ */
+static int query_cost(struct finger_request *request) {
+	if (request->forward || request->watch) {
+		return (DFINGER_COST_QUERY);
 	}
-	// Shall request be checked for *(end+1) == 10?
 
-	if (first_at_sign) {
-		char *host_start = first_at_sign;
-		host_start++;
-		strncpy(request->host, host_start, (end - host_start));
-		request->host[end-host_start] = 0;
-		end = first_at_sign;
-	} else {
-		request->host[0] = 0;
+	switch (request->type) {
+		case QUERY_LOGINS:
+		case QUERY_HISTORY:
+		case QUERY_LAST:
+			if (!*request->user && (!*request->host ||
+			    host_is_pattern(request->host))) {
+				return (DFINGER_COST_LISTING);
+			}
+			return (DFINGER_COST_QUERY);
+		default:
+			return (DFINGER_COST_QUERY);
 	}
+}
 
-	char *ptr = request_str;
-	while (*ptr == ' ') {
-		// This is more liberal than standard -- does it mind?
-		ptr++;
+/*
+ * Token bucket of queries: QUERY_RATE tokens are added per second up to
+ * QUERY_BURST. Returns 0 if there aren't enough tokens for the query,
+ * it's shed then so that updates of clients keep being processed.
+ */
+static int query_admit(int cost) {
+	if (!conf->query_rate) {
+		return (1);
 	}
 
-	if (*ptr == '/' && *(ptr+1) == 'W') {
-		request->verbosity = 1;
-		ptr += 2;
+	long long now = cur_msecs();
+	query_tokens += (now - query_refill) * conf->query_rate / 1000.0;
+	query_refill = now;
+	if (query_tokens > conf->query_burst) {
+		query_tokens = conf->query_burst;
 	}
 
-	while (*ptr == ' ') {
-		ptr++;
+	if (query_tokens < cost) {
+		return (0);
 	}
+	query_tokens -= cost;
 
-	strncpy(request->user, ptr, (end - ptr));
-	request->user[end-ptr] = 0;
+	return (1);
 }
 
-static void fix_logins_machine(struct machine *machine) {
-	struct login_data *login = machine->logins;
-	struct login_stack stack;
-	stack_init(&stack, 0);
-
+/*
+ * Returns 1 if the len bytes of token are SHARD_TOKEN. Every byte is
+ * compared, so the time taken doesn't tell how much of it was right.
+ */
+static int shard_token_matches(const char *token, size_t len) {
+	const char *secret = conf->shard_token;
+	if (!secret || strlen(secret) != len) {
+		return (0);
+	}
+
+	unsigned char diff = 0;
+	for (size_t i = 0; i < len; i++) {
+		diff |= token[i] ^ secret[i];
+	}
+
+	return (diff == 0);
+}
+
+/*
+ * Keep-alive answers are sent in chunks, each preceded by line
+ * "!!! DATA len", and the answer ends with line "!!! END". Bytes of
+ * the response appended since the last call are made a chunk.
+ */
+static void frame_response(int idx, int last) {
+	struct connection *con = &connections[idx];
+	struct growing_buffer *response = con->response;
+	if (!con->keepalive) {
+		return;
+	}
+
+	char header[DFINGER_FRAME_SIZE];
+	size_t room = DFINGER_FRAME_ROOM;
+	if (response->max_size - response->len < room) {
+		// Answer is cut to fit the buffer, chunks framed before stay
+		response->len = (response->max_size - room > con->framed ?
+				response->max_size - room : con->framed);
+	}
+
+	size_t len = response->len - con->framed;
+	if (len) {
+		int header_len = snprintf(header, sizeof (header),
+					"!!! DATA %zu\r\n", len);
+		append_buffer(response, header, header_len);
+		char *data = response->buffer + con->framed;
+		memmove(data + header_len, data, len);
+		memcpy(data, header, header_len);
+	}
+
+	if (last) {
+		append_buffer(response, "!!! END\r\n", 9);
+	}
+	con->framed = response->len;
+}
+
+/*
+ * Forwards query to remote finger daemon. Its answer is streamed to
+ * the client as it arrives, so forwarding holds at most one output
+ * buffer per query, and all the work is driven by the main loop so
+ * slow remote hosts don't delay anybody else.
+ */
+static void finger_forward(int idx, struct finger_request *request) {
+	int peer_idx = add_connection(-1, peer);
+	struct resolve *req = NULL;
+	if (peer_idx < 0 ||
+	    !(req = resolve_start(request->host, conf->forward_port))) {
+		if (peer_idx >= 0) {
+			free_connection(peer_idx);
+		}
+		append_buffer(connections[idx].response,
+				"Finger forwarding failed\r\n", 26);
+		frame_response(idx, 1);
+		connections[idx].response->offset = 0;
+		socks[idx].events = POLLOUT;
+		return;
+	}
+
+	struct connection *con = &connections[peer_idx];
+	con->owner = idx;
+	con->part = -1;
+	con->resolving = req;
+	con->forwarded = 0;
+	con->deadline = cur_msecs() + conf->forward_timeout;
+	input_set(con, request->host);
+	socks[peer_idx].events = 0;
+
+	char query[DFINGER_BUFFER_SIZE + 8];
+	int len = snprintf(query, sizeof (query), "%s%s\r\n",
+			request->verbosity ? "/W " : "", request->user);
+	append_buffer(con->response, query, len);
+
+	connections[idx].streaming = 1;
+	socks[idx].events = 0;
+}
+
+/*
+ * Lets forward peer of the finger connection read again once the client
+ * took what was read before.
+ */
+static void resume_forward(int owner) {
+	for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+		if (connections[i].type == peer && connections[i].owner == owner &&
+		    connections[i].part < 0 && !connections[i].resolving &&
+		    !connections[i].connecting &&
+		    connections[i].response->offset ==
+		    connections[i].response->len) {
+			socks[i].events = POLLIN;
+		}
+	}
+}
+
+static void peer_resolved(int idx) {
+	struct connection *con = &connections[idx];
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+
+	int ret = resolve_done(con->resolving, &addr, &addr_len);
+	if (ret == 0) {
+		return;
+	}
+	resolve_cancel(con->resolving);
+	con->resolving = NULL;
+
+	int fd = -1;
+	if (ret > 0) {
+		fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	}
+	if (fd >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (connect(fd, (struct sockaddr *) &addr, addr_len) != 0 &&
+		    errno != EINPROGRESS) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if (fd < 0) {
+		peer_done(idx, 1);
+		return;
+	}
+
+	socks[idx].fd = fd;
+	socks[idx].events = POLLOUT;
+	con->connecting = 1;
+}
+
+/*
+ * Asks other shards for their part of the answer. Query about single
+ * machine goes only to the shard owning it, other queries go to all
+ * shards and their answers are merged with the local one.
+ * Returns 0 if request should be answered locally right away.
+ */
+static int finger_fanout(int idx, struct finger_request *request) {
+	if (!shard_count() || request->local || request->forward ||
+	    request->watch ||
+	    request->type != QUERY_LOGINS) {
+		return (0);
+	}
+
+	int only = -1;
+	if (*request->host && !*request->user &&
+	    !host_is_pattern(request->host)) {
+		only = shard_owner(request->host);
+		if (only == conf->shard_self) {
+			return (0);
+		}
+	}
+
+	struct fanout *fanout = malloc(sizeof (struct fanout));
+	if (!fanout) {
+		exit(ENOMEM);
+	}
+	fanout->pending = 0;
+	fanout->num_parts = 0;
+	fanout->failed[0] = 0;
+	fanout->sort = request->sort;
+	fanout->json = request->json;
+	// Every shard answers with its first sessions, all of the first
+	// ones are among them
+	fanout->limit = (request->limit > 0 &&
+			request->limit < DFINGER_STACK_MAXSIZE ?
+			request->limit : DFINGER_STACK_MAXSIZE);
+	connections[idx].fanout = fanout;
+	request->keyed = 1;
+
+	if (only < 0) {
+		init_buffer(&fanout->parts[0], 0);
+		finger_process_request(request, &fanout->parts[0]);
+		fanout->num_parts = 1;
+	}
+
+	for (int i = 0; i < shard_count(); i++) {
+		if (i == conf->shard_self || (only >= 0 && i != only)) {
+			continue;
+		}
+
+		int part = fanout->num_parts++;
+		init_buffer(&fanout->parts[part], 0);
+		fanout->pending++;
+		open_peer(idx, part, shard_get(i), request);
+	}
+
+	socks[idx].events = 0;
+	if (!fanout->pending) {
+		finish_fanout(idx);
+	}
+
+	return (1);
+}
+
+static void open_peer(int owner, int part, struct shard *shard,
+			struct finger_request *request) {
+	int fd = -1;
+	if (shard->finger_addrlen) {
+		fd = socket(shard->finger_addr.ss_family, SOCK_STREAM, 0);
+	}
+
+	if (fd >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (connect(fd, (struct sockaddr *) &shard->finger_addr,
+				shard->finger_addrlen) != 0 &&
+		    errno != EINPROGRESS) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	int idx = -1;
+	if (fd >= 0 && (idx = add_connection(fd, peer)) < 0) {
+		close(fd);
+	}
+
+	if (idx < 0) {
+		struct fanout *fanout = connections[owner].fanout;
+		fanout->pending--;
+		size_t len = strlen(fanout->failed);
+		snprintf(fanout->failed + len, DFINGER_BUFFER_SIZE - len,
+			"Shard %s:%d not available\n",
+			shard->host, shard->finger_port);
+		return;
+	}
+
+	connections[idx].owner = owner;
+	connections[idx].part = part;
+	connections[idx].connecting = 1;
+	connections[idx].deadline = cur_msecs() + conf->shard_timeout;
+	char query[DFINGER_BUFFER_SIZE * 2 + DFINGER_LINE_SIZE + 32];
+	snprintf(query, sizeof (query), "%s:%d", shard->host,
+		shard->finger_port);
+	input_set(&connections[idx], query);
+
+	char after[DFINGER_BUFFER_SIZE];
+	after[0] = 0;
+	if (request->after) {
+		struct login_cursor *cursor = &request->cursor;
+		snprintf(after, sizeof (after), " /AFTER %lld,%s,%s,%s",
+			cursor->value, cursor->user, cursor->host,
+			cursor->line);
+	}
+	int len = snprintf(query, sizeof (query),
+			"/L%s%s /KEYS /SORT %s /LIMIT %lld%s%s%s %s%s%s\r\n",
+			conf->shard_token ? " /TOKEN " : "",
+			conf->shard_token ? conf->shard_token : "",
+			sort_keys[request->sort],
+			connections[owner].fanout->limit, after,
+			request->verbosity ? " /W" : "",
+			request->json ? " /J" : "", request->user,
+			*request->host ? "@" : "", request->host);
+	append_buffer(connections[idx].response, query, len);
+	socks[idx].events = POLLOUT;
+}
+
+/*
+ * Called once peer closes the connection, fails or times out.
+ */
+static void peer_done(int idx, int failed) {
+	int owner = connections[idx].owner;
+
+	if (owner >= 0 && connections[idx].part < 0) {
+		struct growing_buffer *response = connections[owner].response;
+		if (failed && !connections[idx].forwarded) {
+			char msg[DFINGER_BUFFER_SIZE + 40];
+			int len = snprintf(msg, sizeof (msg),
+					"Finger forwarding to %s failed\r\n",
+					connections[idx].buffer);
+			append_buffer(response, msg, len);
+		}
+		frame_response(owner, 1);
+		connections[owner].streaming = 0;
+		socks[owner].events = POLLOUT;
+	} else if (owner >= 0) {
+		struct fanout *fanout = connections[owner].fanout;
+		if (failed) {
+			size_t len = strlen(fanout->failed);
+			snprintf(fanout->failed + len,
+				DFINGER_BUFFER_SIZE - len,
+				"Shard %s not available\n",
+				connections[idx].buffer);
+			fanout->parts[connections[idx].part].len = 0;
+		}
+
+		fanout->pending--;
+		if (!fanout->pending) {
+			finish_fanout(owner);
+		}
+	}
+
+	free_connection(idx);
+}
+
+static void finish_fanout(int idx) {
+	struct fanout *fanout = connections[idx].fanout;
+	struct growing_buffer *response = connections[idx].response;
+
+	merge_parts(fanout, response);
+	if (fanout->json) {
+		// Every shard not available on its own line
+		char *line = fanout->failed;
+		char *nl;
+		while ((nl = strchr(line, '\n'))) {
+			json_message("error", line, nl - line, response);
+			line = nl + 1;
+		}
+	} else {
+		append_buffer(response, fanout->failed,
+				strlen(fanout->failed));
+	}
+	append_buffer(response, "\r\n", 2);
+	connections[idx].query_ready = cur_usecs();
+	frame_response(idx, 1);
+
+	for (int i = 0; i < fanout->num_parts; i++) {
+		free_buffer(&fanout->parts[i]);
+	}
+	free(fanout);
+	connections[idx].fanout = NULL;
+
+	response->offset = 0;
+	socks[idx].events = POLLOUT;
+}
+
+/*
+ * Every part is sorted and its lines start with their cursors, so the
+ * parts are merged by them rather than sorted again. The merged answer
+ * is cut at the limit every part was cut at.
+ */
+static void merge_parts(struct fanout *fanout,
+			struct growing_buffer *response) {
+	size_t pos[SHARD_MAX];
+	size_t end[SHARD_MAX];
+	struct login_cursor heads[SHARD_MAX];
+	int has[SHARD_MAX];
+	int more = 0;
+
+	for (int i = 0; i < fanout->num_parts; i++) {
+		struct growing_buffer *part = &fanout->parts[i];
+		pos[i] = 0;
+		end[i] = part->len;
+		// Drop the terminating CRLF
+		if (end[i] >= 2 && part->buffer[end[i]-2] == '\r') {
+			end[i] -= 2;
+		}
+		has[i] = next_part_line(fanout, i, &pos[i], end[i], &heads[i],
+					&more);
+	}
+
+	struct login_cursor last;
+	long long listed = 0;
+	while (1) {
+		int best = -1;
+		struct login_key best_key;
+		for (int i = 0; i < fanout->num_parts; i++) {
+			struct login_key key;
+			if (!has[i]) {
+				continue;
+			}
+
+			cursor_key(&heads[i], &key);
+			if (best < 0 ||
+			    cmp_keys(fanout->sort, &key, &best_key) < 0) {
+				best = i;
+				best_key = key;
+			}
+		}
+
+		if (best < 0) {
+			break;
+		}
+		if (listed == fanout->limit) {
+			more = 1;
+			break;
+		}
+
+		char *line = fanout->parts[best].buffer + pos[best];
+		char *nl = memchr(line, '\n', end[best] - pos[best]);
+		size_t len = (nl ? (size_t) (nl - line) + 1 :
+				end[best] - pos[best]);
+		char *row = memchr(line, ' ', len);
+		append_buffer(response, row + 1, len - (row + 1 - line));
+		pos[best] += len;
+		listed++;
+		last = heads[best];
+
+		has[best] = next_part_line(fanout, best, &pos[best], end[best],
+					&heads[best], &more);
+	}
+
+	if (more && listed) {
+		char buffer[DFINGER_BUFFER_SIZE];
+		int len = snprintf(buffer, sizeof (buffer), "%lld,%s,%s,%s",
+				last.value, last.user, last.host, last.line);
+		if (fanout->json) {
+			json_message("next", buffer, len, response);
+		} else {
+			append_buffer(response, "!!! NEXT ", 9);
+			append_buffer(response, buffer, len);
+			append_buffer(response, "\n", 1);
+		}
+	}
+}
+
+/*
+ * Finds the next line of part with session and parses its cursor, returns
+ * 0 if there's none. Mark of next page sets more.
+ */
+static int next_part_line(struct fanout *fanout, int part, size_t *pos,
+			size_t end, struct login_cursor *cursor, int *more) {
+	char *buffer = fanout->parts[part].buffer;
+
+	while (*pos < end) {
+		char *line = buffer + *pos;
+		char *nl = memchr(line, '\n', end - *pos);
+		size_t len = (nl ? (size_t) (nl - line) + 1 : end - *pos);
+
+		if (len > 9 && strncmp(line, "!!! NEXT ", 9) == 0) {
+			*more = 1;
+		} else if (nl) {
+			// Cursor is parsed from a copy ended by the newline
+			char copy[DFINGER_BUFFER_SIZE];
+			size_t copy_len = (len < sizeof (copy) ?
+					len : sizeof (copy) - 1);
+			memcpy(copy, line, copy_len);
+			copy[copy_len] = 0;
+			char *rest = parse_cursor(copy, cursor);
+			if (rest && *rest == ' ') {
+				return (1);
+			}
+		}
+		*pos += len;
+	}
+
+	return (0);
+}
+
+static void handle_peer(int idx, short revents) {
+	struct connection *con = &connections[idx];
+
+	if (con->connecting && revents & (POLLOUT | POLLERR | POLLHUP)) {
+		int err = 0;
+		socklen_t err_len = sizeof (err);
+		if (getsockopt(socks[idx].fd, SOL_SOCKET, SO_ERROR, &err,
+				&err_len) != 0 || err) {
+			peer_done(idx, 1);
+			return;
+		}
+		con->connecting = 0;
+	}
+
+	if (revents & POLLOUT) {
+		if (write_response(socks[idx].fd, con->response) < 0) {
+			peer_done(idx, 1);
+			return;
+		}
+		if (con->response->offset == con->response->len) {
+			socks[idx].events = POLLIN;
+		}
+		return;
+	}
+
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		char buffer[DFINGER_BUFFER_SIZE];
+		ssize_t num_read = read(socks[idx].fd, buffer,
+					DFINGER_BUFFER_SIZE);
+		if (num_read <= 0) {
+			peer_done(idx, num_read < 0);
+			return;
+		}
+
+		if (con->owner >= 0 && con->part < 0) {
+			struct growing_buffer *response =
+			    connections[con->owner].response;
+			append_buffer(response, buffer, num_read);
+			frame_response(con->owner, 0);
+			con->forwarded += num_read;
+			con->deadline = cur_msecs() + conf->forward_timeout;
+			socks[con->owner].events = POLLOUT;
+			if (response->max_size - response->len <
+			    DFINGER_BUFFER_SIZE) {
+				// Wait for the client to take it
+				socks[idx].events = 0;
+			}
+		} else if (con->owner >= 0) {
+			struct fanout *fanout = connections[con->owner].fanout;
+			append_buffer(&fanout->parts[con->part], buffer,
+					num_read);
+		}
+	}
+}
+
+static void finger_process_request(struct finger_request *request,
+					struct growing_buffer *response) {
+	if (request->forward) {
+		finger_forward_request(request, response);
+		return;
+	}
+
+	if (request->type == QUERY_REPL) {
+		repl_status(response);
+		append_buffer(response, "\r\n", 2);
+		return;
+	}
+
+	if (request->type == QUERY_SLOW) {
+		slowlog_report(response);
+		append_buffer(response, "\r\n", 2);
+		return;
+	}
+
+	if (request->type == QUERY_METRICS) {
+		metrics_report(response);
+		append_buffer(response, "\r\n", 2);
+		return;
+	}
+
+	if (request->type == QUERY_STATS) {
+		stats_report(request, response);
+		append_buffer(response, "\r\n", 2);
+		return;
+	}
+
+	if (request->type == QUERY_DISTINCT) {
+		distinct_report(request, response);
+		append_buffer(response, "\r\n", 2);
+		return;
+	}
+
+	if (request->type == QUERY_HISTORY || request->type == QUERY_LAST) {
+		history_query(request, response);
+		append_buffer(response, "\r\n", 2);
+		return;
+	}
+
+	TRACE_BEGIN("collect");
+	struct login_stack stack;
+	stack_init(&stack, 0);
+	stack_order(&stack, request);
+
+	if (*(request->user)) {
+		struct user *user = ulist;
+		while ((user = fetch_next_user(user, request->user))) {
+			get_logins_user(&stack, user, request->host);
+			user = user->next;
+		}
+	} else {
+		if (host_is_pattern(request->host)) {
+			size_t pos, end;
+			pos = host_first(request->host, &end);
+			struct machine *machine;
+			while ((machine = host_next(request->host, &pos, end))) {
+				get_logins_machine(&stack, machine);
+			}
+		} else if (*(request->host)) {
+			struct machine *machine = find_machine(request->host);
+			get_logins_machine(&stack, machine);
+		} else {
+			struct machine *machine = mlist;
+			while (machine) {
+				get_logins_machine(&stack, machine);
+				machine = machine->next;
+			}
+		}
+	}
+
+	TRACE_END("collect");
+
+	char buffer[DFINGER_BUFFER_SIZE];
+
+	TRACE_BEGIN("sort");
+	stack_sort(&stack);
+	TRACE_END("sort");
+
+	TRACE_BEGIN("format");
+	for (size_t i = 0; i < stack.end; i++) {
+		int len = 0;
+		if (request->keyed) {
+			len = sprint_cursor(stack.stack[i], request->sort,
+					buffer, DFINGER_BUFFER_SIZE - 1);
+			buffer[len++] = ' ';
+		}
+		if (request->json) {
+			append_buffer(response, buffer, len);
+			json_login(stack.stack[i], response);
+			continue;
+		}
+		len += sprint_login(stack.stack[i], buffer + len,
+					DFINGER_BUFFER_SIZE - len);
+		append_buffer(response, buffer, len);
+	}
+	if (stack.dropped && stack.end && request->json && !request->keyed) {
+		int len = sprint_cursor(stack.stack[stack.end - 1],
+					request->sort, buffer,
+					DFINGER_BUFFER_SIZE);
+		json_message("next", buffer, len, response);
+	} else if (stack.dropped && stack.end) {
+		// Next page starts after the last listed session
+		int len = snprintf(buffer, DFINGER_BUFFER_SIZE, "!!! NEXT ");
+		len += sprint_cursor(stack.stack[stack.end - 1], request->sort,
+				buffer + len, DFINGER_BUFFER_SIZE - len - 1);
+		buffer[len++] = '\n';
+		append_buffer(response, buffer, len);
+	}
+	TRACE_END("format");
+
+	append_buffer(response, "\r\n", 2);
+
+	stack_free(&stack);
+}
+
+static void finger_parse_request(char *request_str,
+				struct finger_request *request) {
+	char *first_at_sign = strchr(request_str, '@');
+	char *last_at_sign = strrchr(request_str, '@');
+	if (first_at_sign != last_at_sign) {
+		// Query user@hostA@hostB is sent as user@hostA to hostB
+		request->forward = 1;
+	}
+
+	char *end = strchr(request_str, 13);
+	if (!end) {
+		// Invalid request
+	}
+	// Shall request be checked for *(end+1) == 10?
+
+	if (last_at_sign) {
+		char *host_start = last_at_sign;
+		host_start++;
+		strncpy(request->host, host_start, (end - host_start));
+		request->host[end-host_start] = 0;
+		end = last_at_sign;
+	} else {
+		request->host[0] = 0;
+	}
+
+	char *ptr = request_str;
+	while (*ptr == ' ') {
+		// This is more liberal than standard -- does it mind?
+		ptr++;
+	}
+
+	while (*ptr == '/') {
+		if (strncmp(ptr+1, "REPL", 4) == 0) {
+			request->type = QUERY_REPL;
+			ptr += 5;
+			continue;
+		}
+
+		if (strncmp(ptr+1, "METRICS", 7) == 0) {
+			request->type = QUERY_METRICS;
+			ptr += 8;
+			continue;
+		}
+
+		if (strncmp(ptr+1, "SLOW", 4) == 0) {
+			request->type = QUERY_SLOW;
+			ptr += 5;
+			continue;
+		}
+
+		if (strncmp(ptr+1, "DISTINCT", 8) == 0) {
+			request->type = QUERY_DISTINCT;
+			request->count = strtoll(ptr + 9, &ptr, 10);
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			continue;
+		}
+
+		if (strncmp(ptr+1, "STATS", 5) == 0) {
+			request->type = QUERY_STATS;
+			ptr += 6;
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			continue;
+		}
+
+		if (strncmp(ptr+1, "HIST", 4) == 0) {
+			request->type = QUERY_HISTORY;
+			request->from = strtoll(ptr + 5, &ptr, 10);
+			request->to = strtoll(ptr, &ptr, 10);
+			if (!request->to) {
+				request->to = cur_secs();
+			}
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			continue;
+		}
+
+		if (strncmp(ptr+1, "LAST", 4) == 0) {
+			request->type = QUERY_LAST;
+			request->count = strtoll(ptr + 5, &ptr, 10);
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			continue;
+		}
+
+		if (strncmp(ptr+1, "SORT", 4) == 0) {
+			ptr += 5;
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			size_t len = strcspn(ptr, " @\r\n");
+			for (int i = 0; i < NUM_SORT_KEYS; i++) {
+				if (strlen(sort_keys[i]) == len &&
+				    strncmp(ptr, sort_keys[i], len) == 0) {
+					request->sort = i;
+				}
+			}
+			ptr += len;
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			continue;
+		}
+
+		if (strncmp(ptr+1, "LIMIT", 5) == 0) {
+			request->limit = strtoll(ptr + 6, &ptr, 10);
+			if (request->limit < 0) {
+				request->limit = 0;
+			}
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			continue;
+		}
+
+		if (strncmp(ptr+1, "TOKEN", 5) == 0) {
+			ptr += 6;
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			size_t len = strcspn(ptr, " \r\n");
+			request->shard_token = shard_token_matches(ptr, len);
+			// Token doesn't get to the slow log
+			memset(ptr, '*', len);
+			ptr += len;
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			continue;
+		}
+
+		if (strncmp(ptr+1, "AFTER", 5) == 0) {
+			ptr += 6;
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			char *next = parse_cursor(ptr, &request->cursor);
+			request->after = (next != NULL);
+			ptr = (next ? next : ptr + strcspn(ptr, " \r\n"));
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			continue;
+		}
+
+		if (strncmp(ptr+1, "KEYS", 4) == 0) {
+			request->keyed = 1;
+			ptr += 5;
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			continue;
+		}
+
+		if (strncmp(ptr+1, "WATCH", 5) == 0) {
+			request->watch = 1;
+			ptr += 6;
+			while (*ptr == ' ') {
+				ptr++;
+			}
+			continue;
+		}
+
+		switch (*(ptr+1)) {
+			case 'W':
+				request->verbosity = 1;
+				break;
+			case 'L':
+				request->local = 1;
+				break;
+			case 'K':
+				request->keepalive = 1;
+				break;
+			case 'J':
+				request->json = 1;
+				break;
+			default:
+				break;
+		}
+		ptr += 2;
+
+		while (*ptr == ' ') {
+			ptr++;
+		}
+	}
+
+	strncpy(request->user, ptr, (end - ptr));
+	request->user[end-ptr] = 0;
+}
+
+static void count_logins(struct login_data *login, long long *current,
+				long long *past) {
 	while (login) {
-		stack_add(&stack, login);
+		if (login->idle_time >= 0) {
+			(*current)++;
+		} else {
+			(*past)++;
+		}
 		login = login->next_by_machine;
 	}
+}
+
+/*
+ * Answers /METRICS in Prometheus text format. Sizes of lists are
+ * counted now, so metrics cost nothing until somebody asks for them.
+ */
+static void metrics_report(struct growing_buffer *out) {
+	char labels[DFINGER_LINE_SIZE];
+
+	metrics_type(out, "dfinger_ingest_lines_total", "counter",
+			"Lines of client updates received");
+	metrics_value(out, "dfinger_ingest_lines_total", "", ingest_lines);
+	metrics_type(out, "dfinger_ingest_bytes_total", "counter",
+			"Bytes of client updates received");
+	metrics_value(out, "dfinger_ingest_bytes_total", "", ingest_bytes);
+	metrics_type(out, "dfinger_queries_total", "counter",
+			"Finger queries received");
+	metrics_value(out, "dfinger_queries_total", "", queries);
+	metrics_type(out, "dfinger_io_syscalls_total", "counter",
+			"System calls waiting for and moving client updates "
+			"and finger answers");
+	metrics_value(out, "dfinger_io_syscalls_total", "",
+			io_syscalls + ring.enters);
+	metrics_type(out, "dfinger_io_backend", "gauge",
+			"Backend of the server loop");
+	metrics_value(out, "dfinger_io_backend", (uring_active ?
+			"backend=\"uring\"" : "backend=\"poll\""), 1);
+	struct buffer_pool_stats pool;
+	pool_stats(&pool);
+	metrics_type(out, "dfinger_input_buffer_bytes", "gauge",
+			"Pooled input buffers held by connections or kept free");
+	metrics_value(out, "dfinger_input_buffer_bytes", "state=\"used\"",
+			pool.used_bytes);
+	metrics_value(out, "dfinger_input_buffer_bytes", "state=\"free\"",
+			pool.free_bytes);
+	metrics_type(out, "dfinger_input_buffer_gets_total", "counter",
+			"Input buffers taken by connections");
+	metrics_value(out, "dfinger_input_buffer_gets_total",
+			"source=\"pool\"", pool.reuses);
+	metrics_value(out, "dfinger_input_buffer_gets_total",
+			"source=\"malloc\"", pool.gets - pool.reuses);
+
+	metrics_type(out, "dfinger_update_seconds", "histogram",
+			"Time of processing client update read");
+	metrics_histogram(out, "dfinger_update_seconds", "", &update_latency);
+	metrics_type(out, "dfinger_query_seconds", "histogram",
+			"Time from finger query to its answer written");
+	for (int i = 0; i < NUM_QUERY_KINDS; i++) {
+		snprintf(labels, DFINGER_LINE_SIZE, "type=\"%s\"",
+			query_kinds[i]);
+		metrics_histogram(out, "dfinger_query_seconds", labels,
+				&query_latency[i]);
+	}
+
+	metrics_type(out, "dfinger_dump_seconds", "histogram",
+			"Time of writing the dump file");
+	metrics_histogram(out, "dfinger_dump_seconds", "", &dump_duration);
+	metrics_type(out, "dfinger_dump_segments_written_total", "counter",
+			"Segments of the dump written with changed machines");
+	metrics_value(out, "dfinger_dump_segments_written_total", "",
+			segments_written);
+	metrics_type(out, "dfinger_housekeeping_seconds", "histogram",
+			"Time of housekeeping sweeps");
+	metrics_histogram(out, "dfinger_housekeeping_seconds",
+			"task=\"check_machines\"", &check_duration);
+	metrics_histogram(out, "dfinger_housekeeping_seconds",
+			"task=\"clear_old_records\"", &clear_duration);
+	metrics_histogram(out, "dfinger_housekeeping_seconds",
+			"task=\"cut_records\"", &cut_duration);
+
+	long long by_type[sizeof (connection_types) / sizeof (char *)];
+	memset(by_type, 0, sizeof (by_type));
+	for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+		by_type[connections[i].type]++;
+	}
+	metrics_type(out, "dfinger_connections", "gauge",
+			"Open connections by type");
+	for (size_t i = 0; i < sizeof (by_type) / sizeof (long long); i++) {
+		snprintf(labels, DFINGER_LINE_SIZE, "type=\"%s\"",
+			connection_types[i]);
+		metrics_value(out, "dfinger_connections", labels, by_type[i]);
+	}
+	metrics_type(out, "dfinger_refused_connections_total", "counter",
+			"Connections closed as their class was full");
+	for (int i = 0; i < NUM_CONNECTION_TYPES; i++) {
+		if (i == client || i == finger || i == replica) {
+			snprintf(labels, DFINGER_LINE_SIZE, "type=\"%s\"",
+				connection_types[i]);
+			metrics_value(out, "dfinger_refused_connections_total",
+					labels, refused[i]);
+		}
+	}
+	metrics_type(out, "dfinger_reclaimed_connections_total", "counter",
+			"Finger connections closed by their deadline");
+	metrics_value(out, "dfinger_reclaimed_connections_total",
+			"reason=\"read\"", reclaimed_read);
+	metrics_value(out, "dfinger_reclaimed_connections_total",
+			"reason=\"idle\"", reclaimed_idle);
+	metrics_type(out, "dfinger_shed_queries_total", "counter",
+			"Queries refused for lack of tokens");
+	for (int i = 0; i < NUM_QUERY_KINDS; i++) {
+		snprintf(labels, DFINGER_LINE_SIZE, "kind=\"%s\"",
+			query_kinds[i]);
+		metrics_value(out, "dfinger_shed_queries_total", labels,
+				shed[i]);
+	}
+	metrics_type(out, "dfinger_query_tokens", "gauge",
+			"Tokens left in the query bucket");
+	metrics_value(out, "dfinger_query_tokens", "", (long long) query_tokens);
+
+	long long num_users = 0, num_machines = 0, current = 0, past = 0;
+	long long sketch_bytes = hll_bytes(&fleet_distinct);
+	for (struct user *user = ulist; user; user = user->next) {
+		num_users++;
+	}
+	for (struct machine *machine = mlist; machine;
+	    machine = machine->next) {
+		num_machines++;
+		count_logins(machine->logins, &current, &past);
+		count_logins(machine->past_logins, &current, &past);
+		sketch_bytes += hll_bytes(&machine->distinct);
+	}
+	metrics_type(out, "dfinger_users", "gauge", "Users known");
+	metrics_value(out, "dfinger_users", "", num_users);
+	metrics_type(out, "dfinger_machines", "gauge", "Machines known");
+	metrics_value(out, "dfinger_machines", "", num_machines);
+	metrics_type(out, "dfinger_logins", "gauge", "Logins kept");
+	metrics_value(out, "dfinger_logins", "state=\"current\"", current);
+	metrics_value(out, "dfinger_logins", "state=\"past\"", past);
+	metrics_type(out, "dfinger_distinct_sketch_bytes", "gauge",
+			"Memory of sketches of distinct users");
+	metrics_value(out, "dfinger_distinct_sketch_bytes", "", sketch_bytes);
+}
+
+/*
+ * Counts login starting (delta 1) or ending (delta -1) to be current one.
+ */
+static void stats_login(struct login_data *login, int delta) {
+	struct machine *machine = login->machine;
+	struct user *user = login->user;
+
+	stats_sessions += delta;
+	machine->active += delta;
+	if (machine->active == (delta > 0)) {
+		stats_active_machines += delta;
+	}
+	user->active += delta;
+	if (user->active == (delta > 0)) {
+		stats_active_users += delta;
+	}
+	stats_fix(machine->stats_pos);
+}
+
+static void stats_swap(size_t i, size_t j) {
+	struct machine *tmp = stats_heap[i];
+	stats_heap[i] = stats_heap[j];
+	stats_heap[j] = tmp;
+	stats_heap[i]->stats_pos = i;
+	stats_heap[j]->stats_pos = j;
+}
+
+/*
+ * Moves machine at pos up or down the heap after its count changed.
+ */
+static void stats_fix(size_t pos) {
+	while (pos > 0 && stats_heap[(pos - 1) / 2]->active <
+	    stats_heap[pos]->active) {
+		stats_swap(pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
+
+	for (;;) {
+		size_t largest = pos;
+		size_t child = 2 * pos + 1;
+		for (int i = 0; i < 2; i++, child++) {
+			if (child < stats_heap_len &&
+			    stats_heap[child]->active >
+			    stats_heap[largest]->active) {
+				largest = child;
+			}
+		}
+		if (largest == pos) {
+			break;
+		}
+		stats_swap(pos, largest);
+		pos = largest;
+	}
+}
+
+static void stats_insert(struct machine *machine) {
+	if (stats_heap_len == stats_heap_size) {
+		stats_heap_size = (stats_heap_size ? stats_heap_size * 2 : 64);
+		stats_heap = realloc(stats_heap,
+				stats_heap_size * sizeof (struct machine *));
+		if (!stats_heap) {
+			exit(ENOMEM);
+		}
+	}
+
+	machine->stats_pos = stats_heap_len;
+	stats_heap[stats_heap_len++] = machine;
+	stats_fix(machine->stats_pos);
+}
+
+static void stats_remove(struct machine *machine) {
+	size_t pos = machine->stats_pos;
+	stats_heap_len--;
+	if (pos < stats_heap_len) {
+		stats_heap[pos] = stats_heap[stats_heap_len];
+		stats_heap[pos]->stats_pos = pos;
+		stats_fix(pos);
+	}
+}
+
+/*
+ * Answers /STATS with totals and the busiest machines (as many as /LIMIT
+ * asks for), or with counts of the user and machine asked for.
+ */
+static void stats_report(struct finger_request *request,
+				struct growing_buffer *response) {
+	char line[DFINGER_LINE_SIZE];
+	int len;
+
+	if (*request->user || *request->host) {
+		struct user *user = NULL;
+		struct machine *machine = NULL;
+		if (*request->user && (user = find_user(request->user))) {
+			len = snprintf(line, DFINGER_LINE_SIZE,
+					"user %s %d\n", user->username,
+					user->active);
+			append_buffer(response, line, len);
+		}
+		size_t pos = 0, end = 0;
+		if (host_is_pattern(request->host)) {
+			pos = host_first(request->host, &end);
+			machine = host_next(request->host, &pos, end);
+		} else if (*request->host) {
+			machine = find_machine(request->host);
+		}
+		while (machine) {
+			len = snprintf(line, DFINGER_LINE_SIZE,
+					"machine %s %d\n", machine->hostname,
+					machine->active);
+			append_buffer(response, line, len);
+			machine = host_next(request->host, &pos, end);
+		}
+		return;
+	}
+
+	len = snprintf(line, DFINGER_LINE_SIZE,
+			"sessions %lld\nusers %lld\nactive_users %lld\n"
+			"machines %zu\nactive_machines %lld\n",
+			stats_sessions, stats_users, stats_active_users,
+			stats_heap_len, stats_active_machines);
+	append_buffer(response, line, len);
+
+	stats_top(request->limit ? request->limit : DFINGER_STATS_TOP,
+			response);
+}
+
+/*
+ * Lists count busiest machines. Children of listed machines are the only
+ * candidates for the next one, so they are kept in a small heap of their
+ * own and the answer takes O(count log count).
+ */
+static void stats_top(long long count, struct growing_buffer *response) {
+	if (count > (long long) stats_active_machines) {
+		count = stats_active_machines;
+	}
+	if (count <= 0) {
+		return;
+	}
+
+	size_t *next = malloc((count + 1) * sizeof (size_t));
+	if (!next) {
+		exit(ENOMEM);
+	}
+	size_t num_next = 1;
+	next[0] = 0;
+
+	char line[DFINGER_LINE_SIZE];
+	for (long long listed = 0; listed < count; listed++) {
+		struct machine *machine = stats_heap[next[0]];
+		int len = snprintf(line, DFINGER_LINE_SIZE, "busiest %s %d\n",
+				machine->hostname, machine->active);
+		append_buffer(response, line, len);
+
+		// Top candidate is replaced by its children
+		size_t child = 2 * next[0] + 1;
+		next[0] = next[--num_next];
+		stats_top_fix(next, num_next, 0);
+		for (int i = 0; i < 2; i++, child++) {
+			if (child < stats_heap_len) {
+				next[num_next++] = child;
+				stats_top_fix(next, num_next, num_next - 1);
+			}
+		}
+	}
+
+	free(next);
+}
+
+/*
+ * Moves candidate at pos up or down the heap of candidates, which are
+ * positions in stats_heap.
+ */
+static void stats_top_fix(size_t *next, size_t num_next, size_t pos) {
+	while (pos > 0 && stats_heap[next[(pos - 1) / 2]]->active <
+	    stats_heap[next[pos]]->active) {
+		size_t tmp = next[pos];
+		next[pos] = next[(pos - 1) / 2];
+		next[(pos - 1) / 2] = tmp;
+		pos = (pos - 1) / 2;
+	}
+
+	for (;;) {
+		size_t largest = pos;
+		size_t child = 2 * pos + 1;
+		for (int i = 0; i < 2; i++, child++) {
+			if (child < num_next && stats_heap[next[child]]->active >
+			    stats_heap[next[largest]]->active) {
+				largest = child;
+			}
+		}
+		if (largest == pos) {
+			break;
+		}
+		size_t tmp = next[pos];
+		next[pos] = next[largest];
+		next[largest] = tmp;
+		pos = largest;
+	}
+}
+
+/*
+ * Answers /DISTINCT days [@host] with estimate of distinct users who
+ * logged in within the last days (all that are kept by default).
+ */
+static void distinct_report(struct finger_request *request,
+				struct growing_buffer *response) {
+	struct hll *sketch = &fleet_distinct;
+	struct hll matching;
+	hll_init(&matching);
+	if (host_is_pattern(request->host)) {
+		// Users of all matching machines are counted once
+		size_t pos, end;
+		pos = host_first(request->host, &end);
+		struct machine *machine;
+		while ((machine = host_next(request->host, &pos, end))) {
+			hll_merge(&matching, &machine->distinct);
+		}
+		sketch = &matching;
+	} else if (*request->host) {
+		struct machine *machine = find_machine(request->host);
+		if (!machine) {
+			return;
+		}
+		sketch = &machine->distinct;
+	}
+
+	long long days = request->count;
+	if (days <= 0 || days > conf->distinct_days) {
+		days = conf->distinct_days;
+	}
+	long long today = cur_secs() / DFINGER_DAY;
+
+	char line[DFINGER_LINE_SIZE];
+	int len = snprintf(line, DFINGER_LINE_SIZE, "distinct_users %lld\n",
+			hll_estimate(sketch, today - days + 1, today));
+	append_buffer(response, line, len);
+	hll_free(&matching);
+}
+
+/*
+ * Drops sketches of days older than DISTINCT_DAYS.
+ */
+static void distinct_expire(void) {
+	long long first_day = cur_secs() / DFINGER_DAY - conf->distinct_days + 1;
+
+	for (struct machine *machine = mlist; machine;
+	    machine = machine->next) {
+		hll_expire(&machine->distinct, first_day);
+	}
+	hll_expire(&fleet_distinct, first_day);
+}
+
+static long long lap(long long *mark) {
+	long long now = cur_usecs();
+	long long elapsed = now - *mark;
+	*mark = now;
+
+	return (elapsed);
+}
+
+/*
+ * Logs finger query whose answer took too long, with the time spent
+ * preparing and sending it.
+ */
+static void slow_query(int idx) {
+	struct connection *con = &connections[idx];
+	long long now = cur_usecs();
+	long long total = now - con->query_start;
+	if (!conf->slow_threshold || total < conf->slow_threshold * 1000LL) {
+		return;
+	}
+
+	long long ready = (con->query_ready ? con->query_ready : now);
+	struct growing_buffer *response = con->response;
+	long long lines = 0;
+	for (size_t i = 0; i < response->len; i++) {
+		lines += (response->buffer[i] == '\n');
+	}
+
+	slowlog_add("query", total, "type=%s process=%.3fms write=%.3fms "
+			"lines=%lld bytes=%zu query=\"%s\"",
+			query_kinds[con->query_kind],
+			(ready - con->query_start) / 1000.0,
+			(now - ready) / 1000.0, lines, response->len,
+			con->query);
+}
+
+static void slow_update(struct connection *con, long long usecs,
+			long long lines, ssize_t bytes) {
+	if (!conf->slow_threshold || usecs < conf->slow_threshold * 1000LL) {
+		return;
+	}
+
+	slowlog_add("update", usecs, "machine=%s lines=%lld bytes=%zd",
+			(con->machine ? con->machine->hostname : "-"),
+			lines, bytes);
+}
+
+/*
+ * Logs server loop iteration which took too long, with time of its
+ * phases, number of sockets it handled and sizes of the store.
+ */
+static void slow_tick(long long *phases, long long usecs, int ready) {
+	if (!conf->slow_threshold || usecs < conf->slow_threshold * 1000LL) {
+		return;
+	}
+
+	long long num_users = 0, num_machines = 0, current = 0, past = 0;
+	for (struct user *user = ulist; user; user = user->next) {
+		num_users++;
+	}
+	for (struct machine *machine = mlist; machine;
+	    machine = machine->next) {
+		num_machines++;
+		count_logins(machine->logins, &current, &past);
+		count_logins(machine->past_logins, &current, &past);
+	}
+
+	slowlog_add("tick", usecs, "events=%.3fms flush=%.3fms dump=%.3fms "
+			"check=%.3fms clear=%.3fms cut=%.3fms ready=%d "
+			"connections=%d users=%lld machines=%lld logins=%lld "
+			"past=%lld", phases[TICK_EVENTS] / 1000.0,
+			phases[TICK_FLUSH] / 1000.0, phases[TICK_DUMP] / 1000.0,
+			phases[TICK_CHECK] / 1000.0,
+			phases[TICK_CLEAR] / 1000.0, phases[TICK_CUT] / 1000.0,
+			ready, connections_used - LISTEN_SOCKS, num_users,
+			num_machines, current, past);
+}
+
+/*
+ * Formats login event, line has DFINGER_LINE_SIZE bytes.
+ */
+static int sprint_event(char type, struct login_data *login, char *line) {
+	int len = snprintf(line, DFINGER_LINE_SIZE,
+			"%c %s %s %s %lld %lld %s %lld \n",
+			type, login->machine->hostname, login->user->username,
+			login->line, login->login_time, login->idle_time,
+			login->host, login->logout_time);
+	if (len >= DFINGER_LINE_SIZE) {
+		line[DFINGER_LINE_SIZE - 2] = '\n';
+		len = DFINGER_LINE_SIZE - 1;
+	}
+
+	return (len);
+}
+
+/*
+ * Watch: query /WATCH [user][@host] is answered with current sessions
+ * as usual, followed by lines of login events as they happen, in the
+ * format used by replication (+ login, = idle time, - logout).
+ * Every event is formatted once into watch_log, which all watchers
+ * send from, each from its own position. The log is trimmed once all
+ * of them sent its start; watcher more than WATCH_BACKLOG bytes behind
+ * or behind the start of the log is disconnected.
+ */
+static void finger_watch(int idx, struct finger_request *request) {
+	struct connection *con = &connections[idx];
+
+	output_init(con, conf->watch_backlog);
+	finger_process_request(request, con->response);
+	histogram_observe(&query_latency[QUERY_WATCH],
+			cur_usecs() - con->query_start);
+
+	con->watch = malloc(sizeof (struct finger_request));
+	if (!con->watch) {
+		exit(ENOMEM);
+	}
+	memcpy(con->watch, request, sizeof (struct finger_request));
+	con->type = watcher;
+	conns_by_type[finger]--;
+	conns_by_type[watcher]++;
+	con->keepalive = 0;
+	con->watch_pos = watch_base + watch_log.len;
+	con->watch_partial = 0;
+	num_watchers++;
+
+	socks[idx].events = POLLIN | POLLOUT;
+}
+
+static void watch_event(char type, struct login_data *login) {
+	if (!num_watchers) {
+		return;
+	}
+
+	char line[DFINGER_LINE_SIZE];
+	int len = sprint_event(type, login, line);
+	if (watch_log.max_size - watch_log.len < (size_t) len) {
+		watch_trim(len);
+	}
+	append_buffer(&watch_log, line, len);
+}
+
+/*
+ * Makes room for len bytes in full watch_log by trimming its start up
+ * to the first watcher which doesn't need it. Watchers behind the new
+ * start are disconnected by watch_flush, the others keep their events.
+ */
+static void watch_trim(size_t len) {
+	long long end = watch_base + watch_log.len;
+	long long cut = end + len - watch_log.max_size;
+	long long min_pos = end;
+	for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+		if (connections[i].type == watcher &&
+		    connections[i].watch_pos >= cut &&
+		    connections[i].watch_pos < min_pos) {
+			min_pos = connections[i].watch_pos;
+		}
+	}
+
+	size_t sent = min_pos - watch_base;
+	move_buffer(watch_log.buffer, watch_log.len, &sent);
+	watch_log.len = sent;
+	watch_base = min_pos;
+}
+
+static int watch_matches(struct finger_request *watch, char *event) {
+	char *host = event + 2;
+	char *user = strchr(host, ' ') + 1;
+	size_t host_len = user - 1 - host;
+	size_t user_len = strchr(user, ' ') - user;
+
+	if (*watch->host) {
+		char hostname[UT_HOSTSIZE];
+		if (host_len >= UT_HOSTSIZE) {
+			return (0);
+		}
+		memcpy(hostname, host, host_len);
+		hostname[host_len] = 0;
+		if (!host_matches(watch->host, hostname)) {
+			return (0);
+		}
+	}
+
+	if (*watch->user && (strlen(watch->user) != user_len ||
+	    strncmp(watch->user, user, user_len) != 0)) {
+		return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * Called once per main loop iteration, wakes up watchers with events
+ * to send, drops those too far behind and trims the log.
+ */
+static void watch_flush(void) {
+	if (!num_watchers) {
+		watch_base += watch_log.len;
+		watch_log.len = 0;
+		return;
+	}
+
+	long long end = watch_base + watch_log.len;
+	long long min_pos = end;
+	for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+		if (connections[i].type != watcher) {
+			continue;
+		}
+
+		if (connections[i].watch_pos < watch_base ||
+		    end - connections[i].watch_pos > conf->watch_backlog) {
+			fprintf(stderr, "Watcher too slow, disconnecting\n");
+			free_connection(i);
+			i--;
+			continue;
+		}
+
+		if (connections[i].watch_pos < end) {
+			socks[i].events = POLLIN | POLLOUT;
+		}
+		if (connections[i].watch_pos < min_pos) {
+			min_pos = connections[i].watch_pos;
+		}
+	}
+
+	size_t sent = min_pos - watch_base;
+	if (sent) {
+		move_buffer(watch_log.buffer, watch_log.len, &sent);
+		watch_log.len = sent;
+		watch_base = min_pos;
+	}
+}
+
+/*
+ * Sends events matching the watcher's query straight from watch_log.
+ */
+static void handle_watcher(int idx, short revents) {
+	struct connection *con = &connections[idx];
+
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		// Watchers don't send anything more, so it's a hangup
+		char buffer[DFINGER_BUFFER_SIZE];
+		if (read(socks[idx].fd, buffer, DFINGER_BUFFER_SIZE) <= 0) {
+			free_connection(idx);
+			return;
+		}
+	}
+
+	if (!(revents & POLLOUT)) {
+		return;
+	}
+
+	if (con->watch_pos < watch_base) {
+		// Its events were trimmed from the full log
+		fprintf(stderr, "Watcher too slow, disconnecting\n");
+		free_connection(idx);
+		return;
+	}
+
+	// Answer to the query itself goes first
+	if (con->response->offset < con->response->len) {
+		if (write_response(socks[idx].fd, con->response) < 0) {
+			free_connection(idx);
+		}
+		return;
+	}
+
+	struct iovec iov[DFINGER_WATCH_IOV];
+	size_t iov_start[DFINGER_WATCH_IOV];
+	int num_iov = 0;
+	size_t pos = con->watch_pos - watch_base;
+	size_t scan = pos;
+	while (scan < watch_log.len) {
+		char *event = watch_log.buffer + scan;
+		char *eol = memchr(event, '\n', watch_log.len - scan);
+		size_t len = eol + 1 - event;
+
+		if ((scan == pos && con->watch_partial) ||
+		    watch_matches(con->watch, event)) {
+			if (num_iov && iov_start[num_iov-1] +
+			    iov[num_iov-1].iov_len == scan) {
+				iov[num_iov-1].iov_len += len;
+			} else if (num_iov < DFINGER_WATCH_IOV) {
+				iov[num_iov].iov_base = event;
+				iov[num_iov].iov_len = len;
+				iov_start[num_iov] = scan;
+				num_iov++;
+			} else {
+				break;
+			}
+		}
+		scan += len;
+	}
+
+	ssize_t written = 0;
+	if (num_iov) {
+		written = writev(socks[idx].fd, iov, num_iov);
+		if (written < 0) {
+			free_connection(idx);
+			return;
+		}
+	}
+
+	for (int i = 0; i < num_iov; i++) {
+		if ((size_t) written < iov[i].iov_len) {
+			scan = iov_start[i] + written;
+			break;
+		}
+		written -= iov[i].iov_len;
+	}
+
+	con->watch_pos = watch_base + scan;
+	con->watch_partial = scan > 0 && watch_log.buffer[scan-1] != '\n';
+	if (scan == watch_log.len) {
+		socks[idx].events = POLLIN;
+	}
+}
+
+/*
+ * Replication: replica connects to REPL_PORT of the primary, receives
+ * snapshot of all machines and logins and then stream of changes, one
+ * per line:
+ *	M host				machine added
+ *	+ host user line login idle from	login added
+ *	p host user line login idle from	past login (snapshot only)
+ *	= host user line login idle from	idle time changed
+ *	- host user line login idle from	login ended
+ *	T msecs				time of the primary
+ * Snapshot is enclosed in lines S and E. Changes are collected in repl_log
+ * during one iteration of main loop and then appended to output buffers
+ * of all replicas. Snapshot is sent in chunks as the replica takes them,
+ * meanwhile only changes of machines already sent are passed on.
+ */
+static void repl_event(char type, struct login_data *login) {
+	if (!num_replicas) {
+		return;
+	}
+
+	char line[DFINGER_LINE_SIZE];
+	int len = sprint_event(type, login, line);
+	if (repl_log.max_size - repl_log.len < (size_t) len) {
+		repl_overflow = 1;
+		return;
+	}
+	append_buffer(&repl_log, line, len);
+}
+
+static void repl_machine_event(struct machine *machine) {
+	if (!num_replicas) {
+		return;
+	}
+
+	char line[DFINGER_LINE_SIZE];
+	int len = snprintf(line, DFINGER_LINE_SIZE, "M %s\n",
+			machine->hostname);
+	if (repl_log.max_size - repl_log.len < (size_t) len) {
+		repl_overflow = 1;
+		return;
+	}
+	append_buffer(&repl_log, line, len);
+}
+
+static void repl_snapshot_logins(struct growing_buffer *out, char type,
+				struct login_data *login) {
+	size_t num_logins;
+	struct login_data **logins = list_logins(login, 0, &num_logins);
+
+	// Replica prepends logins, so they are sent from the oldest one
+	char line[DFINGER_LINE_SIZE];
+	for (size_t i = num_logins; i > 0; i--) {
+		int len = sprint_event(type, logins[i-1], line);
+		append_buffer(out, line, len);
+	}
+
+	free(logins);
+}
+
+static void repl_snapshot_machine(struct growing_buffer *out,
+					struct machine *machine) {
+	char line[DFINGER_LINE_SIZE];
+	int len = snprintf(line, DFINGER_LINE_SIZE, "M %s\n",
+			machine->hostname);
+	append_buffer(out, line, len);
+	repl_snapshot_logins(out, 'p', machine->past_logins);
+	repl_snapshot_logins(out, '+', machine->logins);
+}
+
+/*
+ * Adds machines to the snapshot of replica until DFINGER_REPL_CHUNK bytes
+ * wait to be sent. Returns -1 if the replica was disconnected, because
+ * the machine doesn't fit its buffer.
+ */
+static int repl_snapshot_step(int idx) {
+	struct snapshot_cursor *cursor = connections[idx].snapshot;
+	struct growing_buffer *out = connections[idx].response;
+
+	while (out->len - out->offset < DFINGER_REPL_CHUNK) {
+		size_t pos = (cursor->started ?
+				host_upper_bound(cursor->host, UT_HOSTSIZE) : 0);
+		if (pos == host_index_len) {
+			append_buffer(out, "E\n", 2);
+			free(cursor);
+			connections[idx].snapshot = NULL;
+			break;
+		}
+
+		struct machine *machine = host_index[pos];
+		size_t lines = 2;
+		for (struct login_data *login = machine->logins; login;
+		    login = login->next_by_machine) {
+			lines++;
+		}
+		for (struct login_data *login = machine->past_logins; login;
+		    login = login->next_by_machine) {
+			lines++;
+		}
+		if (out->max_size - out->len < lines * DFINGER_LINE_SIZE) {
+			fprintf(stderr, "Snapshot too large, disconnecting "
+				"replica\n");
+			free_connection(idx);
+			return (-1);
+		}
+
+		repl_snapshot_machine(out, machine);
+		strcpy(cursor->host, machine->hostname);
+		cursor->started = 1;
+	}
+
+	socks[idx].events = POLLIN | POLLOUT;
+	return (0);
+}
+
+/*
+ * Returns 1 if the change in line is of machine already in the snapshot.
+ */
+static int repl_snapshot_sent(struct snapshot_cursor *cursor,
+				const char *line) {
+	if (!cursor->started) {
+		return (0);
+	}
+
+	const char *host = line + 2;
+	size_t len = strcspn(host, (line[0] == 'M' ? "\n" : " \n"));
+	if (len >= UT_HOSTSIZE) {
+		return (0);
+	}
+	char hostname[UT_HOSTSIZE];
+	memcpy(hostname, host, len);
+	hostname[len] = 0;
+
+	return (strcmp(hostname, cursor->host) <= 0);
+}
+
+/*
+ * Sends changes collected since the last call to all replicas.
+ * Replica which can't keep up is disconnected, it gets new snapshot
+ * once it reconnects.
+ */
+static void repl_flush(void) {
+	if (!num_replicas) {
+		repl_log.len = 0;
+		repl_overflow = 0;
+		return;
+	}
+
+	if (repl_overflow) {
+		// Changes were lost, replicas resync once they reconnect
+		fprintf(stderr, "Replication log full, disconnecting "
+			"replicas\n");
+		for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+			if (connections[i].type == replica) {
+				free_connection(i);
+				i--;
+			}
+		}
+		repl_log.len = 0;
+		repl_overflow = 0;
+		return;
+	}
+
+	long long now = cur_msecs();
+	if (!repl_log.len && now < repl_next_heartbeat) {
+		return;
+	}
+	repl_next_heartbeat = now + DFINGER_REPL_HEARTBEAT;
+
+	char heartbeat[DFINGER_TIME_SIZE + 4];
+	int len = snprintf(heartbeat, sizeof (heartbeat), "T %lld\n", now);
+
+	for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+		if (connections[i].type != replica) {
+			continue;
+		}
+
+		struct growing_buffer *out = connections[i].response;
+		if (out->max_size - out->len < repl_log.len + len) {
+			fprintf(stderr, "Replica too slow, disconnecting\n");
+			free_connection(i);
+			i--;
+			continue;
+		}
+
+		append_buffer(out, heartbeat, len);
+		if (!connections[i].snapshot) {
+			append_buffer(out, repl_log.buffer, repl_log.len);
+		} else {
+			// Other machines get into the snapshot as they are
+			char *line = repl_log.buffer;
+			char *end = repl_log.buffer + repl_log.len;
+			while (line < end) {
+				char *nl = memchr(line, '\n', end - line);
+				size_t line_len = (nl ? nl + 1 : end) - line;
+				if (repl_snapshot_sent(connections[i].snapshot,
+						line)) {
+					append_buffer(out, line, line_len);
+				}
+				line += line_len;
+			}
+		}
+		socks[i].events = POLLIN | POLLOUT;
+	}
+
+	repl_log.len = 0;
+}
+
+static void repl_status(struct growing_buffer *response) {
+	char line[DFINGER_LINE_SIZE];
+	int len;
+
+	if (conf->is_replica) {
+		len = snprintf(line, DFINGER_LINE_SIZE,
+			"connected %d\nsynced %d\nlag_ms %lld\n"
+			"heartbeat_age_ms %lld\nevents %lld\n",
+			repl_connected, repl_synced, repl_lag,
+			repl_heartbeat ? cur_msecs() - repl_heartbeat : -1,
+			repl_events);
+		append_buffer(response, line, len);
+		return;
+	}
+
+	len = snprintf(line, DFINGER_LINE_SIZE, "replicas %d\n",
+			num_replicas);
+	append_buffer(response, line, len);
+	for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+		if (connections[i].type != replica) {
+			continue;
+		}
+
+		len = snprintf(line, DFINGER_LINE_SIZE,
+				"replica %d pending_bytes %zu\n", i,
+				connections[i].response->len -
+				connections[i].response->offset);
+		append_buffer(response, line, len);
+	}
+}
+
+static void handle_replica(int idx, short revents) {
+	struct growing_buffer *out = connections[idx].response;
+
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		// Replicas don't talk, so anything readable means hangup
+		char buffer[DFINGER_BUFFER_SIZE];
+		if (read(socks[idx].fd, buffer, DFINGER_BUFFER_SIZE) <= 0) {
+			free_connection(idx);
+			return;
+		}
+	}
+
+	if (revents & POLLOUT) {
+		if (write_response(socks[idx].fd, out) < 0) {
+			free_connection(idx);
+			return;
+		}
+
+		if (out->offset == out->len) {
+			out->offset = 0;
+			out->len = 0;
+		} else if (out->offset >= DFINGER_REPL_CHUNK) {
+			size_t rest = out->offset;
+			move_buffer(out->buffer, out->len, &rest);
+			out->offset = 0;
+			out->len = rest;
+		}
+
+		if (connections[idx].snapshot &&
+		    repl_snapshot_step(idx) < 0) {
+			return;
+		}
+		if (out->offset == out->len) {
+			socks[idx].events = POLLIN;
+		}
+	}
+}
+
+static void connect_primary(void) {
+	int fd = connect_host(conf->repl_addr ? conf->repl_addr : "localhost",
+				conf->repl_port);
+	if (fd < 0) {
+		fprintf(stderr, "Could not connect to primary\n");
+		return;
+	}
+
+	if (add_connection(fd, primary) < 0) {
+		close(fd);
+		return;
+	}
+	repl_connected = 1;
+	repl_synced = 0;
+}
+
+static void process_repl_line(char *line) {
+	repl_events++;
+
+	if (line[0] == 'S') {
+		clear_store();
+		repl_synced = 0;
+		return;
+	}
+
+	if (line[0] == 'E') {
+		repl_synced = 1;
+		return;
+	}
+
+	if (line[0] == 'T' && line[1] == ' ') {
+		repl_heartbeat = cur_msecs();
+		repl_lag = repl_heartbeat - atoll(line + 2);
+		return;
+	}
+
+	if (line[1] != ' ') {
+		return;
+	}
+
+	char hostname[UT_HOSTSIZE];
+	char *rest = line + 2;
+	if (line[0] == 'M') {
+		if (strlen(rest) >= UT_HOSTSIZE) {
+			return;
+		}
+		strcpy(hostname, rest);
+	} else {
+		rest = get_next_field(rest, hostname, UT_HOSTSIZE - 1);
+		if (!rest) {
+			return;
+		}
+	}
+
+	struct machine *machine = find_machine(hostname);
+	if (!machine) {
+		machine = add_machine(hostname);
+	}
+
+	struct login login;
+	if (line[0] == 'M' || fetch_login(rest, &login) != 0) {
+		return;
+	}
+
+	struct login_data *prev;
+	struct login_data *login_data;
+	switch (line[0]) {
+		case '+':
+			add_raw_login(machine, &login);
+			break;
+		case 'p':
+			add_raw_login(machine, &login);
+			retire_login(machine, machine->logins, NULL);
+			break;
+		case '=':
+			update_login(machine, &login);
+			break;
+		case '-':
+			login_data = find_login(machine, &login, &prev);
+			if (login_data) {
+				login_data->logout_time = login.logout_time;
+				retire_login(machine, login_data, prev);
+			}
+			break;
+	}
+}
+
+static ssize_t read_primary(int fd, struct connection *con) {
+	ssize_t num_read = input_fill(fd, con);
+	if (num_read <= 0) {
+		return (num_read);
+	}
+	size_t buf_len = con->offset + num_read;
+	con->buffer[buf_len] = 0;
+	con->offset = input_skip(con, buf_len);
+
+	int ret;
+	char line[DFINGER_LINE_SIZE];
+	while ((ret = fetch_line(con->buffer, buf_len, &(con->offset),
+				line, DFINGER_LINE_SIZE - 1)) != RTL_WANT_MORE) {
+		if (ret == RTL_LINE_FETCHED) {
+			process_repl_line(line);
+		}
+	}
+
+	move_buffer(con->buffer, buf_len, &con->offset);
+	input_drop_overlong(con);
+	input_release(con);
+
+	return (num_read);
+}
+
+/*
+ * Frees all machines, users and logins.
+ */
+static void clear_store(void) {
+	while (mlist) {
+		struct machine *machine = mlist;
+		struct login_data *lists[2] = { machine->logins,
+						machine->past_logins };
+		for (int i = 0; i < 2; i++) {
+			struct login_data *login = lists[i];
+			while (login) {
+				struct login_data *tmp = login->next_by_machine;
+				free(login);
+				login = tmp;
+			}
+		}
+
+		mlist = machine->next;
+		history_free(&machine->history);
+		hll_free(&machine->distinct);
+		free(machine);
+	}
+	hll_free(&fleet_distinct);
+	host_index_len = 0;
+	user_index_len = 0;
+
+	while (ulist) {
+		struct user *user = ulist;
+		ulist = user->next;
+		history_free(&user->history);
+		free(user->fullname);
+		free(user->add_info);
+		free(user);
+	}
 
-	qsort(stack.stack, stack.end, sizeof (struct login_data *),
+	stats_sessions = 0;
+	stats_users = 0;
+	stats_active_users = 0;
+	stats_active_machines = 0;
+	stats_heap_len = 0;
+
+	for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+		connections[i].machine = NULL;
+	}
+}
+
+/*
+ * Returns all logins of the list starting at login, linked by
+ * next_by_user if by_user is set, else by next_by_machine. The array
+ * isn't capped like login_stack, the caller frees it.
+ */
+static struct login_data ** list_logins(struct login_data *login,
+					int by_user, size_t *len) {
+	struct login_data *cur;
+	*len = 0;
+	for (cur = login; cur; cur = (by_user ?
+			cur->next_by_user : cur->next_by_machine)) {
+		(*len)++;
+	}
+
+	struct login_data **logins = malloc((*len ? *len : 1) *
+					sizeof (struct login_data *));
+	if (!logins) {
+		exit(ENOMEM);
+	}
+
+	size_t i = 0;
+	for (cur = login; cur; cur = (by_user ?
+			cur->next_by_user : cur->next_by_machine)) {
+		logins[i++] = cur;
+	}
+
+	return (logins);
+}
+
+static void fix_logins_machine(struct machine *machine) {
+	size_t len;
+	struct login_data **logins = list_logins(machine->logins, 0, &len);
+
+	qsort(logins, len, sizeof (struct login_data *),
 		cmp_logins_by_logintime);
 	machine->logins = NULL;
 	machine->past_logins = NULL;
 	int set_past = 0;
 
-	for (int i = stack.end-1; i >= 0; i--) {
-		if (stack.stack[i]->idle_time > 0 && !set_past) {
+	// Past logins (with idle time -1) are sorted to the end
+	for (size_t i = len; i > 0; i--) {
+		if (logins[i-1]->idle_time >= 0 && !set_past) {
 			machine->past_logins = machine->logins;
 			machine->logins = NULL;
 			set_past = 1;
 		}
-		machine->logins = stack.stack[i];
-		stack.stack[i]->next_by_machine = ((size_t) i+1 < stack.end ?
-						stack.stack[i+1] : NULL);
+		logins[i-1]->next_by_machine = machine->logins;
+		machine->logins = logins[i-1];
 	}
 
-	stack_free(&stack);
+	if (!set_past) {
+		machine->past_logins = machine->logins;
+		machine->logins = NULL;
+	}
+
+	free(logins);
 }
 
 static void fix_logins_user(struct user *user) {
-	struct login_data *login = user->logins;
-	struct login_stack stack;
-	stack_init(&stack, 0);
-
-	while (login) {
-		stack_add(&stack, login);
-		login = login->next_by_user;
-	}
+	size_t len;
+	struct login_data **logins = list_logins(user->logins, 1, &len);
 
-	qsort(stack.stack, stack.end, sizeof (struct login_data *),
+	qsort(logins, len, sizeof (struct login_data *),
 		cmp_logins_by_logintime);
 	user->logins = NULL;
 	user->past_logins = NULL;
 	int set_past = 0;
 
-	for (int i = stack.end-1; i >= 0; i--) {
-		if (stack.stack[i]->idle_time > 0 && !set_past) {
+	for (size_t i = len; i > 0; i--) {
+		if (logins[i-1]->idle_time >= 0 && !set_past) {
 			user->past_logins = user->logins;
 			user->logins = NULL;
 			set_past = 1;
 		}
 
-		user->logins = stack.stack[i];
+		logins[i-1]->prev_by_user = NULL;
+		logins[i-1]->next_by_user = user->logins;
+		if (user->logins) {
+			user->logins->prev_by_user = logins[i-1];
+		}
+		user->logins = logins[i-1];
+	}
+
+	if (!set_past) {
+		user->past_logins = user->logins;
+		user->logins = NULL;
+	}
+
+	free(logins);
+}
+
+/*
+ * Copies line of the dump at pos to line, returns pointer after it or NULL
+ * if there's no whole line before end.
+ */
+static char * dump_line(char *pos, char *end, char *line) {
+	char *nl = memchr(pos, '\n', end - pos);
+	if (!nl) {
+		return (NULL);
+	}
+
+	size_t len = nl - pos;
+	if (len > DFINGER_LINE_SIZE - 1) {
+		fprintf(stderr, "Error occured while parsing dumpfile\n");
+		exit(EINVAL);
+	}
+	memcpy(line, pos, len);
+	line[len] = 0;
+
+	return (nl + 1);
+}
+
+static int cmp_users_by_name(const void *p1, const void *p2) {
+	struct user *a = * ((struct user **) p1);
+	struct user *b = * ((struct user **) p2);
+
+	return (strncmp(a->username, b->username, UT_NAMESIZE));
+}
+
+/*
+ * Builds logins of one machine. Only the machine is written to, users
+ * are found in the index and linked by the main thread once all sections
+ * are loaded.
+ */
+static void load_section(struct dump_section *section) {
+	struct machine *machine = section->machine;
+	size_t size = 0;
+	char line[DFINGER_LINE_SIZE];
+	char *pos = section->start;
+
+	while (pos < section->end) {
+		pos = dump_line(pos, section->end, line);
+		if (!pos) {
+			break;
+		}
+
+		if (strncmp(line, HLL_DUMP_PREFIX,
+		    strlen(HLL_DUMP_PREFIX)) == 0) {
+			hll_parse(&machine->distinct, line);
+			continue;
+		}
 
-		if ((size_t) i+1 < stack.end) {
-			stack.stack[i+1]->prev_by_user = stack.stack[i];
-			stack.stack[i]->next_by_user = stack.stack[i+1];
+		struct login login;
+		if (fetch_login(line, &login) != 0) {
+			continue;
+		}
+		// Adding user again doesn't change the sketch, dumps of
+		// imports and older ones have only logins
+		hll_add(&machine->distinct, login.login_time / DFINGER_DAY,
+			login.user);
+
+		struct user key;
+		struct user *found = &key;
+		snprintf(key.username, UT_NAMESIZE, "%s", login.user);
+		struct user **user = bsearch(&found, user_index, user_index_len,
+					sizeof (struct user *),
+					cmp_users_by_name);
+
+		struct login_data *login_data =
+		    malloc(sizeof (struct login_data));
+		if (!login_data) {
+			exit(ENOMEM);
+		}
+		memset(login_data, 0, sizeof (struct login_data));
+		login_data->machine = machine;
+		if (user) {
+			login_data->user = *user;
 		} else {
-			stack.stack[i]->next_by_user = NULL;
+			section->unknown = realloc(section->unknown,
+					(section->num_unknown + 1) *
+					sizeof (struct dump_unknown));
+			if (!section->unknown) {
+				exit(ENOMEM);
+			}
+			struct dump_unknown *unknown =
+			    &section->unknown[section->num_unknown++];
+			unknown->login = login_data;
+			memcpy(unknown->user, login.user, UT_NAMESIZE);
+		}
+		login_data->login_time = login.login_time;
+		login_data->idle_time = login.idle_time;
+		login_data->logout_time = login.logout_time;
+		memcpy(login_data->line, login.line, UT_LINESIZE);
+		memcpy(login_data->host, login.host, UT_HOSTSIZE);
+		login_data->checked = 1;
+
+		login_data->next_by_machine = machine->logins;
+		machine->logins = login_data;
+		history_add(&machine->history, login_data);
+
+		if (section->num_logins == size) {
+			size = (size ? size * 2 : 16);
+			section->logins = realloc(section->logins,
+					size * sizeof (struct login_data *));
+			if (!section->logins) {
+				exit(ENOMEM);
+			}
 		}
+		section->logins[section->num_logins++] = login_data;
 	}
-	stack.stack[0]->prev_by_user = NULL;
+}
 
-	stack_free(&stack);
+/*
+ * Loads all sections of one machine in order of the dump, so that only
+ * one worker touches the machine.
+ */
+static void load_machine(size_t idx) {
+	struct dump_section *section = &dump_sections[dump_jobs[idx]];
+	struct machine *machine = section->machine;
+
+	for (; section; section = section->next) {
+		load_section(section);
+	}
+
+	fix_logins_machine(machine);
+}
+
+static int cmp_dump_sections(const void *p1, const void *p2) {
+	size_t a = * ((size_t *) p1);
+	size_t b = * ((size_t *) p2);
+
+	int cmp = strcmp(dump_sections[a].machine->hostname,
+			dump_sections[b].machine->hostname);
+	if (cmp) {
+		return (cmp);
+	}
+
+	return (a < b ? -1 : a > b);
+}
+
+static void load_user(size_t idx) {
+	fix_logins_user(user_index[idx]);
+}
+
+static int cmp_machines_by_name(const void *p1, const void *p2) {
+	struct machine *a = * ((struct machine **) p1);
+	struct machine *b = * ((struct machine **) p2);
+
+	return (strcmp(a->hostname, b->hostname));
+}
+
+static int cmp_dump_names(const void *p1, const void *p2) {
+	const struct dump_name *a = p1;
+	const struct dump_name *b = p2;
+
+	int cmp = memcmp(a->name, b->name, (a->len < b->len ? a->len : b->len));
+	if (cmp) {
+		return (cmp);
+	}
+	if (a->len != b->len) {
+		return (a->len < b->len ? -1 : 1);
+	}
+
+	return (a->order < b->order ? -1 : a->order > b->order);
+}
+
+static int cmp_dump_order(const void *p1, const void *p2) {
+	const struct dump_name *a = p1;
+	const struct dump_name *b = p2;
+
+	return (a->order < b->order ? -1 : a->order > b->order);
+}
+
+/*
+ * Maps file of the dump, returns NULL if it can't be opened (errno tells
+ * why) or is empty.
+ */
+static char * map_dump(const char *file, size_t *size) {
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		return (NULL);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		errno = 0;
+		return (NULL);
+	}
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s\n", file);
+		errno = 0;
+		return (NULL);
+	}
+	posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+	*size = st.st_size;
+
+	return (data);
 }
 
+/*
+ * Maps segments listed by manifest "!!! SEGMENTS generation" followed by
+ * their files, one per line. They are remembered as the current ones.
+ */
+static struct dump_map * read_manifest(char *data, char *end,
+					size_t *num_maps) {
+	char line[DFINGER_LINE_SIZE];
+	char *pos = dump_line(data, end, line);
+	dump_generation = atoll(line + strlen(DFINGER_DUMP_MANIFEST));
+
+	struct dump_map *maps = malloc(DFINGER_DUMP_MAXSEGMENTS *
+					sizeof (struct dump_map));
+	dump_names = calloc(DFINGER_DUMP_MAXSEGMENTS, sizeof (char *));
+	if (!maps || !dump_names) {
+		exit(ENOMEM);
+	}
+
+	*num_maps = 0;
+	while (pos && (pos = dump_line(pos, end, line)) && *line &&
+	    dump_num_segments < DFINGER_DUMP_MAXSEGMENTS) {
+		dump_names[dump_num_segments] = malloc(strlen(line) + 1);
+		if (!dump_names[dump_num_segments]) {
+			exit(ENOMEM);
+		}
+		strcpy(dump_names[dump_num_segments++], line);
+
+		struct dump_map *map = &maps[*num_maps];
+		if ((map->data = map_dump(line, &map->size))) {
+			(*num_maps)++;
+		} else if (errno) {
+			fprintf(stderr, "Could not open dump segment %s\n",
+				line);
+		}
+	}
+
+	return (maps);
+}
+
+/*
+ * Loads the dump: machines and users, each ended by blank line, and then
+ * logins of each machine after its name, ended by blank line. Segmented
+ * dump has a manifest listing such files instead. Files are mapped and
+ * split by machines, whose logins are built in parallel (every worker
+ * allocates from its own malloc arena); users are linked to them in order
+ * of the dump and sorted in parallel again.
+ */
 static void read_data(void) {
 	errno = 0;
-	int dump_file = open(conf->dump_file, O_RDONLY);
-	if (dump_file < 0) {
+	size_t size = 0;
+	char *data = map_dump(conf->dump_file, &size);
+	if (!data) {
 		if (errno == EACCES) {
 			fprintf(stderr, "Could not access dump file\n");
-		} else {
+		} else if (errno) {
 			fprintf(stderr, "Could not open dump file, "
 					"assuming there isn't any\n");
 		}
@@ -575,108 +3668,207 @@ static void read_data(void) {
 		return;
 	}
 
-	char buffer[DFINGER_BUFFER_SIZE];
-	memset(buffer, 0, DFINGER_BUFFER_SIZE);
+	struct dump_map *maps;
+	size_t num_maps = 1;
+	size_t magic_len = strlen(DFINGER_DUMP_MANIFEST);
+	if (size > magic_len &&
+	    memcmp(data, DFINGER_DUMP_MANIFEST, magic_len) == 0) {
+		maps = read_manifest(data, data + size, &num_maps);
+		munmap(data, size);
+	} else {
+		maps = malloc(sizeof (struct dump_map));
+		if (!maps) {
+			exit(ENOMEM);
+		}
+		maps[0].data = data;
+		maps[0].size = size;
+	}
+
+	load_maps(maps, num_maps);
+
+	for (size_t i = 0; i < num_maps; i++) {
+		munmap(maps[i].data, maps[i].size);
+	}
+	free(maps);
+}
+
+static void load_maps(struct dump_map *maps, size_t num_maps) {
 	char line[DFINGER_LINE_SIZE];
-	memset(line, 0, DFINGER_LINE_SIZE);
-
-	size_t blen = DFINGER_BUFFER_SIZE, boffset = 0,
-			llen = DFINGER_LINE_SIZE;
-
-	enum reading_state {
-		READING_MACHINES,
-		READING_USERS,
-		READING_MACHNAME,
-		READING_LOGINS,
-	};
-
-	enum reading_state state = READING_MACHINES;
-	struct machine *cur_machine = NULL;
-
-	while (read(dump_file, buffer, DFINGER_BUFFER_SIZE) > 0) {
-		int ret;
-		while ((ret = fetch_line(buffer, blen, &boffset, line, llen))
-				!= RTL_WANT_MORE) {
-			switch (ret) {
-				case RTL_BLANK_LINE:
-					switch (state) {
-						case READING_MACHINES:
-							state = READING_USERS;
-							break;
-						case READING_USERS:
-						case READING_LOGINS:
-							state =
-							    READING_MACHNAME;
-							break;
-						case READING_MACHNAME:
-							break;
-						default:
-							fprintf(stderr,
-							"Unexpected blank line"
-							" in dumpfile\n");
-							exit(EINVAL);
-					}
-					break;
-				case RTL_LINE_FETCHED:
-					switch (state) {
-						case READING_MACHINES:
-							add_machine(line);
-							break;
-						case READING_USERS:
-							add_user(line);
-							break;
-						case READING_MACHNAME:;
-							cur_machine =
-							    find_machine(line);
-							state = READING_LOGINS;
-							break;
-						case READING_LOGINS:;
-							struct login login;
-							fetch_login(line,
-								&login);
-							add_raw_login(
-								cur_machine,
-								&login);
-							break;
-					}
-					break;
-				case RTL_TOO_LONG:
-				case RTL_ERROR_OCCURED:
-					fprintf(stderr,
-					"Error occured while parsing "
-					"dumpfile\n");
-					exit(EINVAL);
-			}
+	struct dump_name *names = NULL;
+	size_t num_names = 0, size = 0;
+
+	host_index_bulk = 1;
+	for (size_t i = 0; i < num_maps; i++) {
+		char *pos = maps[i].data;
+		char *end = pos + maps[i].size;
+		while (pos && (pos = dump_line(pos, end, line)) && *line) {
+			add_machine(line);
+		}
 
+		char *name = pos;
+		while (pos && (pos = dump_line(pos, end, line)) && *line) {
+			if (num_names == size) {
+				size = (size ? size * 2 : 256);
+				names = realloc(names,
+						size * sizeof (struct dump_name));
+				if (!names) {
+					exit(ENOMEM);
+				}
+			}
+			names[num_names].name = name;
+			names[num_names].len = pos - 1 - name;
+			names[num_names].order = num_names;
+			names[num_names].dup = 0;
+			num_names++;
+			name = pos;
 		}
+		maps[i].logins = pos;
+	}
+	host_index_bulk = 0;
+	if (host_index_len) {
+		qsort(host_index, host_index_len, sizeof (struct machine *),
+			cmp_machines_by_name);
+	}
 
-		move_buffer(buffer, blen, &boffset);
+	// Users are added in order of the dump, each only once
+	if (num_maps > 1) {
+		qsort(names, num_names, sizeof (struct dump_name),
+			cmp_dump_names);
+		for (size_t i = 1; i < num_names; i++) {
+			names[i].dup = (names[i].len == names[i-1].len &&
+					memcmp(names[i].name, names[i-1].name,
+					names[i].len) == 0);
+		}
+		qsort(names, num_names, sizeof (struct dump_name),
+			cmp_dump_order);
+	}
+	user_index_bulk = 1;
+	for (size_t i = 0; i < num_names; i++) {
+		if (!names[i].dup) {
+			memcpy(line, names[i].name, names[i].len);
+			line[names[i].len] = 0;
+			add_user(line);
+		}
+	}
+	free(names);
+	user_index_bulk = 0;
+	if (user_index_len) {
+		qsort(user_index, user_index_len, sizeof (struct user *),
+			cmp_users_by_name);
 	}
 
-	close(dump_file);
+	// Sections are only split here, workers parse them
+	size_t num_sections = 0;
+	size = 0;
+	dump_sections = NULL;
+	for (size_t i = 0; i < num_maps; i++) {
+		char *pos = maps[i].logins;
+		char *end = maps[i].data + maps[i].size;
+		while (pos && (pos = dump_line(pos, end, line))) {
+			if (!*line) {
+				continue;
+			}
 
-	struct machine *machine = mlist;
-	while (machine) {
-		fix_logins_machine(machine);
-		machine = machine->next;
+			if (num_sections == size) {
+				size = (size ? size * 2 : 64);
+				dump_sections = realloc(dump_sections,
+					size * sizeof (struct dump_section));
+				if (!dump_sections) {
+					exit(ENOMEM);
+				}
+			}
+			struct dump_section *section =
+			    &dump_sections[num_sections++];
+			memset(section, 0, sizeof (struct dump_section));
+
+			struct machine *machine = find_machine(line);
+			section->machine = (machine ? machine :
+						add_machine(line));
+
+			section->start = pos;
+			while (pos < end && *pos != '\n') {
+				char *nl = memchr(pos, '\n', end - pos);
+				pos = (nl ? nl + 1 : end);
+			}
+			section->end = pos;
+		}
 	}
 
-	struct user *user = ulist;
-	while (user) {
-		fix_logins_user(user);
-		user = user->next;
+	// Sections of the same machine (repeated in imports) are chained
+	dump_jobs = malloc((num_sections ? num_sections : 1) *
+				sizeof (size_t));
+	if (!dump_jobs) {
+		exit(ENOMEM);
+	}
+	for (size_t i = 0; i < num_sections; i++) {
+		dump_jobs[i] = i;
+	}
+	qsort(dump_jobs, num_sections, sizeof (size_t), cmp_dump_sections);
+	size_t num_jobs = 0;
+	struct dump_section *last = NULL;
+	for (size_t i = 0; i < num_sections; i++) {
+		struct dump_section *section = &dump_sections[dump_jobs[i]];
+		if (last && last->machine == section->machine) {
+			last->next = section;
+		} else {
+			dump_jobs[num_jobs++] = dump_jobs[i];
+		}
+		last = section;
+	}
+	run_parallel(num_jobs, load_machine);
+	free(dump_jobs);
+	dump_jobs = NULL;
+
+	for (size_t i = 0; i < num_sections; i++) {
+		struct dump_section *section = &dump_sections[i];
+		for (size_t j = 0; j < section->num_unknown; j++) {
+			struct dump_unknown *unknown = &section->unknown[j];
+			if (!(unknown->login->user = find_user(unknown->user))) {
+				unknown->login->user = add_user(unknown->user);
+			}
+		}
+		free(section->unknown);
+
+		for (size_t j = 0; j < section->num_logins; j++) {
+			struct login_data *login = section->logins[j];
+			struct user *user = login->user;
+			login->next_by_user = user->logins;
+			if (user->logins) {
+				user->logins->prev_by_user = login;
+			}
+			user->logins = login;
+			history_add(&user->history, login);
+		}
+		free(section->logins);
+	}
+	free(dump_sections);
+	dump_sections = NULL;
+
+	// Users added for unknown logins are in the index by now
+	run_parallel(user_index_len, load_user);
+
+	// Logins were linked by workers, not by add_login()
+	for (struct machine *machine = mlist; machine;
+	    machine = machine->next) {
+		for (struct login_data *login = machine->logins; login;
+		    login = login->next_by_machine) {
+			stats_login(login, 1);
+		}
+		hll_merge(&fleet_distinct, &machine->distinct);
 	}
+	distinct_expire();
 }
 
-static void write_machines(int dump_file) {
+static void write_machines(int dump_file, struct machine **machines,
+				size_t num_machines) {
 	char buffer[DFINGER_BUFFER_SIZE];
-	struct machine *machine = mlist;
 	size_t chars_left = DFINGER_BUFFER_SIZE;
 	size_t buffer_offset = 0;
 	size_t written;
 
-	while (machine) {
-		if (strlen(machine->hostname) > chars_left) {
+	for (size_t i = 0; i < num_machines; i++) {
+		struct machine *machine = machines[i];
+		if (strlen(machine->hostname) + 2 > chars_left) {
 			flush(dump_file, buffer,
 				DFINGER_BUFFER_SIZE - chars_left);
 			chars_left = DFINGER_BUFFER_SIZE;
@@ -687,7 +3879,6 @@ static void write_machines(int dump_file) {
 					machine->hostname);
 		chars_left -= written;
 		buffer_offset += written;
-		machine = machine->next;
 	}
 
 	flush(dump_file, buffer, DFINGER_BUFFER_SIZE - chars_left);
@@ -695,15 +3886,16 @@ static void write_machines(int dump_file) {
 	flush(dump_file, buffer, 1);
 }
 
-static void write_users(int dump_file) {
+static void write_users(int dump_file, struct user **users,
+			size_t num_users) {
 	char buffer[DFINGER_BUFFER_SIZE];
-	struct user *user = ulist;
 	size_t chars_left = DFINGER_BUFFER_SIZE;
 	size_t buffer_offset = 0;
 	size_t written;
 
-	while (user) {
-		if (strlen(user->username) > chars_left) {
+	for (size_t i = 0; i < num_users; i++) {
+		struct user *user = users[i];
+		if (strlen(user->username) + 2 > chars_left) {
 			flush(dump_file, buffer,
 				DFINGER_BUFFER_SIZE - chars_left);
 			chars_left = DFINGER_BUFFER_SIZE;
@@ -714,7 +3906,6 @@ static void write_users(int dump_file) {
 					user->username);
 		chars_left -= written;
 		buffer_offset += written;
-		user = user->next;
 	}
 
 	flush(dump_file, buffer, DFINGER_BUFFER_SIZE - chars_left);
@@ -722,17 +3913,18 @@ static void write_users(int dump_file) {
 	flush(dump_file, buffer, 1);
 }
 
-static void write_logins(int dump_file) {
+static void write_logins(int dump_file, struct machine **machines,
+				size_t num_machines) {
 	char buffer[DFINGER_BUFFER_SIZE];
-	struct machine *machine = mlist;
 	size_t chars_left = DFINGER_BUFFER_SIZE;
 	size_t buffer_offset = 0;
 	size_t written;
 
-	while (machine) {
+	for (size_t i = 0; i < num_machines; i++) {
+		struct machine *machine = machines[i];
 		struct login_data *login = machine->logins;
 
-		if (strlen(machine->hostname) > chars_left) {
+		if (strlen(machine->hostname) + 2 > chars_left) {
 			flush(dump_file, buffer,
 				DFINGER_BUFFER_SIZE - chars_left);
 			chars_left = DFINGER_BUFFER_SIZE;
@@ -756,121 +3948,489 @@ static void write_logins(int dump_file) {
 			}
 
 			written = snprintf(buffer+buffer_offset, chars_left,
-			"%s %s %lld %lld %s \n", login->user->username,
+			"%s %s %lld %lld %s %lld \n", login->user->username,
 			login->line, login->login_time, login->idle_time,
-			login->host);
+			login->host, login->logout_time);
+			chars_left -= written;
+			buffer_offset += written;
+
+			login = login->next_by_machine;
+		}
+
+		login = machine->past_logins;
+		while (login) {
+			if (strlen(login->user->username) +
+			    strlen(login->line) + strlen(login->host) +
+			    DFINGER_UINFO_SIZE
+			    > chars_left) {
+				flush(dump_file, buffer,
+					DFINGER_BUFFER_SIZE - chars_left);
+				chars_left = DFINGER_BUFFER_SIZE;
+				buffer_offset = 0;
+			}
+
+			written = snprintf(buffer+buffer_offset, chars_left,
+			"%s %s %lld %lld %s %lld \n", login->user->username,
+			login->line, login->login_time, login->idle_time,
+			login->host, login->logout_time);
+			chars_left -= written;
+			buffer_offset += written;
+
+			login = login->next_by_machine;
+		}
+
+		for (size_t j = 0; j < machine->distinct.len; j++) {
+			if (HLL_LINE_SIZE > chars_left) {
+				flush(dump_file, buffer,
+					DFINGER_BUFFER_SIZE - chars_left);
+				chars_left = DFINGER_BUFFER_SIZE;
+				buffer_offset = 0;
+			}
+
+			written = hll_format(&machine->distinct.days[j],
+						buffer + buffer_offset);
 			chars_left -= written;
 			buffer_offset += written;
+		}
+
+		flush(dump_file, buffer, DFINGER_BUFFER_SIZE - chars_left);
+		buffer[0] = '\n';
+		flush(dump_file, buffer, 1);
+
+		chars_left = DFINGER_BUFFER_SIZE;
+		buffer_offset = 0;
+	}
+
+	flush(dump_file, buffer, DFINGER_BUFFER_SIZE - chars_left);
+	buffer[0] = '\n';
+	flush(dump_file, buffer, 1);
+}
+
+/*
+ * Writes dump of the machines and users to file, returns 0 on success.
+ */
+static int write_dump(const char *file, struct machine **machines,
+			size_t num_machines, struct user **users,
+			size_t num_users) {
+	int dump_file = open(file, O_WRONLY | O_CREAT | O_TRUNC,
+					S_IRUSR | S_IRGRP | S_IROTH);
+	if (dump_file < 0) {
+		fprintf(stderr, "Could not open dump file\n");
+		return (-1);
+	}
+
+	write_machines(dump_file, machines, num_machines);
+	write_users(dump_file, users, num_users);
+	write_logins(dump_file, machines, num_machines);
+
+	close(dump_file);
+
+	return (0);
+}
+
+static void write_data(void) {
+	size_t num_machines = 0;
+	for (struct machine *machine = mlist; machine;
+	    machine = machine->next) {
+		num_machines++;
+	}
+	struct machine **machines = malloc((num_machines ? num_machines : 1) *
+					sizeof (struct machine *));
+	if (!machines) {
+		exit(ENOMEM);
+	}
+	num_machines = 0;
+	for (struct machine *machine = mlist; machine;
+	    machine = machine->next) {
+		machines[num_machines++] = machine;
+	}
+
+	if (conf->dump_segments) {
+		write_segments(machines, num_machines);
+		free(machines);
+		return;
+	}
+
+	size_t num_users = 0;
+	for (struct user *user = ulist; user; user = user->next) {
+		num_users++;
+	}
+	struct user **users = malloc((num_users ? num_users : 1) *
+					sizeof (struct user *));
+	if (!users) {
+		exit(ENOMEM);
+	}
+	num_users = 0;
+	for (struct user *user = ulist; user; user = user->next) {
+		users[num_users++] = user;
+	}
+
+	char *tmpfile = malloc(strlen(conf->dump_file) + 4 + 1);
+	snprintf(tmpfile, strlen(conf->dump_file) + 4 + 1, "%s.tmp",
+		conf->dump_file);
+
+	if (write_dump(tmpfile, machines, num_machines, users,
+	    num_users) == 0) {
+		rename(tmpfile, conf->dump_file);
+		// Dump was segmented before
+		drop_segments();
+	}
+
+	free(tmpfile);
+	free(users);
+	free(machines);
+}
+
+// FNV-1a
+static unsigned int dump_hash(const char *hostname) {
+	unsigned int hash = 2166136261u;
+	for (; *hostname; hostname++) {
+		hash ^= (unsigned char) *hostname;
+		hash *= 16777619u;
+	}
+
+	return (hash);
+}
+
+/*
+ * Writes segments of the dump with changed machines (all of them every
+ * DUMP_FULL_INTERVAL or when the number of segments changes) to new
+ * files and replaces the manifest, so the dump changes at once. Files
+ * of segments written anew are removed afterwards.
+ */
+static void write_segments(struct machine **machines,
+				size_t num_machines) {
+	int num_segments = conf->dump_segments;
+	int full = (num_segments != dump_num_segments ||
+			cur_secs() >= dump_next_full);
+
+	// Machines grouped by segment, segment i starts at start[i]
+	size_t *start = calloc(num_segments + 1, sizeof (size_t));
+	size_t *next = malloc(num_segments * sizeof (size_t));
+	struct machine **grouped = malloc((num_machines ? num_machines : 1) *
+					sizeof (struct machine *));
+	char **names = calloc(num_segments, sizeof (char *));
+	int *written = calloc(num_segments, sizeof (int));
+	if (!start || !next || !grouped || !names || !written) {
+		exit(ENOMEM);
+	}
+	for (size_t i = 0; i < num_machines; i++) {
+		start[machines[i]->dump_hash % num_segments + 1]++;
+	}
+	for (int i = 0; i < num_segments; i++) {
+		start[i + 1] += start[i];
+		next[i] = start[i];
+	}
+	for (size_t i = 0; i < num_machines; i++) {
+		grouped[next[machines[i]->dump_hash % num_segments]++] =
+		    machines[i];
+	}
+
+	dump_generation++;
+	size_t name_size = strlen(conf->dump_file) + 32;
+	int failed = 0, changed = 0;
+	for (int i = 0; i < num_segments && !failed; i++) {
+		size_t len = start[i + 1] - start[i];
+		int dirty = (full || len != dump_sizes[i]);
+		for (size_t j = start[i]; j < start[i + 1] && !dirty; j++) {
+			dirty = grouped[j]->dirty;
+		}
+		if (!dirty) {
+			names[i] = dump_names[i];
+			continue;
+		}
 
-			login = login->next_by_machine;
+		names[i] = malloc(name_size);
+		if (!names[i]) {
+			exit(ENOMEM);
 		}
+		snprintf(names[i], name_size, "%s.%d.%lld", conf->dump_file, i,
+			dump_generation);
+		written[i] = changed = 1;
+		failed = (write_segment(names[i], grouped + start[i],
+				len) != 0);
+	}
 
-		login = machine->past_logins;
-		while (login) {
-			if (strlen(login->user->username) +
-			    strlen(login->line) + strlen(login->host) +
-			    DFINGER_UINFO_SIZE
-			    > chars_left) {
-				flush(dump_file, buffer,
-					DFINGER_BUFFER_SIZE - chars_left);
-				chars_left = DFINGER_BUFFER_SIZE;
-				buffer_offset = 0;
+	if (!changed) {
+		// Manifest stays as it was
+	} else if (failed || write_manifest(names, num_segments) != 0) {
+		// Dump stays as it was
+		for (int i = 0; i < num_segments; i++) {
+			if (written[i]) {
+				unlink(names[i]);
+				free(names[i]);
 			}
-
-			written = snprintf(buffer+buffer_offset, chars_left,
-			"%s %s %lld %lld %s \n", login->user->username,
-			login->line, login->login_time, login->idle_time,
-			login->host);
-			chars_left -= written;
-			buffer_offset += written;
-
-			login = login->next_by_machine;
 		}
+	} else {
+		for (int i = 0; i < num_segments; i++) {
+			if (!written[i]) {
+				dump_names[i] = NULL;
+				continue;
+			}
+			segments_written++;
+			for (size_t j = start[i]; j < start[i + 1]; j++) {
+				grouped[j]->dirty = 0;
+			}
+		}
+		drop_segments();
+
+		dump_names = names;
+		names = NULL;
+		dump_num_segments = num_segments;
+		dump_sizes = realloc(dump_sizes,
+					num_segments * sizeof (size_t));
+		if (!dump_sizes) {
+			exit(ENOMEM);
+		}
+		for (int i = 0; i < num_segments; i++) {
+			dump_sizes[i] = start[i + 1] - start[i];
+		}
+		if (full) {
+			dump_next_full = cur_secs() + conf->dump_full_interval;
+		}
+	}
 
-		flush(dump_file, buffer, DFINGER_BUFFER_SIZE - chars_left);
-		buffer[0] = '\n';
-		flush(dump_file, buffer, 1);
-
-		machine = machine->next;
+	free(names);
+	free(written);
+	free(grouped);
+	free(next);
+	free(start);
+}
 
-		chars_left = DFINGER_BUFFER_SIZE;
-		buffer_offset = 0;
+/*
+ * Writes segment with the machines and users of their logins.
+ */
+static int write_segment(const char *file, struct machine **machines,
+				size_t num_machines) {
+	struct user **users = NULL;
+	size_t num_users = 0, size = 0;
+
+	dump_mark++;
+	for (size_t i = 0; i < num_machines; i++) {
+		struct login_data *lists[2] = { machines[i]->logins,
+						machines[i]->past_logins };
+		for (int j = 0; j < 2; j++) {
+			for (struct login_data *login = lists[j]; login;
+			    login = login->next_by_machine) {
+				if (login->user->dump_mark == dump_mark) {
+					continue;
+				}
+				login->user->dump_mark = dump_mark;
+
+				if (num_users == size) {
+					size = (size ? size * 2 : 64);
+					users = realloc(users, size *
+						sizeof (struct user *));
+					if (!users) {
+						exit(ENOMEM);
+					}
+				}
+				users[num_users++] = login->user;
+			}
+		}
 	}
 
-	flush(dump_file, buffer, DFINGER_BUFFER_SIZE - chars_left);
-	buffer[0] = '\n';
-	flush(dump_file, buffer, 1);
+	int ret = write_dump(file, machines, num_machines, users, num_users);
+	free(users);
+
+	return (ret);
 }
 
-static void write_data(void) {
+static int write_manifest(char **names, int num_segments) {
 	char *tmpfile = malloc(strlen(conf->dump_file) + 4 + 1);
 	snprintf(tmpfile, strlen(conf->dump_file) + 4 + 1, "%s.tmp",
 		conf->dump_file);
 
-	int dump_file = open(tmpfile, O_WRONLY | O_CREAT,
-					S_IRUSR | S_IRGRP | S_IROTH);
-	if (dump_file < 0) {
+	FILE *manifest = fopen(tmpfile, "w");
+	if (!manifest) {
 		fprintf(stderr, "Could not open dump file\n");
-		return;
+		free(tmpfile);
+		return (-1);
 	}
 
-	write_machines(dump_file);
-	write_users(dump_file);
-	write_logins(dump_file);
-
-	close(dump_file);
-	rename(tmpfile, conf->dump_file);
-}
-
-static int bind_sock(int port) {
-	struct addrinfo *r, hints;
-	memset(&hints, 0, sizeof (hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;
-	char buf[PORT_SIZE]; snprintf(buf, PORT_SIZE, "%d", port);
-	if (getaddrinfo(NULL, buf, &hints, &r) != 0) {
-		fprintf(stderr, "Could not retrieve address info\n");
-		exit(EINVAL);
+	fprintf(manifest, "%s%lld\n", DFINGER_DUMP_MANIFEST, dump_generation);
+	for (int i = 0; i < num_segments; i++) {
+		fprintf(manifest, "%s\n", names[i]);
 	}
 
-	int fd;
-	if ((fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol)) == -1) {
-		fprintf(stderr, "Could not open socket\n");
-		exit(EINVAL);
+	int ret = 0;
+	if (fclose(manifest) != 0 || rename(tmpfile, conf->dump_file) != 0) {
+		fprintf(stderr, "Could not write dump file\n");
+		unlink(tmpfile);
+		ret = -1;
 	}
+	free(tmpfile);
 
-	if (bind(fd, r->ai_addr, r->ai_addrlen) == -1) {
-		fprintf(stderr, "Could not bind socket\n");
-		exit(EINVAL);
-	}
+	return (ret);
+}
 
-	return (fd);
+/*
+ * Removes files of segments no longer listed by the manifest.
+ */
+static void drop_segments(void) {
+	for (int i = 0; i < dump_num_segments; i++) {
+		if (dump_names[i]) {
+			unlink(dump_names[i]);
+			free(dump_names[i]);
+		}
+	}
+	free(dump_names);
+	dump_names = NULL;
+	dump_num_segments = 0;
 }
 
 static void initial_bind(struct connection *connections, struct pollfd *socks,
 			struct conf *conf) {
 	connections[0].in_use = 1;
-	socks[0].fd = bind_sock(conf->port);
-	socks[0].events = POLLIN;
-	listen(socks[0].fd, 1);
+	socks[0].fd = -1;
+	if (!conf->is_replica) {
+		// Replicas are read-only
+		socks[0].fd = bind_sock(conf->port);
+		socks[0].events = POLLIN;
+		listen(socks[0].fd, conf->max_clients);
+	}
 
 	connections[1].in_use = 1;
 	socks[1].fd = bind_sock(conf->finger_port);
 	socks[1].events = POLLIN;
-	listen(socks[1].fd, 1);
+	listen(socks[1].fd, conf->max_fingers);
+
+	connections[2].in_use = 1;
+	socks[2].fd = -1;
+	if (conf->repl_port && !conf->is_replica) {
+		socks[2].fd = bind_sock(conf->repl_port);
+		socks[2].events = POLLIN;
+		listen(socks[2].fd, conf->max_replicas);
+	}
 }
 
-static struct machine * find_machine(char *hostname) {
-	struct machine *machine = mlist;
+/*
+ * Returns index of the first machine whose hostname isn't before the
+ * len bytes of name in the sorted index.
+ */
+static size_t host_lower_bound(const char *name, size_t len) {
+	size_t lo = 0, hi = host_index_len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (strncmp(host_index[mid]->hostname, name, len) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
 
-	while (machine) {
-		if (strcmp(machine->hostname, hostname) != 0) {
-			machine = machine->next;
-			continue;
+	return (lo);
+}
+
+/*
+ * Returns index past the last machine whose hostname starts with the len
+ * bytes of name.
+ */
+static size_t host_upper_bound(const char *name, size_t len) {
+	size_t lo = 0, hi = host_index_len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (strncmp(host_index[mid]->hostname, name, len) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return (lo);
+}
+
+static void host_index_add(struct machine *machine) {
+	if (host_index_len == host_index_size) {
+		host_index_size = (host_index_size ? host_index_size * 2 : 64);
+		host_index = realloc(host_index, host_index_size *
+					sizeof (struct machine *));
+		if (!host_index) {
+			exit(ENOMEM);
 		}
+	}
+
+	if (host_index_bulk) {
+		// Machines of the dump are sorted all at once after loading
+		host_index[host_index_len++] = machine;
+		return;
+	}
+
+	size_t pos = host_lower_bound(machine->hostname, UT_HOSTSIZE);
+	memmove(host_index + pos + 1, host_index + pos,
+		(host_index_len - pos) * sizeof (struct machine *));
+	host_index[pos] = machine;
+	host_index_len++;
+}
+
+static void host_index_remove(struct machine *machine) {
+	size_t pos = host_lower_bound(machine->hostname, UT_HOSTSIZE);
+	if (pos == host_index_len || host_index[pos] != machine) {
+		return;
+	}
+
+	memmove(host_index + pos, host_index + pos + 1,
+		(host_index_len - pos - 1) * sizeof (struct machine *));
+	host_index_len--;
+}
+
+static struct machine * find_machine(char *hostname) {
+	// Hostnames are kept cut to the size of utmp
+	size_t pos = host_lower_bound(hostname, UT_HOSTSIZE - 1);
+	if (pos < host_index_len && strncmp(host_index[pos]->hostname,
+					hostname, UT_HOSTSIZE - 1) == 0) {
+		return (host_index[pos]);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Hostname of request is a pattern if it has any of the wildcards of
+ * glob(7), the characters can't be in hostnames.
+ */
+static int host_is_pattern(const char *host) {
+	return (strpbrk(host, "*?[") != NULL);
+}
+
+static int host_matches(const char *host, const char *hostname) {
+	if (!host_is_pattern(host)) {
+		return (strcmp(host, hostname) == 0);
+	}
 
-		return (machine);
+	return (fnmatch(host, hostname, 0) == 0);
+}
+
+/*
+ * Returns index of the first machine hostname of which may match host,
+ * end is set past the last one. Only names starting with the literal
+ * prefix of the pattern can match, so they are a range of the index.
+ */
+static size_t host_first(const char *host, size_t *end) {
+	size_t len = strcspn(host, "*?[\\");
+	if (len > UT_HOSTSIZE - 1) {
+		len = UT_HOSTSIZE - 1;
+	}
+
+	*end = host_upper_bound(host, len);
+	return (host_lower_bound(host, len));
+}
+
+/*
+ * Returns the next machine of the range matching host from *pos on, or
+ * NULL once there isn't any. Pattern of just a prefix and '*' matches
+ * the whole range.
+ */
+static struct machine * host_next(const char *host, size_t *pos,
+					size_t end) {
+	size_t len = strcspn(host, "*?[\\");
+	int whole = (host[len] == '*' && host[len + 1] == '\0');
+
+	while (*pos < end) {
+		struct machine *machine = host_index[(*pos)++];
+		if (whole || host_matches(host, machine->hostname)) {
+			return (machine);
+		}
 	}
 
 	return (NULL);
@@ -880,26 +4440,80 @@ static struct machine * add_machine(char *hostname) {
 	struct machine *machine = malloc(sizeof (struct machine));
 	memset(machine, 0, sizeof (*machine));
 
-	strncpy(machine->hostname, hostname, strlen(hostname));
+	strncpy(machine->hostname, hostname, UT_HOSTSIZE - 1);
 
 	machine->last_activity = cur_secs();
+	machine->connection_id = -1;
+	machine->dump_hash = dump_hash(machine->hostname);
+	machine->dirty = 1;
+	stats_insert(machine);
+	host_index_add(machine);
 
 	machine->next = mlist;
 	mlist = machine;
+	repl_machine_event(machine);
 
 	return (machine);
 }
 
-static struct user * find_user(char *username) {
-	struct user *user = ulist;
+/*
+ * Returns index of the first user whose name isn't before name in the
+ * sorted index.
+ */
+static size_t user_lower_bound(const char *name) {
+	size_t lo = 0, hi = user_index_len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (strncmp(user_index[mid]->username, name, UT_NAMESIZE) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
 
-	while (user) {
-		if (strcmp(user->username, username) != 0) {
-			user = user->next;
-			continue;
+	return (lo);
+}
+
+static void user_index_add(struct user *user) {
+	if (user_index_len == user_index_size) {
+		user_index_size = (user_index_size ? user_index_size * 2 : 64);
+		user_index = realloc(user_index, user_index_size *
+					sizeof (struct user *));
+		if (!user_index) {
+			exit(ENOMEM);
 		}
+	}
+
+	if (user_index_bulk) {
+		// Users of the dump are sorted all at once after loading
+		user_index[user_index_len++] = user;
+		return;
+	}
+
+	size_t pos = user_lower_bound(user->username);
+	memmove(user_index + pos + 1, user_index + pos,
+		(user_index_len - pos) * sizeof (struct user *));
+	user_index[pos] = user;
+	user_index_len++;
+}
 
-		return (user);
+static void user_index_remove(struct user *user) {
+	size_t pos = user_lower_bound(user->username);
+	if (pos == user_index_len || user_index[pos] != user) {
+		return;
+	}
+
+	memmove(user_index + pos, user_index + pos + 1,
+		(user_index_len - pos - 1) * sizeof (struct user *));
+	user_index_len--;
+}
+
+static struct user * find_user(char *username) {
+	// Usernames are kept cut to the size of utmp
+	size_t pos = user_lower_bound(username);
+	if (pos < user_index_len && strncmp(user_index[pos]->username,
+					username, UT_NAMESIZE) == 0) {
+		return (user_index[pos]);
 	}
 
 	return (NULL);
@@ -932,8 +4546,11 @@ static struct user * add_user(char *username) {
 	strncpy(user->username, username, sizeof (user->username));
 	get_user_info(user);
 
+	user_index_add(user);
+
 	user->next = ulist;
 	ulist = user;
+	stats_users++;
 
 	return (user);
 }
@@ -948,8 +4565,15 @@ static void add_login(struct machine *machine, struct login_data *login_data) {
 	login_data->user->logins = login_data;
 
 	machine->logins = login_data;
+	machine->dirty = 1;
+	stats_login(login_data, 1);
+
+	history_add(&machine->history, login_data);
+	history_add(&login_data->user->history, login_data);
 
 	login_data->checked = 1;
+	repl_event('+', login_data);
+	watch_event('+', login_data);
 }
 
 static void add_raw_login(struct machine *machine, struct login *login) {
@@ -958,6 +4582,7 @@ static void add_raw_login(struct machine *machine, struct login *login) {
 	login_data->machine = machine;
 	login_data->login_time = login->login_time;
 	login_data->idle_time = login->idle_time;
+	login_data->logout_time = login->logout_time;
 	strncpy(login_data->line, login->line, UT_LINESIZE);
 	strncpy(login_data->host, login->host, UT_HOSTSIZE);
 
@@ -966,30 +4591,98 @@ static void add_raw_login(struct machine *machine, struct login *login) {
 	}
 
 	add_login(machine, login_data);
+
+	long long day = login->login_time / DFINGER_DAY;
+	if (day > cur_secs() / DFINGER_DAY - conf->distinct_days) {
+		hll_add(&machine->distinct, day, login->user);
+		hll_add(&fleet_distinct, day, login->user);
+	}
 }
 
-static void update_login(struct machine *machine, struct login *login) {
+static struct login_data * find_login(struct machine *machine,
+				struct login *login, struct login_data **prev) {
 	struct login_data *login_data = machine->logins;
+	*prev = NULL;
 
 	while (login_data) {
 		if (strcmp(login_data->user->username, login->user) != 0 ||
 		    login_data->login_time != login->login_time ||
 		    strcmp(login_data->line, login->line) != 0 ||
 		    strcmp(login_data->host, login->host) != 0) {
+			*prev = login_data;
 			login_data = login_data->next_by_machine;
 			continue;
 		}
 
-		if (login_data->idle_time < login_data->user->least_idle) {
-			login_data->user->least_idle = login_data->idle_time;
-		}
+		return (login_data);
+	}
 
-		login_data->idle_time = login->idle_time;
-		login_data->checked = 1;
+	return (NULL);
+}
+
+static void update_login(struct machine *machine, struct login *login) {
+	struct login_data *prev;
+	struct login_data *login_data = find_login(machine, login, &prev);
+
+	if (!login_data) {
+		add_raw_login(machine, login);
 		return;
 	}
 
-	add_raw_login(machine, login);
+	if (login_data->idle_time < login_data->user->least_idle) {
+		login_data->user->least_idle = login_data->idle_time;
+	}
+
+	if (login_data->idle_time != login->idle_time) {
+		login_data->idle_time = login->idle_time;
+		machine->dirty = 1;
+		repl_event('=', login_data);
+		watch_event('=', login_data);
+	}
+	login_data->checked = 1;
+}
+
+/*
+ * Moves login from current to past logins of its machine and user.
+ */
+static void retire_login(struct machine *machine, struct login_data *login,
+				struct login_data *prev) {
+	if (!login->logout_time) {
+		login->logout_time = cur_secs();
+	}
+	repl_event('-', login);
+	watch_event('-', login);
+	login->idle_time = -1;
+	history_logout(&machine->history, login);
+	history_logout(&login->user->history, login);
+	machine->dirty = 1;
+	stats_login(login, -1);
+
+	if (prev) {
+		prev->next_by_machine = login->next_by_machine;
+	} else {
+		machine->logins = login->next_by_machine;
+	}
+
+	if (login->next_by_user) {
+		login->next_by_user->prev_by_user = login->prev_by_user;
+	}
+
+	if (login->prev_by_user) {
+		login->prev_by_user->next_by_user = login->next_by_user;
+	} else {
+		login->user->logins = login->next_by_user;
+	}
+
+	login->prev_by_user = NULL;
+	login->next_by_user = login->user->past_logins;
+	if (login->user->past_logins) {
+		login->user->past_logins->prev_by_user = login;
+	}
+	login->user->past_logins = login;
+
+	login->next_by_machine = machine->past_logins;
+	machine->past_logins = login;
 }
 
 static void delete_logins(struct machine *machine, int all) {
@@ -1002,33 +4695,8 @@ static void delete_logins(struct machine *machine, int all) {
 
 	while (login) {
 		if (all || !login->checked) {
-			login->idle_time = -1;
 			struct login_data *tmp = login->next_by_machine;
-
-			if (login->next_by_user) {
-				login->next_by_user->prev_by_user =
-				    login->prev_by_user;
-			}
-
-			if (login->prev_by_user) {
-				login->prev_by_user->next_by_user =
-				    login->next_by_user;
-			}
-
-			if (prev) {
-				prev->next_by_machine =
-				    login->next_by_machine;
-			}
-
-			machine->logins = login->next_by_machine;
-			login->user->logins = login->next_by_user;
-
-			login->next_by_user = login->user->past_logins;
-			login->user->past_logins = login;
-			login->next_by_machine = machine->past_logins;
-
-			machine->past_logins = login;
-
+			retire_login(machine, login, prev);
 			login = tmp;
 			continue;
 		}
@@ -1054,16 +4722,31 @@ static void check_machines(void) {
 	while (machine) {
 		if (cur_secs() - machine->last_activity >
 		    conf->client_lifetime) {
-			free_connection(machine->connection_id);
+			if (machine->connection_id >= 0) {
+				free_connection(machine->connection_id);
+			}
 			delete_logins(machine, 1);
 		}
 		machine = machine->next;
 	}
 }
 
+/*
+ * Frees past login, prev is the previous past login of its machine
+ * or NULL when the caller doesn't know it.
+ */
 static void clear_login(struct login_data *login, struct login_data *prev) {
-	if (prev) {
-		prev->next_by_machine = login->next_by_machine;
+	struct machine *machine = login->machine;
+	struct login_data **link = (prev ?
+				&prev->next_by_machine : &machine->past_logins);
+
+	// A login missing from the list of its machine is still freed
+	while (*link && *link != login) {
+		link = &(*link)->next_by_machine;
+	}
+
+	if (*link) {
+		*link = login->next_by_machine;
 	}
 
 	if (login->prev_by_user) {
@@ -1077,12 +4760,18 @@ static void clear_login(struct login_data *login, struct login_data *prev) {
 	if (login->user->past_logins == login) {
 		login->user->past_logins = login->next_by_user;
 	}
-	login->machine->past_logins = login->next_by_machine;
 
+	history_remove(&login->machine->history, login);
+	history_remove(&login->user->history, login);
+	machine->dirty = 1;
 	free(login);
 }
 
-static void clear_old_logins() {
+/*
+ * Clears past logins which ended more than archive_time ago.
+ */
+static void clear_old_logins(void) {
+	long long now = cur_secs();
 	struct machine *machine = mlist;
 
 	while (machine) {
@@ -1090,8 +4779,9 @@ static void clear_old_logins() {
 		struct login_data *prev_login = NULL;
 
 		while (login) {
-			if (cur_secs() - login->login_time <
-			    conf->archive_time) {
+			long long end = (login->logout_time ?
+					login->logout_time : login->login_time);
+			if (now - end > conf->archive_time) {
 				struct login_data *tmp = login->next_by_machine;
 				clear_login(login, prev_login);
 				login = tmp;
@@ -1101,19 +4791,29 @@ static void clear_old_logins() {
 			prev_login = login;
 			login = login->next_by_machine;
 		}
+
+		machine = machine->next;
 	}
 }
 
 static void clear_old_machines(void) {
 	struct machine *machine = mlist;
 	struct machine *prev = NULL;
+	long long now = cur_secs();
 	while (machine) {
-		if (cur_secs() - machine->last_activity > conf->archive_time) {
-			// All logins should be freed by now
+		if (now - machine->last_activity > conf->archive_time &&
+		    !machine->logins && !machine->past_logins &&
+		    machine->connection_id < 0) {
 			if (prev) {
 				prev->next = machine->next;
+			} else {
+				mlist = machine->next;
 			}
 			struct machine *tmp = machine->next;
+			history_free(&machine->history);
+			hll_free(&machine->distinct);
+			stats_remove(machine);
+			host_index_remove(machine);
 			free(machine);
 			machine = tmp;
 			continue;
@@ -1129,13 +4829,20 @@ static void clear_old_users(void) {
 	struct user *prev = NULL;
 
 	while (user) {
-		if (user->least_idle > conf->archive_time) {
-			// All logins should be freed by now
+		if (!user->logins && !user->past_logins) {
+			// All logins of the user have been cleared
 			if (prev) {
 				prev->next = user->next;
+			} else {
+				ulist = user->next;
 			}
+			user_index_remove(user);
 			struct user *tmp = user->next;
+			history_free(&user->history);
+			free(user->fullname);
+			free(user->add_info);
 			free(user);
+			stats_users--;
 			user = tmp;
 			continue;
 		}
@@ -1149,51 +4856,47 @@ static void clear_old_records(void) {
 	clear_old_logins();
 	clear_old_users();
 	clear_old_machines();
+	distinct_expire();
 }
 
+/*
+ * Keeps at most num_records logins of each machine and user, the oldest
+ * past logins are cleared first. Current logins are never cut.
+ */
 static void cut_records(void) {
-	struct machine *machine = mlist;
-	while (machine) {
-		struct login_data *login = machine->logins;
+	for (struct machine *machine = mlist; machine;
+	    machine = machine->next) {
 		int num_records = 0;
+		struct login_data *login = machine->logins;
 		while (login) {
 			num_records++;
-			if (num_records > conf->num_records) {
-				struct login_data *tmp = login->next_by_machine;
-				clear_login(login, NULL);
-				login = tmp;
-				continue;
-			}
 			login = login->next_by_machine;
 		}
-		login = mlist->past_logins;
+
+		struct login_data *prev = NULL;
+		login = machine->past_logins;
 		while (login) {
 			num_records++;
 			if (num_records > conf->num_records) {
 				struct login_data *tmp = login->next_by_machine;
-				clear_login(login, NULL);
+				clear_login(login, prev);
 				login = tmp;
 				continue;
 			}
+			prev = login;
 			login = login->next_by_machine;
 		}
 	}
 
-	struct user *user = ulist;
-	while (user) {
-		struct login_data *login = user->logins;
+	for (struct user *user = ulist; user; user = user->next) {
 		int num_records = 0;
+		struct login_data *login = user->logins;
 		while (login) {
 			num_records++;
-			if (num_records > conf->num_records) {
-				struct login_data *tmp = login->next_by_user;
-				clear_login(login, NULL);
-				login = tmp;
-				continue;
-			}
 			login = login->next_by_user;
 		}
-		login = ulist->past_logins;
+
+		login = user->past_logins;
 		while (login) {
 			num_records++;
 			if (num_records > conf->num_records) {
@@ -1207,22 +4910,18 @@ static void cut_records(void) {
 	}
 }
 
-static void accept_connection(int sock_id,
-				struct conf *conf, enum connection_type type) {
-	if (connections_size == connections_used) {
-		if (connections_size >= conf->max_clients) {
-			// TODO: logging
-			int fd = accept(socks[sock_id].fd, NULL, NULL);
-			if (fd >= 0) {
-				fprintf(stderr, "Refusing connection\n");
-				close(fd);
-			}
-			listen(socks[sock_id].fd, 1);
-			return;
-		}
+/*
+ * Puts socket fd among connections, returns its index
+ * or -1 if there are already too many connections.
+ */
+static int add_connection(int fd, enum connection_type type) {
+	if (class_full(type)) {
+		return (-1);
+	}
 
-		connections_size = (connections_size * 2 < conf->max_clients ?
-				    connections_size * 2 : conf->max_clients);
+	if (connections_size == connections_used) {
+		int old_size = connections_size;
+		connections_size *= 2;
 		connections = realloc(connections,
 				connections_size * sizeof (struct connection));
 		if (!connections) {
@@ -1233,46 +4932,160 @@ static void accept_connection(int sock_id,
 		if (!socks) {
 			exit(ENOMEM);
 		}
-		memset(connections + (connections_size / 2), 0,
-			(connections_size / 2) * sizeof (struct connection));
-		memset(socks + (connections_size / 2), 0,
-			(connections_size / 2) * sizeof (struct pollfd));
-
+		memset(connections + old_size, 0,
+			(connections_size - old_size) *
+			sizeof (struct connection));
+		memset(socks + old_size, 0,
+			(connections_size - old_size) * sizeof (struct pollfd));
 	}
 	int idx = connections_used;
 
-	struct sockaddr_storage ca;
-	socklen_t sz = sizeof (ca);
 	connections[idx].type = type;
-	socks[idx].fd = accept(socks[sock_id].fd, (struct sockaddr *) &ca, &sz);
+	connections[idx].machine = NULL;
+	connections[idx].relay = 0;
+	connections[idx].shard_peer = 0;
+	connections[idx].buffer = NULL;
+	connections[idx].size = 0;
+	connections[idx].offset = 0;
+	connections[idx].overlong = 0;
+	connections[idx].fanout = NULL;
+	connections[idx].owner = -1;
+	connections[idx].connecting = 0;
+	connections[idx].resolving = NULL;
+	connections[idx].streaming = 0;
+	connections[idx].keepalive = 0;
+	connections[idx].framed = 0;
+	connections[idx].watch = NULL;
+	connections[idx].snapshot = NULL;
+	connections[idx].uring_id = (++uring_ids ? uring_ids : ++uring_ids);
+	connections[idx].uring_poll = 0;
+	connections[idx].uring_revents = 0;
+	connections[idx].uring_recv = 0;
+	connections[idx].uring_sending = 0;
+	connections[idx].uring_send_done = 0;
+	socks[idx].fd = fd;
 	socks[idx].events = POLLIN;
+	socks[idx].revents = 0;
+
+	connections[idx].response = NULL;
+	if (type == peer) {
+		output_init(&connections[idx], 0);
+	}
+	connections[idx].in_use = 1;
+	connections_used++;
+	conns_by_type[type]++;
+
+	return (idx);
+}
+
+static void accept_connection(int sock_id,
+				struct conf *conf, enum connection_type type) {
+	UNUSED(conf);
+	int fd = accept(socks[sock_id].fd, NULL, NULL);
+	io_syscalls++;
+	if (fd < 0) {
+		return;
+	}
+
+	admit_connection(fd, type);
+}
+
+static void admit_connection(int fd, enum connection_type type) {
+	int idx = add_connection(fd, type);
+	if (idx < 0) {
+		// Accepted on the ring before the listener was paused
+		fprintf(stderr, "Refusing %s connection\n",
+			connection_types[type]);
+		refused[type]++;
+		close(fd);
+		return;
+	}
 
 	if (type == client) {
-		char host[UT_HOSTSIZE]; char service[PORT_SIZE];
-		if (getnameinfo((struct sockaddr *) &ca, sizeof (ca),
-				host, sizeof (host),
-				service, sizeof (service), 0) != 0) {
-			// What shall happen?
+		char host[UT_HOSTSIZE];
+		peer_hostname(fd, host, sizeof (host));
+
+		if ((connections[idx].machine = find_machine(host)) == NULL) {
+			connections[idx].machine = add_machine(host);
+		}
+
+		connections[idx].machine->connection_id = idx;
+		connections[idx].relay = relay_allowed(host);
+	}
+
+	if (type == finger) {
+		connections[idx].shard_peer = shard_is_peer(fd);
+		connections[idx].deadline = cur_msecs() +
+					conf->finger_read_timeout;
+	}
+
+	if (type == replica) {
+		output_init(&connections[idx], DFINGER_REPL_BUFFER_SIZE);
+		connections[idx].snapshot = malloc(
+					sizeof (struct snapshot_cursor));
+		if (!connections[idx].snapshot) {
+			exit(ENOMEM);
 		}
+		connections[idx].snapshot->started = 0;
+		num_replicas++;
+		append_buffer(connections[idx].response, "S\n", 2);
+		repl_snapshot_step(idx);
+	}
+}
+
+/*
+ * Returns 1 if host is listed in RELAY_HOSTS, only such clients may
+ * send records of other machines.
+ */
+static int relay_allowed(const char *host) {
+	const char *list = conf->relay_hosts;
+	size_t len = strlen(host);
+	if (!list || !len) {
+		return (0);
+	}
 
-		char *dot = strchr(host, '.');
-		if (dot) {
-			*dot = 0;
+	while (*list) {
+		size_t item = strcspn(list, ", ");
+		if (item == len && strncmp(list, host, len) == 0) {
+			return (1);
 		}
+		list += item;
+		list += strspn(list, ", ");
+	}
 
-		if ((connections[idx].machine = find_machine(host)) == NULL) {
-			connections[idx].machine = add_machine(host);
-		}
+	return (0);
+}
 
-		connections[idx].machine->connection_id = idx;
+/*
+ * Limits of connections by class. Watchers came as fingers and keep
+ * their slots, connections the server opens itself aren't limited.
+ */
+static int class_full(enum connection_type type) {
+	switch (type) {
+		case client:
+			return (conns_by_type[client] >= conf->max_clients);
+		case finger:
+			return (conns_by_type[finger] + conns_by_type[watcher] >=
+				conf->max_fingers);
+		case replica:
+			return (conns_by_type[replica] >= conf->max_replicas);
+		default:
+			return (0);
 	}
+}
 
-	connections[idx].response = malloc(sizeof (struct growing_buffer));
-	init_buffer(connections[idx].response, 0);
-	connections[idx].in_use = 1;
-	connections_used++;
-
-	listen(socks[sock_id].fd, 1);
+/*
+ * Listening socket of full class stops accepting, new connections wait
+ * in its listen queue until a slot frees, so fingers can't take slots
+ * of clients and the other way round.
+ */
+static void admission_update(void) {
+	for (int i = 0; i < LISTEN_SOCKS; i++) {
+		if (socks[i].fd >= 0) {
+			socks[i].events = (class_full(listen_types[i]) ?
+					0 : POLLIN);
+		}
+	}
 }
 
 static char * get_next_field(char *buffer, char *dest, size_t max_size) {
@@ -1324,80 +5137,349 @@ static int fetch_login(char *buffer, struct login *login) {
 		return (1);
 	}
 
+	// Logout time is optional, older dumps and clients don't have it
+	login->logout_time = 0;
+	if (get_next_field(buffer, time, DFINGER_BUFFER_SIZE)) {
+		login->logout_time = atoll(time);
+	}
+
 	return (0);
 }
 
 static void free_connection(int idx) {
-	free_buffer(connections[idx].response);
-	free(connections[idx].response);
-	close(socks[idx].fd);
+	if (uring_active) {
+		uring_forget(idx);
+	}
+	if (connections[idx].response) {
+		free_buffer(connections[idx].response);
+		free(connections[idx].response);
+	}
+	if (connections[idx].buffer) {
+		pool_put(connections[idx].buffer, connections[idx].size);
+	}
+	if (socks[idx].fd >= 0) {
+		close(socks[idx].fd);
+	}
+	if (connections[idx].resolving) {
+		resolve_cancel(connections[idx].resolving);
+	}
+	if (connections[idx].machine &&
+	    connections[idx].machine->connection_id == idx) {
+		connections[idx].machine->connection_id = -1;
+	}
+
+	conns_by_type[connections[idx].type]--;
+	if (connections[idx].type == replica) {
+		free(connections[idx].snapshot);
+		num_replicas--;
+	}
+
+	if (connections[idx].type == primary) {
+		repl_connected = 0;
+	}
+
+	if (connections[idx].type == watcher) {
+		free(connections[idx].watch);
+		num_watchers--;
+	}
+
+	if (connections[idx].fanout) {
+		struct fanout *fanout = connections[idx].fanout;
+		for (int i = 0; i < fanout->num_parts; i++) {
+			free_buffer(&fanout->parts[i]);
+		}
+		free(fanout);
+	}
+
+	for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+		// Peers of closed finger only wait to be closed too
+		if (connections[i].type == peer && connections[i].owner == idx) {
+			connections[i].owner = -1;
+		}
+	}
 	connections_used--;
 
 	if (idx == connections_used) {
+		connections[idx].in_use = 0;
 		return;
 	}
 
-	strncpy(connections[connections_used].buffer,
-		connections[idx].buffer, DFINGER_BUFFER_SIZE);
+	memcpy(&connections[idx], &connections[connections_used],
+		sizeof (struct connection));
+	if (connections[idx].machine &&
+	    connections[idx].machine->connection_id == connections_used) {
+		connections[idx].machine->connection_id = idx;
+	}
 
-	connections[idx].machine = connections[connections_used].machine;
-	connections[idx].type = connections[connections_used].type;
-	connections[idx].offset = connections[connections_used].offset;
-	connections[idx].response = connections[connections_used].response;
+	for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+		if (connections[i].type == peer &&
+		    connections[i].owner == connections_used) {
+			connections[i].owner = idx;
+		}
+	}
 
 	connections[connections_used].in_use = 0;
 
 	socks[idx].fd = socks[connections_used].fd;
 	socks[idx].events = socks[connections_used].events;
+	socks[idx].revents = socks[connections_used].revents;
+	if (uring_active && socks[idx].fd >= 0 &&
+	    socks[idx].fd < uring_fds_size) {
+		uring_fds[socks[idx].fd] = idx;
+	}
+}
+
+/*
+ * Handles one non-blank line of client update. Lines starting with
+ * exclamation marks are commands, the rest are login records of machine
+ * currently selected for the connection. Relays select the machine
+ * the following records belong to by "!!! MACHINE hostname".
+ */
+static void process_update_line(struct connection *con, char *line) {
+	ingest_lines++;
+	if (line[0] != '!') {
+		struct login login;
+		if (fetch_login(line, &login) == 0) {
+			update_login(con->machine, &login);
+		}
+		return;
+	}
+
+	if (strncmp(line, "!!! END", 7) == 0) {
+		update_machine(con->machine);
+	}
+
+	if (strncmp(line, "!!! BYE", 7) == 0) {
+		logout_machine(con->machine);
+	}
+
+	if (strncmp(line, "!!! MACHINE ", 12) == 0) {
+		char *host = line + 12;
+		if (!con->relay || !*host || strlen(host) >= UT_HOSTSIZE) {
+			return;
+		}
+
+		// Relay itself doesn't send updates, its machine mustn't
+		// log the relay out when its lifetime passes
+		struct machine *own = con->machine;
+		if (own && own->connection_id >= 0 &&
+		    &connections[own->connection_id] == con) {
+			own->connection_id = -1;
+		}
+
+		if ((con->machine = find_machine(host)) == NULL) {
+			con->machine = add_machine(host);
+		}
+	}
 }
 
 static ssize_t read_message(int fd, struct connection *con) {
-	ssize_t num_read = read(fd, con->buffer + con->offset,
-				DFINGER_BUFFER_SIZE - con->offset);
-	if (num_read < 0) {
+	ssize_t num_read = input_fill(fd, con);
+	if (num_read <= 0) {
 		return (num_read);
 	}
+	process_message(con, num_read);
+	input_release(con);
+
+	return (num_read);
+}
+
+/*
+ * Processes num_read bytes placed in the input buffer after the bytes
+ * left there before.
+ */
+static void process_message(struct connection *con, size_t num_read) {
+	ingest_bytes += num_read;
 	size_t buf_len = con->offset + num_read;
-	con->offset = 0;
+	con->buffer[buf_len] = 0;
+	con->offset = input_skip(con, buf_len);
 
 	int ret;
 	char line[DFINGER_LINE_SIZE];
-	size_t line_len = DFINGER_LINE_SIZE;
+	size_t line_len = DFINGER_LINE_SIZE - 1;
 
 	while ((ret = fetch_line(con->buffer, buf_len, &(con->offset),
-				line, line_len)) == RTL_LINE_FETCHED) {
-		if (line[0] == '!') {
-			if (strncmp(line, "!!! END", 7) == 0) {
+				line, line_len)) != RTL_WANT_MORE) {
+		switch (ret) {
+			case RTL_LINE_FETCHED:
+				process_update_line(con, line);
+				break;
+			case RTL_BLANK_LINE:
 				update_machine(con->machine);
-			}
-			if (strncmp(line, "!!! BYE", 7) == 0) {
-				logout_machine(con->machine);
-			}
-		} else {
-			struct login login;
-			fetch_login(line, &login);
-			update_login(con->machine, &login);
+				break;
+			default:
+				// Malformed line is skipped
+				break;
 		}
 	}
 
-	switch (ret) {
-		case RTL_BLANK_LINE:
-			update_machine(con->machine);
-			con->offset = 0;
-			break;
-		case RTL_WANT_MORE:
-			move_buffer(con->buffer, buf_len, &con->offset);
-			break;
-		case RTL_ERROR_OCCURED:
-			break;
+	move_buffer(con->buffer, buf_len, &con->offset);
+	input_drop_overlong(con);
+}
+
+/*
+ * Processes data received on the ring, the input buffer grows to take
+ * it whole when it can.
+ */
+static void receive_message(struct connection *con, char *data, size_t len) {
+	size_t limit = input_limit(con);
+	while (len) {
+		size_t want = con->offset + len + 1;
+		input_reserve(con, (want < limit ? want : limit));
+
+		size_t room = con->size - con->offset - 1;
+		size_t num = (len < room ? len : room);
+		memcpy(con->buffer + con->offset, data, num);
+		process_message(con, num);
+		data += num;
+		len -= num;
+	}
+	input_release(con);
+}
+
+/*
+ * Largest input buffer of the connection. Finger requests are short,
+ * clients may send big updates at once.
+ */
+static size_t input_limit(struct connection *con) {
+	if (con->type == client || con->type == primary) {
+		return (DFINGER_INPUT_MAXSIZE);
+	}
+
+	return (DFINGER_BUFFER_SIZE);
+}
+
+/*
+ * Makes input buffer at least size bytes big, keeping its content.
+ */
+static void input_reserve(struct connection *con, size_t size) {
+	if (con->buffer && con->size >= size) {
+		return;
+	}
+
+	size_t got;
+	char *buffer = pool_get(size, &got);
+	if (con->buffer) {
+		memcpy(buffer, con->buffer, con->offset);
+		pool_put(con->buffer, con->size);
+	}
+	con->buffer = buffer;
+	con->size = got;
+}
+
+/*
+ * Returns input buffer of connection with no pending input to the pool,
+ * so idle connections hold none.
+ */
+static void input_release(struct connection *con) {
+	if (con->buffer && !con->offset && !con->overlong) {
+		pool_put(con->buffer, con->size);
+		con->buffer = NULL;
+		con->size = 0;
+	}
+}
+
+/*
+ * Keeps name of peer in its input buffer, peers don't read into it.
+ */
+static void input_set(struct connection *con, const char *str) {
+	input_reserve(con, strlen(str) + 1);
+	strcpy(con->buffer, str);
+}
+
+/*
+ * Reads what's available after the input left in buffer. Data not fitting
+ * the buffer land in spill area in the same readv() call and the buffer
+ * grows to take them, up to the limit of the connection.
+ */
+static ssize_t input_fill(int fd, struct connection *con) {
+	static char spill[DFINGER_INPUT_MAXSIZE];
+	size_t limit = input_limit(con);
+	size_t want = con->offset + DFINGER_LINE_SIZE;
+	input_reserve(con, (want < limit ? want : limit));
+
+	struct iovec iov[2];
+	iov[0].iov_base = con->buffer + con->offset;
+	iov[0].iov_len = con->size - con->offset - 1;
+	iov[1].iov_base = spill;
+	iov[1].iov_len = limit - con->size;
+	ssize_t num_read = readv(fd, iov, 2);
+	io_syscalls++;
+	if (num_read <= 0) {
+		return (num_read);
+	}
+
+	size_t room = iov[0].iov_len;
+	if ((size_t) num_read > room) {
+		// Bytes read into the buffer move with it when it grows
+		con->offset += room;
+		input_reserve(con, con->offset + num_read - room + 1);
+		memcpy(con->buffer + con->offset, spill, num_read - room);
+		con->offset -= room;
 	}
 
 	return (num_read);
 }
 
+/*
+ * Returns offset of the first line in buf_len bytes of input, rest of line
+ * dropped by input_drop_overlong() is skipped.
+ */
+static size_t input_skip(struct connection *con, size_t buf_len) {
+	if (!con->overlong) {
+		return (0);
+	}
+
+	char *nl = memchr(con->buffer, '\n', buf_len);
+	if (!nl) {
+		return (buf_len);
+	}
+	con->overlong = 0;
+
+	return (nl + 1 - con->buffer);
+}
+
+/*
+ * Drops incomplete line filling whole buffer of the largest size, so that
+ * reading goes on with the next line instead of getting stuck.
+ */
+static void input_drop_overlong(struct connection *con) {
+	if (con->offset + 1 >= input_limit(con)) {
+		con->offset = 0;
+		con->overlong = 1;
+	}
+}
+
+/*
+ * Gives connection empty response buffer of at most max_size bytes, 0
+ * for the default. Only connections which write get one, fingers once
+ * they are answered; buffer of the same size is reused.
+ */
+static void output_init(struct connection *con, size_t max_size) {
+	if (con->response && max_size &&
+	    con->response->max_size == max_size) {
+		con->response->offset = 0;
+		con->response->len = 0;
+		return;
+	} else if (con->response) {
+		free_buffer(con->response);
+	} else {
+		con->response = malloc(sizeof (struct growing_buffer));
+		if (!con->response) {
+			exit(ENOMEM);
+		}
+	}
+	init_buffer(con->response, max_size);
+}
+
 static ssize_t read_request(int fd, struct connection *con) {
+	size_t limit = input_limit(con);
+	size_t want = con->offset + DFINGER_LINE_SIZE;
+	input_reserve(con, (want < limit ? want : limit));
+
 	ssize_t num_read = read(fd, con->buffer + con->offset,
-				DFINGER_BUFFER_SIZE - con->offset);
+				con->size - con->offset - 1);
+	io_syscalls++;
 	if (num_read < 0) {
 		return (num_read);
 	}
@@ -1415,8 +5497,11 @@ static ssize_t write_response(int fd, struct growing_buffer *response) {
 	} else {
 		len = DFINGER_BUFFER_SIZE;
 	}
+	TRACE_BEGIN("write");
 	ssize_t num_written = write(fd, response->buffer + response->offset,
 					len);
+	TRACE_END("write");
+	io_syscalls++;
 	if (num_written < 0) {
 		return (num_written);
 	}
@@ -1426,15 +5511,288 @@ static ssize_t write_response(int fd, struct growing_buffer *response) {
 	return (num_written);
 }
 
+/*
+ * Switches the server to io_uring if the kernel supports everything
+ * it needs, otherwise the server stays with poll.
+ */
+static void uring_start(void) {
+	int err = uring_init(&ring, DFINGER_BUFFER_SIZE);
+	if (err) {
+		fprintf(stderr, "io_uring not available (%s), using poll\n",
+			strerror(err));
+		return;
+	}
+
+	uring_active = 1;
+}
+
+static unsigned long long uring_tag(int idx, enum uring_op op) {
+	return ((unsigned long long) connections[idx].uring_id << 32 |
+		(unsigned long long) socks[idx].fd << 4 | op);
+}
+
+/*
+ * Queues operations the connections wait for: multishot accept on
+ * listening sockets, multishot receive into provided buffers on client
+ * connections, send of whole finger answers and poll for the rest.
+ * Everything is submitted by one system call together with the wait.
+ */
+static void uring_arm(long long *timeout) {
+	for (int i = 0; i < connections_used; i++) {
+		struct connection *con = &connections[i];
+		int fd = socks[i].fd;
+		if (fd < 0) {
+			continue;
+		}
+
+		if (fd >= uring_fds_size) {
+			int size = fd * 2 + 64;
+			uring_fds = realloc(uring_fds, size * sizeof (int));
+			if (!uring_fds) {
+				exit(ENOMEM);
+			}
+			uring_fds_size = size;
+		}
+		uring_fds[fd] = i;
+
+		if (con->uring_revents) {
+			// Completed before the connection was moved
+			*timeout = 0;
+		}
+
+		if (i < LISTEN_SOCKS && !(socks[i].events & POLLIN)) {
+			if (con->uring_recv) {
+				// Class is full, accepting stops
+				uring_prep_cancel(uring_get_sqe(&ring),
+					uring_tag(i, URING_ACCEPT),
+					uring_tag(i, URING_IGNORE));
+				con->uring_recv = 0;
+			}
+			continue;
+		}
+
+		if (i < LISTEN_SOCKS || con->type == client) {
+			if (!con->uring_recv) {
+				struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+				if (i < LISTEN_SOCKS) {
+					uring_prep_accept(sqe, fd,
+						uring_tag(i, URING_ACCEPT));
+				} else {
+					uring_prep_recv(sqe, fd,
+						uring_tag(i, URING_RECV));
+				}
+				con->uring_recv = 1;
+			}
+			continue;
+		}
+
+		// Forwarded answer grows while it's sent, so it's written
+		if (con->type == finger && socks[i].events & POLLOUT &&
+		    !con->streaming) {
+			struct growing_buffer *response = con->response;
+			if (!con->uring_sending && !con->uring_send_done) {
+				uring_prep_send(uring_get_sqe(&ring), fd,
+					response->buffer + response->offset,
+					response->len - response->offset,
+					uring_tag(i, URING_SEND));
+				con->uring_sending = 1;
+			}
+			continue;
+		}
+
+		short events = socks[i].events;
+		if (!(events & ~con->uring_poll)) {
+			continue;
+		}
+		if (con->uring_poll) {
+			uring_prep_poll_update(uring_get_sqe(&ring),
+				uring_tag(i, URING_POLL),
+				events | con->uring_poll,
+				uring_tag(i, URING_IGNORE));
+		} else {
+			uring_prep_poll(uring_get_sqe(&ring), fd, events,
+				uring_tag(i, URING_POLL));
+		}
+		con->uring_poll |= events;
+	}
+}
+
+/*
+ * Handles completions, returns their number.
+ */
+static int uring_reap(void) {
+	int reaped = 0;
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = uring_peek(&ring))) {
+		reaped++;
+		unsigned long long tag = cqe->user_data;
+		enum uring_op op = tag & 15;
+		int fd = (tag >> 4) & 0xfffffff;
+		unsigned int id = tag >> 32;
+
+		int idx = (fd < uring_fds_size ? uring_fds[fd] : -1);
+		if (op == URING_IGNORE) {
+			// Nothing to do
+		} else if (idx >= 0 && idx < connections_used &&
+		    socks[idx].fd == fd && connections[idx].uring_id == id) {
+			uring_complete(idx, op, cqe);
+		} else {
+			uring_stale(op, cqe);
+		}
+		uring_seen(&ring);
+	}
+
+	return (reaped);
+}
+
+static void uring_complete(int idx, enum uring_op op,
+				struct io_uring_cqe *cqe) {
+	struct connection *con = &connections[idx];
+	int more = cqe->flags & IORING_CQE_F_MORE;
+	int res = cqe->res;
+
+	if (op == URING_ACCEPT) {
+		if (res == -ECANCELED) {
+			// Listener was paused, uring_arm() knows
+			return;
+		}
+		con->uring_recv = more;
+		if (res >= 0) {
+			admit_connection(res, listen_types[idx]);
+		}
+		return;
+	}
+
+	if (op == URING_POLL) {
+		con->uring_poll = 0;
+		if (res > 0) {
+			con->uring_revents |= res;
+		}
+		return;
+	}
+
+	if (op == URING_SEND) {
+		con->uring_sending = 0;
+		con->uring_send_done = 1;
+		con->uring_sent = res;
+		if (res > 0) {
+			con->response->offset += res;
+		}
+		con->uring_revents |= POLLOUT;
+		return;
+	}
+
+	con->uring_recv = more;
+	if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+		// Out of buffers (receive is armed again) or end of stream
+		if (res != -ENOBUFS) {
+			free_connection(idx);
+		}
+		return;
+	}
+
+	unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	long long start = cur_usecs();
+	long long lines = ingest_lines;
+	TRACE_BEGIN("update");
+	receive_message(con, uring_buffer(&ring, bid), res);
+	TRACE_END("update");
+	uring_put_buffer(&ring, bid);
+
+	long long elapsed = cur_usecs() - start;
+	histogram_observe(&update_latency, elapsed);
+	slow_update(con, elapsed, ingest_lines - lines, res);
+}
+
+/*
+ * Completion of closed connection, its buffers are released.
+ */
+static void uring_stale(enum uring_op op, struct io_uring_cqe *cqe) {
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		uring_put_buffer(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	}
+
+	if (op != URING_SEND) {
+		return;
+	}
+
+	for (int i = 0; i < uring_num_orphans; i++) {
+		if (uring_orphans[i].tag == cqe->user_data) {
+			free_buffer(uring_orphans[i].buffer);
+			free(uring_orphans[i].buffer);
+			uring_orphans[i] = uring_orphans[--uring_num_orphans];
+			break;
+		}
+	}
+}
+
+/*
+ * Hands events completed on the ring to the connection's handlers.
+ */
+static void uring_deliver(int idx) {
+	struct connection *con = &connections[idx];
+	socks[idx].revents = con->uring_revents &
+				(socks[idx].events | POLLERR | POLLHUP);
+	con->uring_revents = 0;
+	if (con->uring_sending) {
+		// Written by the ring, not by the handler
+		socks[idx].revents &= ~POLLOUT;
+	}
+}
+
+/*
+ * Cancels operations of connection being closed. Response the kernel
+ * may be sending is kept until the send completes.
+ */
+static void uring_forget(int idx) {
+	struct connection *con = &connections[idx];
+	if (socks[idx].fd < 0) {
+		return;
+	}
+
+	if (con->uring_recv) {
+		uring_prep_cancel(uring_get_sqe(&ring), uring_tag(idx, URING_RECV),
+			uring_tag(idx, URING_IGNORE));
+	}
+	if (con->uring_poll) {
+		uring_prep_cancel(uring_get_sqe(&ring), uring_tag(idx, URING_POLL),
+			uring_tag(idx, URING_IGNORE));
+	}
+	if (con->uring_sending) {
+		uring_prep_cancel(uring_get_sqe(&ring), uring_tag(idx, URING_SEND),
+			uring_tag(idx, URING_IGNORE));
+
+		uring_orphans = realloc(uring_orphans, (uring_num_orphans + 1) *
+					sizeof (struct uring_orphan));
+		if (!uring_orphans) {
+			exit(ENOMEM);
+		}
+		uring_orphans[uring_num_orphans].tag = uring_tag(idx, URING_SEND);
+		uring_orphans[uring_num_orphans].buffer = con->response;
+		uring_num_orphans++;
+		con->response = NULL;
+	}
+}
+
 void server_run(void) {
 	read_data();
 
-	connections_size = 2;
-	connections_used = 2;
+	connections_size = LISTEN_SOCKS;
+	connections_used = LISTEN_SOCKS;
 	connections = malloc(connections_size * sizeof (struct connection));
 	memset(connections, 0, connections_size * sizeof (struct connection));
 	socks = malloc(connections_size * sizeof (struct pollfd));
+	memset(socks, 0, connections_size * sizeof (struct pollfd));
 	initial_bind(connections, socks, conf);
+	if (conf->io_uring) {
+		uring_start();
+	}
+	init_buffer(&repl_log, DFINGER_REPL_BUFFER_SIZE);
+	init_buffer(&watch_log, DFINGER_WATCH_LOG_SIZE);
+	query_tokens = conf->query_burst;
+	query_refill = cur_msecs();
+	long long next_repl_connect = 0;
 
 	long long next_dump = cur_secs() + conf->timeout_dump;
 	long long next_check = cur_secs() + conf->client_lifetime;
@@ -1451,11 +5809,20 @@ void server_run(void) {
 	act_sigterm.sa_handler = sigterm_handler;
 	sigaction(SIGTERM, &act_sigterm, NULL);
 
+	struct sigaction act_sigusr1;
+	memset(&act_sigusr1, 0, sizeof (struct sigaction));
+	act_sigusr1.sa_handler = sigusr1_handler;
+	sigaction(SIGUSR1, &act_sigusr1, NULL);
+
+	// SIGUSR1 toggles tracing, TRACING in reread config sets it
+	int tracing = conf->tracing;
+	trace_switch(tracing, conf->trace_file);
+
 	while (1) {
 		int cur_time = cur_secs();
 		int remaining = next_dump - cur_time;
 		if (next_check - cur_time < remaining) {
-			remaining = next_dump - cur_time;
+			remaining = next_check - cur_time;
 		}
 		if (next_clear - cur_time < remaining) {
 			remaining = next_clear - cur_time;
@@ -1467,36 +5834,193 @@ void server_run(void) {
 			remaining = 0;
 		}
 
-		poll(socks, connections_used, remaining * 1000);
+		long long timeout = remaining * 1000LL;
+		long long now = cur_msecs();
+		if (num_replicas && repl_next_heartbeat - now < timeout) {
+			timeout = repl_next_heartbeat - now;
+		}
+		if (conf->is_replica && !repl_connected &&
+		    next_repl_connect - now < timeout) {
+			timeout = next_repl_connect - now;
+		}
+		admission_update();
+		for (int i = LISTEN_SOCKS; i < connections_used; i++) {
+			if ((connections[i].type == peer ||
+			    (connections[i].type == finger &&
+			    connections[i].deadline)) &&
+			    connections[i].deadline - now < timeout) {
+				timeout = connections[i].deadline - now;
+			}
+			if (connections[i].resolving &&
+			    DFINGER_RESOLVE_POLL < timeout) {
+				timeout = DFINGER_RESOLVE_POLL;
+			}
+		}
+		if (timeout < 0) {
+			timeout = 0;
+		}
+
+		int ready = 0;
+		if (uring_active) {
+			uring_arm(&timeout);
+			uring_wait(&ring, timeout);
+		} else {
+			ready = poll(socks, connections_used, timeout);
+			io_syscalls++;
+		}
+		long long tick[NUM_TICK_PHASES];
+		memset(tick, 0, sizeof (tick));
+		long long tick_start = cur_usecs();
+		long long mark = tick_start;
+
+		if (trace_toggle) {
+			trace_toggle = 0;
+			trace_switch(!trace_enabled, conf->trace_file);
+		}
+		if (conf->tracing != tracing) {
+			tracing = conf->tracing;
+			trace_switch(tracing, conf->trace_file);
+		}
+
+		if (uring_active) {
+			ready = uring_reap();
+		}
+
+		// Slot of connection freed in the pass gets the last one,
+		// the slot is visited again then
+		unsigned int id = 0;
+		for (int i = LISTEN_SOCKS; i < connections_used;
+		    i += (connections[i].uring_id == id)) {
+			id = connections[i].uring_id;
+			if (uring_active) {
+				uring_deliver(i);
+			}
+
+			if (connections[i].type == peer) {
+				if (connections[i].resolving) {
+					peer_resolved(i);
+				}
+
+				if (connections[i].in_use &&
+				    connections[i].uring_id == id &&
+				    socks[i].revents) {
+					handle_peer(i, socks[i].revents);
+				}
+				// Shard sending slowly times out as well
+				if (connections[i].in_use &&
+				    connections[i].uring_id == id &&
+				    cur_msecs() >= connections[i].deadline) {
+					peer_done(i, 1);
+				}
+				continue;
+			}
+
+			if (connections[i].type == replica) {
+				if (socks[i].revents) {
+					handle_replica(i, socks[i].revents);
+				}
+				continue;
+			}
+
+			if (connections[i].type == watcher) {
+				if (socks[i].revents) {
+					handle_watcher(i, socks[i].revents);
+				}
+				continue;
+			}
+
+			if (connections[i].type == primary &&
+			    socks[i].revents & (POLLIN | POLLHUP)) {
+				if (read_primary(socks[i].fd,
+					&connections[i]) <= 0) {
+					fprintf(stderr, "Lost primary\n");
+					free_connection(i);
+				}
+				continue;
+			}
 
-		for (int i = 2; i < connections_used; i++) {
 			if (connections[i].type == client &&
-			    socks[i].revents & POLLIN) {
-				if (read_message(socks[i].fd,
-					&connections[i]) == 0) {
+			    socks[i].revents & (POLLIN | POLLHUP)) {
+				long long start = cur_usecs();
+				long long lines = ingest_lines;
+				TRACE_BEGIN("update");
+				ssize_t num_read = read_message(socks[i].fd,
+							&connections[i]);
+				TRACE_END("update");
+				if (num_read <= 0) {
 					free_connection(i);
+					continue;
+				}
+				long long elapsed = cur_usecs() - start;
+				histogram_observe(&update_latency, elapsed);
+				slow_update(&connections[i], elapsed,
+						ingest_lines - lines, num_read);
+				continue;
+			}
+
+			if (connections[i].type == finger &&
+			    connections[i].deadline &&
+			    !(socks[i].revents & POLLIN) &&
+			    cur_msecs() >= connections[i].deadline) {
+				// Slow or silent finger gives its slot up
+				if (connections[i].offset) {
+					reclaimed_read++;
+				} else {
+					reclaimed_idle++;
 				}
+				free_connection(i);
+				continue;
 			}
 
 			if (connections[i].type == finger &&
 			    socks[i].revents & POLLIN) {
 				if (read_request(socks[i].fd,
-					&connections[i]) == 0) {
+					&connections[i]) <= 0) {
 					free_connection(i);
+					continue;
 				}
-				if (finger_complete_request(
-						connections[i].buffer,
-						connections[i].offset)) {
-					connections[i].offset = 0;
-					finger_respond(i);
-				}
+				finger_next(i);
 			}
 
 			if (connections[i].type == finger &&
 			    socks[i].revents & POLLOUT) {
-				if (write_response(socks[i].fd,
-						connections[i].response) == 0) {
+				struct growing_buffer *response =
+				    connections[i].response;
+				int written;
+				if (connections[i].uring_send_done) {
+					connections[i].uring_send_done = 0;
+					written = connections[i].uring_sent;
+				} else {
+					written = write_response(socks[i].fd,
+								response);
+				}
+				if (written >= 0 &&
+				    response->offset == response->len &&
+				    !connections[i].streaming) {
+					histogram_observe(&query_latency[
+					    connections[i].query_kind],
+					    cur_usecs() -
+					    connections[i].query_start);
+					slow_query(i);
+				}
+				if (written < 0 ||
+				    (response->offset == response->len &&
+				    !connections[i].streaming &&
+				    !connections[i].keepalive)) {
 					free_connection(i);
+					continue;
+				}
+
+				if (response->offset == response->len &&
+				    connections[i].streaming) {
+					// Forwarded answer isn't complete yet
+					response->offset = 0;
+					response->len = 0;
+					connections[i].framed = 0;
+					socks[i].events = 0;
+					resume_forward(i);
+				} else if (response->offset == response->len) {
+					finger_next(i);
 				}
 			}
 		}
@@ -1509,24 +6033,60 @@ void server_run(void) {
 			accept_connection(1, conf, finger);
 		}
 
+		if (socks[2].revents & POLLIN) {
+			accept_connection(2, conf, replica);
+		}
+
+		tick[TICK_EVENTS] = lap(&mark);
+
+		repl_flush();
+		watch_flush();
+		tick[TICK_FLUSH] = lap(&mark);
+
+		if (conf->is_replica && !repl_connected &&
+		    cur_msecs() >= next_repl_connect) {
+			connect_primary();
+			next_repl_connect = cur_msecs() +
+						conf->timeout_update * 1000LL;
+		}
+
 		if (cur_secs() >= next_dump) {
+			lap(&mark);
 			write_data();
+			tick[TICK_DUMP] = lap(&mark);
+			histogram_observe(&dump_duration, tick[TICK_DUMP]);
+			slowlog_flush(conf->slow_log_file);
 			next_dump = cur_secs() + conf->timeout_dump;
 		}
 
 		if (cur_secs() >= next_check) {
-			check_machines();
+			// Replica learns about expired machines from primary
+			if (!conf->is_replica) {
+				lap(&mark);
+				check_machines();
+				tick[TICK_CHECK] = lap(&mark);
+				histogram_observe(&check_duration,
+						tick[TICK_CHECK]);
+			}
 			next_check = cur_secs() + conf->client_lifetime;
 		}
 
 		if (cur_secs() >= next_clear) {
+			lap(&mark);
 			clear_old_records();
+			tick[TICK_CLEAR] = lap(&mark);
+			histogram_observe(&clear_duration, tick[TICK_CLEAR]);
 			next_clear = cur_secs() + conf->timeout_clear;
 		}
 
 		if (cur_secs() >= next_cut) {
+			lap(&mark);
 			cut_records();
+			tick[TICK_CUT] = lap(&mark);
+			histogram_observe(&cut_duration, tick[TICK_CUT]);
 			next_cut = cur_secs() + conf->timeout_cut;
 		}
+
+		slow_tick(tick, cur_usecs() - tick_start, ready);
 	}
 }
@@ -26,6 +26,7 @@ struct login_data {
 	struct machine *machine;
 	long long login_time;
 	long long idle_time;
+	long long logout_time;		// Zero while logged in or if unknown
 	char line[UT_LINESIZE];
 	char host[UT_HOSTSIZE];
 
@@ -0,0 +1,209 @@
+#define	_XOPEN_SOURCE 600
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "shard.h"
+#include "utils.h"
+
+/*
+ * Sharded deployment: every server owns part of machines, chosen by
+ * consistent hashing of hostname. Each server of SHARD_SERVERS list
+ * is put on the ring SHARD_VNODES times so that machines spread evenly
+ * and adding a server moves only machines of its new ranges.
+ */
+
+struct ring_point {
+	uint32_t hash;
+	int shard;
+};
+
+static uint32_t hash_str(const char *str);
+static int cmp_ring_points(const void *p1, const void *p2);
+static int parse_shard(char *entry, struct shard *shard);
+static void resolve_shard(struct shard *shard);
+
+static struct shard shards[SHARD_MAX];
+static int num_shards;
+
+static struct ring_point ring[SHARD_MAX * SHARD_VNODES];
+static int ring_size;
+
+// FNV-1a
+static uint32_t hash_str(const char *str) {
+	uint32_t hash = 2166136261u;
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash *= 16777619u;
+	}
+
+	return (hash);
+}
+
+static int cmp_ring_points(const void *p1, const void *p2) {
+	const struct ring_point *a = p1;
+	const struct ring_point *b = p2;
+
+	if (a->hash != b->hash) {
+		return (a->hash < b->hash ? -1 : 1);
+	}
+
+	return (a->shard - b->shard);
+}
+
+/*
+ * Parses entry of form host:port:finger_port
+ */
+static int parse_shard(char *entry, struct shard *shard) {
+	char *port = strchr(entry, ':');
+	if (!port || port - entry >= DFINGER_HOST_SIZE) {
+		return (1);
+	}
+	char *finger_port = strchr(port + 1, ':');
+	if (!finger_port) {
+		return (1);
+	}
+
+	memset(shard, 0, sizeof (struct shard));
+	strncpy(shard->host, entry, port - entry);
+	shard->port = strtol(port + 1, NULL, 10);
+	shard->finger_port = strtol(finger_port + 1, NULL, 10);
+
+	return (shard->port <= 0 || shard->finger_port <= 0);
+}
+
+static void resolve_shard(struct shard *shard) {
+	struct addrinfo *r, hints;
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	char portstr[PORT_SIZE];
+	snprintf(portstr, PORT_SIZE, "%d", shard->finger_port);
+
+	if (getaddrinfo(shard->host, portstr, &hints, &r) != 0) {
+		fprintf(stderr, "Could not resolve shard %s\n", shard->host);
+		return;
+	}
+
+	memcpy(&shard->finger_addr, r->ai_addr, r->ai_addrlen);
+	shard->finger_addrlen = r->ai_addrlen;
+	freeaddrinfo(r);
+}
+
+/*
+ * Loads comma separated list of shards and builds the ring,
+ * returns number of shards loaded.
+ */
+int shard_load(const char *list) {
+	num_shards = 0;
+	ring_size = 0;
+	if (!list) {
+		return (0);
+	}
+
+	char *copy = malloc(strlen(list) + 1);
+	if (!copy) {
+		exit(ENOMEM);
+	}
+	strcpy(copy, list);
+
+	char *saveptr;
+	char *entry = strtok_r(copy, ", \t", &saveptr);
+	while (entry && num_shards < SHARD_MAX) {
+		if (parse_shard(entry, &shards[num_shards]) != 0) {
+			fprintf(stderr, "Invalid shard %s\n", entry);
+		} else {
+			resolve_shard(&shards[num_shards]);
+			num_shards++;
+		}
+		entry = strtok_r(NULL, ", \t", &saveptr);
+	}
+	free(copy);
+
+	char point[DFINGER_HOST_SIZE + 2 * PORT_SIZE];
+	for (int i = 0; i < num_shards; i++) {
+		for (int j = 0; j < SHARD_VNODES; j++) {
+			snprintf(point, sizeof (point), "%.*s:%d#%d",
+				DFINGER_HOST_SIZE - 1, shards[i].host,
+				shards[i].port, j);
+			ring[ring_size].hash = hash_str(point);
+			ring[ring_size].shard = i;
+			ring_size++;
+		}
+	}
+
+	qsort(ring, ring_size, sizeof (struct ring_point), cmp_ring_points);
+
+	return (num_shards);
+}
+
+int shard_count(void) {
+	return (num_shards);
+}
+
+struct shard * shard_get(int idx) {
+	return (&shards[idx]);
+}
+
+/*
+ * Returns index of shard owning the machine, or -1 if there are
+ * no shards configured.
+ */
+int shard_owner(const char *hostname) {
+	if (!ring_size) {
+		return (-1);
+	}
+
+	uint32_t hash = hash_str(hostname);
+	int lo = 0, hi = ring_size;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (ring[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return (ring[lo % ring_size].shard);
+}
+
+/*
+ * Returns 1 if the peer on socket fd has address of one of the shards,
+ * only those may ask for the part of answer known to this server alone.
+ */
+int shard_is_peer(int fd) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof (addr);
+	if (!num_shards ||
+	    getpeername(fd, (struct sockaddr *) &addr, &len) != 0) {
+		return (0);
+	}
+
+	for (int i = 0; i < num_shards; i++) {
+		struct sockaddr_storage *shard = &shards[i].finger_addr;
+		if (!shards[i].finger_addrlen ||
+		    shard->ss_family != addr.ss_family) {
+			continue;
+		}
+
+		if (addr.ss_family == AF_INET &&
+		    memcmp(&((struct sockaddr_in *) shard)->sin_addr,
+			&((struct sockaddr_in *) &addr)->sin_addr,
+			sizeof (struct in_addr)) == 0) {
+			return (1);
+		}
+		if (addr.ss_family == AF_INET6 &&
+		    memcmp(&((struct sockaddr_in6 *) shard)->sin6_addr,
+			&((struct sockaddr_in6 *) &addr)->sin6_addr,
+			sizeof (struct in6_addr)) == 0) {
+			return (1);
+		}
+	}
+
+	return (0);
+}
@@ -0,0 +1,24 @@
+#ifndef __SHARD_H
+#define	__SHARD_H
+
+#include <sys/socket.h>
+
+#include "conf.h"
+
+#define	SHARD_MAX 64
+#define	SHARD_VNODES 100	// Points on the ring per server
+
+struct shard {
+	char host[DFINGER_HOST_SIZE];
+	int port;			// Port for updates
+	int finger_port;		// Port for finger requests
+	struct sockaddr_storage finger_addr;
+	socklen_t finger_addrlen;	// Zero if host could not be resolved
+};
+
+int shard_load(const char *list);
+int shard_count(void);
+struct shard * shard_get(int idx);
+int shard_owner(const char *hostname);
+int shard_is_peer(int fd);
+#endif
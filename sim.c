@@ -0,0 +1,353 @@
+/*
+ * Simulation of the server on virtual time. Server is included whole and
+ * its store is driven in-process, without sockets: updates go through
+ * process_update_line() just like those of relayed clients, queries
+ * through finger_process_request() and housekeeping runs whenever it's
+ * due by the configured timeouts, while the clock only moves when the
+ * script says so.
+ *
+ * Script (file or standard input) consists of commands
+ *	time secs		set the clock (seconds since the epoch)
+ *	advance secs		move the clock, running due housekeeping
+ *	update host		update of host, sessions follow up to blank line
+ *	bye host		host logs out
+ *	query [finger query]	print answer to the query
+ *	housekeep		run all housekeeping now
+ *	stats			print sizes of the store and heap
+ *	fleet machines sessions days interval
+ *				simulate machines with about sessions
+ *				sessions each, updating every interval
+ *				seconds, printing stats for every day
+ * Lines starting with '#' are ignored.
+ */
+#include "server.c"
+
+#include <malloc.h>
+
+#define	SIM_USERS_PER_SESSION 2		// User names per simulated session
+#define	SIM_SESSION_HOURS 8		// Mean length of simulated session
+
+struct conf *conf;
+char conf_file[DFINGER_FILENAME_SIZE];
+
+enum sim_task {
+	SIM_UPDATE,
+	SIM_CHECK,
+	SIM_CLEAR,
+	SIM_CUT,
+	NUM_SIM_TASKS
+};
+
+struct sim_session {
+	int user;
+	int line;
+	long long login_time;
+};
+
+static long long sim_clock(void);
+static long long real_usecs(void);
+static void sim_line(char *line);
+static void sim_advance(long long target);
+static void sim_task(enum sim_task task);
+static void sim_stats(void);
+static void sim_query(char *query);
+static void sim_fleet(int machines, int sessions, int days, int interval);
+static void run_script(FILE *script);
+
+static const char *task_names[NUM_SIM_TASKS] = {
+	"update", "check", "clear", "cut"
+};
+
+static long long sim_now;		// Virtual time [us]
+static long long next_check, next_clear, next_cut;
+static long long task_usecs[NUM_SIM_TASKS];	// Time spent since last stats
+static long long task_runs[NUM_SIM_TASKS];
+static struct connection sim_con;	// Connection updates arrive on
+static unsigned int seed = 1;
+
+static long long sim_clock(void) {
+	return (sim_now);
+}
+
+static long long real_usecs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+/*
+ * Feeds line of update, blank line ends the update as in read_message().
+ */
+static void sim_line(char *line) {
+	long long start = real_usecs();
+	if (*line) {
+		process_update_line(&sim_con, line);
+	} else if (sim_con.machine) {
+		update_machine(sim_con.machine);
+		task_runs[SIM_UPDATE]++;
+	}
+	task_usecs[SIM_UPDATE] += real_usecs() - start;
+}
+
+static void sim_advance(long long target) {
+	while (1) {
+		long long next = next_check;
+		if (next_clear < next) {
+			next = next_clear;
+		}
+		if (next_cut < next) {
+			next = next_cut;
+		}
+		if (next > target) {
+			break;
+		}
+
+		sim_now = next * 1000000;
+		if (next_check <= next) {
+			sim_task(SIM_CHECK);
+			next_check = next + conf->client_lifetime;
+		}
+		if (next_clear <= next) {
+			sim_task(SIM_CLEAR);
+			next_clear = next + conf->timeout_clear;
+		}
+		if (next_cut <= next) {
+			sim_task(SIM_CUT);
+			next_cut = next + conf->timeout_cut;
+		}
+	}
+
+	sim_now = target * 1000000;
+}
+
+static void sim_task(enum sim_task task) {
+	long long start = real_usecs();
+	switch (task) {
+		case SIM_CHECK:
+			check_machines();
+			break;
+		case SIM_CLEAR:
+			clear_old_records();
+			break;
+		case SIM_CUT:
+			cut_records();
+			break;
+		default:
+			break;
+	}
+	task_usecs[task] += real_usecs() - start;
+	task_runs[task]++;
+}
+
+/*
+ * Prints sizes of the store and time spent in tasks since the last stats.
+ */
+static void sim_stats(void) {
+	long long num_users = 0, num_machines = 0, current = 0, past = 0;
+	for (struct user *user = ulist; user; user = user->next) {
+		num_users++;
+	}
+	for (struct machine *machine = mlist; machine;
+	    machine = machine->next) {
+		num_machines++;
+		count_logins(machine->logins, &current, &past);
+		count_logins(machine->past_logins, &current, &past);
+	}
+
+	struct mallinfo2 info = mallinfo2();
+	printf("time=%lld machines=%lld users=%lld logins=%lld past=%lld "
+		"heap=%zu", cur_secs(), num_machines, num_users,
+		current, past, info.uordblks);
+	for (int i = 0; i < NUM_SIM_TASKS; i++) {
+		printf(" %s_ms=%.3f %s_runs=%lld", task_names[i],
+			task_usecs[i] / 1000.0, task_names[i], task_runs[i]);
+		task_usecs[i] = 0;
+		task_runs[i] = 0;
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static void sim_query(char *query) {
+	char request_str[DFINGER_LINE_SIZE + 2];
+	snprintf(request_str, sizeof (request_str), "%s\r\n", query);
+
+	struct finger_request request;
+	memset(&request, 0, sizeof (struct finger_request));
+	finger_parse_request(request_str, &request);
+
+	struct growing_buffer response;
+	init_buffer(&response, DFINGER_METRICS_BUFFER_SIZE);
+	finger_process_request(&request, &response);
+	fwrite(response.buffer, 1, response.len, stdout);
+	free_buffer(&response);
+}
+
+/*
+ * Generates activity of machines for given number of days. Sessions
+ * end at random with mean length of SIM_SESSION_HOURS and are replaced
+ * by new ones, so history grows until housekeeping catches up.
+ */
+static void sim_fleet(int machines, int sessions, int days, int interval) {
+	int per_machine = 2 * sessions + 1;
+	int users = machines * sessions * SIM_USERS_PER_SESSION + 1;
+	double end_chance = (double) interval / (SIM_SESSION_HOURS * 3600);
+	struct sim_session *fleet = malloc(machines * per_machine *
+					sizeof (struct sim_session));
+	int *counts = malloc(machines * sizeof (int));
+	if (!fleet || !counts) {
+		exit(ENOMEM);
+	}
+
+	long long now = cur_secs();
+	for (int i = 0; i < machines; i++) {
+		counts[i] = rand_r(&seed) % per_machine;
+		for (int j = 0; j < counts[i]; j++) {
+			struct sim_session *session = &fleet[i * per_machine + j];
+			session->user = rand_r(&seed) % users;
+			session->line = j;
+			session->login_time = now - rand_r(&seed) % 3600;
+		}
+	}
+
+	char line[DFINGER_LINE_SIZE];
+	long long day_end = now + 24 * 60 * 60;
+	for (long long t = now; t < now + days * 24LL * 60 * 60;
+	    t += interval) {
+		sim_advance(t);
+		for (int i = 0; i < machines; i++) {
+			snprintf(line, DFINGER_LINE_SIZE, "!!! MACHINE sim%d", i);
+			sim_line(line);
+
+			for (int j = 0; j < counts[i]; j++) {
+				struct sim_session *session =
+				    &fleet[i * per_machine + j];
+				if (rand_r(&seed) < end_chance * RAND_MAX) {
+					session->user = rand_r(&seed) % users;
+					session->login_time = t;
+				}
+				snprintf(line, DFINGER_LINE_SIZE,
+					"user%d pts/%d %lld %d 10.%d.%d.%d ",
+					session->user, session->line,
+					session->login_time,
+					rand_r(&seed) % 3600, i >> 16 & 255,
+					i >> 8 & 255, i & 255);
+				sim_line(line);
+			}
+			sim_line("");
+		}
+
+		if (t + interval >= day_end) {
+			sim_stats();
+			day_end += 24 * 60 * 60;
+		}
+	}
+
+	free(counts);
+	free(fleet);
+}
+
+static void run_script(FILE *script) {
+	char line[DFINGER_LINE_SIZE];
+	int in_update = 0;
+
+	while (fgets(line, DFINGER_LINE_SIZE, script)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (in_update) {
+			sim_line(line);
+			in_update = (*line != 0);
+			continue;
+		}
+
+		if (line[0] == '#' || line[0] == 0) {
+			continue;
+		}
+
+		char *arg = strchr(line, ' ');
+		if (arg) {
+			*arg++ = 0;
+		} else {
+			arg = line + strlen(line);
+		}
+
+		if (strcmp(line, "time") == 0) {
+			sim_now = atoll(arg) * 1000000;
+		} else if (strcmp(line, "advance") == 0) {
+			sim_advance(cur_secs() + atoll(arg));
+		} else if (strcmp(line, "update") == 0 ||
+			    strcmp(line, "bye") == 0) {
+			char machine[DFINGER_LINE_SIZE];
+			snprintf(machine, DFINGER_LINE_SIZE, "!!! MACHINE %s",
+				arg);
+			sim_line(machine);
+			if (strcmp(line, "bye") == 0) {
+				sim_line("!!! BYE");
+			} else {
+				in_update = 1;
+			}
+		} else if (strcmp(line, "query") == 0) {
+			sim_query(arg);
+		} else if (strcmp(line, "housekeep") == 0) {
+			sim_task(SIM_CHECK);
+			sim_task(SIM_CLEAR);
+			sim_task(SIM_CUT);
+		} else if (strcmp(line, "stats") == 0) {
+			sim_stats();
+		} else if (strcmp(line, "fleet") == 0) {
+			int machines, sessions, days, interval;
+			if (sscanf(arg, "%d %d %d %d", &machines, &sessions,
+			    &days, &interval) != 4 || machines <= 0 ||
+			    sessions < 0 || interval <= 0) {
+				fprintf(stderr, "Bad fleet command\n");
+				exit(EINVAL);
+			}
+			sim_fleet(machines, sessions, days, interval);
+		} else {
+			fprintf(stderr, "Unknown command %s\n", line);
+			exit(EINVAL);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	conf = malloc(sizeof (struct conf));
+	if (!conf) {
+		return (ENOMEM);
+	}
+	memset(conf, 0, sizeof (struct conf));
+	conf_set_defaults(conf);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "c:")) != -1) {
+		if (opt != 'c') {
+			fprintf(stderr, "Usage: dfinger-sim [-c config] "
+				"[script]\n");
+			return (EINVAL);
+		}
+		snprintf(conf_file, DFINGER_FILENAME_SIZE, "%s", optarg);
+		parse_config(conf_file, conf);
+	}
+
+	FILE *script = stdin;
+	if (optind < argc && !(script = fopen(argv[optind], "r"))) {
+		fprintf(stderr, "Could not open %s\n", argv[optind]);
+		return (EINVAL);
+	}
+
+	sim_now = 1000000000LL * 1000000;
+	set_clock(sim_clock);
+	sim_con.relay = 1;		// Updates of all machines come on it
+	next_check = cur_secs() + conf->client_lifetime;
+	next_clear = cur_secs() + conf->timeout_clear;
+	next_cut = cur_secs() + conf->timeout_cut;
+
+	run_script(script);
+
+	if (script != stdin) {
+		fclose(script);
+	}
+	clear_store();
+
+	return (0);
+}
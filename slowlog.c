@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "slowlog.h"
+
+/*
+ * Log of operations which took longer than the threshold. Entries are
+ * formatted when added and kept in a ring of the last SLOWLOG_ENTRIES,
+ * entries not yet written are appended to the file by slowlog_flush.
+ */
+
+static char ring[SLOWLOG_ENTRIES][SLOWLOG_ENTRY_SIZE];
+static unsigned long long head;		// Entries added
+static unsigned long long flushed;	// Entries written to file
+
+static unsigned long long oldest(unsigned long long from);
+
+static unsigned long long oldest(unsigned long long from) {
+	if (head - from > SLOWLOG_ENTRIES) {
+		return (head - SLOWLOG_ENTRIES);
+	}
+
+	return (from);
+}
+
+/*
+ * Adds entry "<time> <kind> <duration in ms> <details>".
+ */
+void slowlog_add(const char *kind, long long usecs, const char *format, ...) {
+	char *entry = ring[head & (SLOWLOG_ENTRIES - 1)];
+	int len = snprintf(entry, SLOWLOG_ENTRY_SIZE, "%lld %s %.3fms ",
+				cur_secs(), kind, usecs / 1000.0);
+
+	va_list args;
+	va_start(args, format);
+	vsnprintf(entry + len, SLOWLOG_ENTRY_SIZE - len, format, args);
+	va_end(args);
+
+	head++;
+}
+
+void slowlog_report(struct growing_buffer *out) {
+	for (unsigned long long i = oldest(0); i < head; i++) {
+		char *entry = ring[i & (SLOWLOG_ENTRIES - 1)];
+		append_buffer(out, entry, strlen(entry));
+		append_buffer(out, "\r\n", 2);
+	}
+}
+
+int slowlog_flush(const char *file) {
+	if (flushed == head) {
+		return (0);
+	}
+
+	FILE *out = fopen(file, "a");
+	if (!out) {
+		fprintf(stderr, "Could not open slow log %s\n", file);
+		return (1);
+	}
+
+	for (unsigned long long i = oldest(flushed); i < head; i++) {
+		fprintf(out, "%s\n", ring[i & (SLOWLOG_ENTRIES - 1)]);
+	}
+	flushed = head;
+
+	if (fclose(out) != 0) {
+		fprintf(stderr, "Could not write slow log %s\n", file);
+		return (1);
+	}
+
+	return (0);
+}
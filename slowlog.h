@@ -0,0 +1,12 @@
+#ifndef __SLOWLOG_H
+#define	__SLOWLOG_H
+
+#include "utils.h"
+
+#define	SLOWLOG_ENTRIES 256		// Entries kept, power of two
+#define	SLOWLOG_ENTRY_SIZE 512
+
+void slowlog_add(const char *kind, long long usecs, const char *format, ...);
+void slowlog_report(struct growing_buffer *out);
+int slowlog_flush(const char *file);
+#endif
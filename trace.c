@@ -0,0 +1,111 @@
+#define	_POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils.h"
+
+/*
+ * Tracing of hot paths. Events go to a ring which keeps the last
+ * TRACE_RING_SIZE of them and is written as Chrome trace-event JSON
+ * (chrome://tracing, Perfetto) when tracing is switched off. All traced
+ * code runs in the server loop, so the ring is owned by that thread and
+ * needs no locking.
+ *
+ * Timestamps are raw TSC ticks, converted to microseconds only when
+ * written, using the ticks elapsed since tracing was switched on.
+ */
+
+struct trace_record {
+	const char *name;
+	unsigned long long tsc;
+	char phase;
+};
+
+int trace_enabled = 0;
+
+static struct trace_record ring[TRACE_RING_SIZE];
+static unsigned long long head;			// Events recorded
+static unsigned long long start_tsc;
+static long long start_usecs;
+
+#if !defined(__x86_64__) && !defined(__i386__)
+unsigned long long trace_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+#endif
+
+void trace_event(const char *name, char phase) {
+	struct trace_record *record = &ring[head & (TRACE_RING_SIZE - 1)];
+	record->tsc = TRACE_CLOCK();
+	record->name = name;
+	record->phase = phase;
+	head++;
+}
+
+/*
+ * Switches tracing on (forgetting older events) or off (writing events
+ * to the file).
+ */
+void trace_switch(int enable, const char *file) {
+	if (enable == trace_enabled) {
+		return;
+	}
+
+	if (enable) {
+		head = 0;
+		start_usecs = cur_usecs();
+		start_tsc = TRACE_CLOCK();
+		trace_enabled = 1;
+		return;
+	}
+
+	trace_enabled = 0;
+	trace_write(file);
+}
+
+int trace_write(const char *file) {
+	double ticks_per_usec = 1;
+	long long elapsed = cur_usecs() - start_usecs;
+	if (elapsed > 0) {
+		ticks_per_usec = (double) (TRACE_CLOCK() - start_tsc) /
+				elapsed;
+	}
+
+	FILE *out = fopen(file, "w");
+	if (!out) {
+		fprintf(stderr, "Could not open trace file %s\n", file);
+		return (1);
+	}
+
+	unsigned long long first = 0;
+	if (head > TRACE_RING_SIZE) {
+		first = head - TRACE_RING_SIZE;
+	}
+
+	int pid = getpid();
+	fprintf(out, "{\"traceEvents\":[\n");
+	for (unsigned long long i = first; i < head; i++) {
+		struct trace_record *record =
+		    &ring[i & (TRACE_RING_SIZE - 1)];
+		fprintf(out, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+			"\"pid\":%d,\"tid\":%d}%s\n", record->name,
+			record->phase,
+			(double) (record->tsc - start_tsc) / ticks_per_usec,
+			pid, pid, (i + 1 < head ? "," : ""));
+	}
+	fprintf(out, "],\"displayTimeUnit\":\"ns\"}\n");
+
+	if (fclose(out) != 0) {
+		fprintf(stderr, "Could not write trace file %s\n", file);
+		return (1);
+	}
+
+	return (0);
+}
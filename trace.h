@@ -0,0 +1,35 @@
+#ifndef __TRACE_H
+#define	__TRACE_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define	TRACE_CLOCK() __rdtsc()
+#else
+#define	TRACE_CLOCK() trace_clock()
+unsigned long long trace_clock(void);
+#endif
+
+#define	TRACE_RING_SIZE 65536		// Events kept, power of two
+
+/*
+ * Phase of work is marked by TRACE_BEGIN and TRACE_END with the same
+ * name, which must be a string constant. While tracing is off, each of
+ * them costs one well predicted branch.
+ */
+#define	TRACE_BEGIN(name) do { \
+	if (__builtin_expect(trace_enabled, 0)) { \
+		trace_event((name), 'B'); \
+	} \
+} while (0)
+#define	TRACE_END(name) do { \
+	if (__builtin_expect(trace_enabled, 0)) { \
+		trace_event((name), 'E'); \
+	} \
+} while (0)
+
+extern int trace_enabled;
+
+void trace_event(const char *name, char phase);
+void trace_switch(int enable, const char *file);
+int trace_write(const char *file);
+#endif
@@ -0,0 +1,353 @@
+#define	_GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/*
+ * The kernel interface is used directly (io_uring_setup, io_uring_enter
+ * and io_uring_register), so the server doesn't depend on liburing.
+ * Only the server loop uses the ring, so the only synchronization needed
+ * is with the kernel: ring indices are loaded with acquire and stored
+ * with release ordering.
+ */
+
+static int sys_setup(unsigned int entries, struct io_uring_params *params);
+static int sys_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+			unsigned int flags, void *arg, size_t arg_size);
+static int sys_register(int fd, unsigned int opcode, void *arg,
+			unsigned int nr_args);
+static int uring_probe(struct uring *ring);
+
+static int sys_setup(unsigned int entries, struct io_uring_params *params) {
+	return ((int) syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int sys_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+			unsigned int flags, void *arg, size_t arg_size) {
+	return ((int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+				flags, arg, arg_size));
+}
+
+static int sys_register(int fd, unsigned int opcode, void *arg,
+			unsigned int nr_args) {
+	return ((int) syscall(__NR_io_uring_register, fd, opcode, arg,
+				nr_args));
+}
+
+/*
+ * Sets the ring up, returns 0 or error code when the kernel lacks
+ * anything the server needs (multishot accept and receive, provided
+ * buffer rings, waiting with timeout).
+ */
+int uring_init(struct uring *ring, unsigned int buf_size) {
+	memset(ring, 0, sizeof (struct uring));
+	ring->fd = -1;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof (params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_ENTRIES * 4;
+	int fd = sys_setup(URING_ENTRIES, &params);
+	if (fd < 0) {
+		return (errno);
+	}
+	ring->fd = fd;
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(params.features & IORING_FEAT_EXT_ARG)) {
+		uring_free(ring);
+		return (ENOSYS);
+	}
+
+	size_t sq_size = params.sq_off.array +
+			params.sq_entries * sizeof (unsigned int);
+	size_t cq_size = params.cq_off.cqes +
+			params.cq_entries * sizeof (struct io_uring_cqe);
+	ring->rings_size = (sq_size > cq_size ? sq_size : cq_size);
+	ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->rings == MAP_FAILED) {
+		ring->rings = NULL;
+		uring_free(ring);
+		return (ENOMEM);
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		uring_free(ring);
+		return (ENOMEM);
+	}
+
+	char *base = ring->rings;
+	ring->sq_head = (unsigned int *) (base + params.sq_off.head);
+	ring->sq_tail = (unsigned int *) (base + params.sq_off.tail);
+	ring->sq_mask = *(unsigned int *) (base + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_array = (unsigned int *) (base + params.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned int *) (base + params.cq_off.head);
+	ring->cq_tail = (unsigned int *) (base + params.cq_off.tail);
+	ring->cq_mask = *(unsigned int *) (base + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+
+	// Receive buffers are handed to the kernel through a shared ring
+	size_t buf_ring_size = URING_BUFFERS * sizeof (struct io_uring_buf);
+	ring->buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->bufs = malloc((size_t) URING_BUFFERS * buf_size);
+	if (ring->buf_ring == MAP_FAILED || !ring->bufs) {
+		if (ring->buf_ring == MAP_FAILED) {
+			ring->buf_ring = NULL;
+		}
+		uring_free(ring);
+		return (ENOMEM);
+	}
+	ring->buf_size = buf_size;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof (reg));
+	reg.ring_addr = (unsigned long) ring->buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (sys_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		int err = errno;
+		uring_free(ring);
+		return (err);
+	}
+
+	for (unsigned int i = 0; i < URING_BUFFERS; i++) {
+		uring_put_buffer(ring, i);
+	}
+
+	int err = uring_probe(ring);
+	if (err) {
+		uring_free(ring);
+		return (err);
+	}
+
+	return (0);
+}
+
+/*
+ * Multishot receive is the newest thing the server needs (Linux 6.0),
+ * older kernels accept the ring but fail the request, so it's tried
+ * on a socket pair before the server relies on it.
+ */
+static int uring_probe(struct uring *ring) {
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+		return (errno);
+	}
+
+	uring_prep_recv(uring_get_sqe(ring), pair[0], 1);
+	if (write(pair[1], "", 1) != 1) {
+		close(pair[0]);
+		close(pair[1]);
+		return (EIO);
+	}
+
+	int err = ENOSYS;
+	if (uring_wait(ring, 1000) >= 0) {
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_peek(ring))) {
+			if (cqe->user_data == 1 && cqe->res == 1 &&
+			    (cqe->flags & IORING_CQE_F_BUFFER) &&
+			    (cqe->flags & IORING_CQE_F_MORE)) {
+				err = 0;
+			}
+			if (cqe->flags & IORING_CQE_F_BUFFER) {
+				uring_put_buffer(ring, cqe->flags >>
+						IORING_CQE_BUFFER_SHIFT);
+			}
+			uring_seen(ring);
+		}
+	}
+
+	uring_prep_cancel(uring_get_sqe(ring), 1, 0);
+	close(pair[0]);
+	close(pair[1]);
+	uring_wait(ring, 100);
+	while (uring_peek(ring)) {
+		uring_seen(ring);
+	}
+
+	return (err);
+}
+
+void uring_free(struct uring *ring) {
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->rings) {
+		munmap(ring->rings, ring->rings_size);
+	}
+	if (ring->buf_ring) {
+		munmap(ring->buf_ring, URING_BUFFERS *
+			sizeof (struct io_uring_buf));
+	}
+	free(ring->bufs);
+	memset(ring, 0, sizeof (struct uring));
+	ring->fd = -1;
+}
+
+/*
+ * Returns free submission entry, full queue is submitted first.
+ */
+struct io_uring_sqe * uring_get_sqe(struct uring *ring) {
+	while (ring->sq_local_tail - __atomic_load_n(ring->sq_head,
+	    __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		__atomic_store_n(ring->sq_tail, ring->sq_local_tail,
+				__ATOMIC_RELEASE);
+		ring->enters++;
+		sys_enter(ring->fd, ring->sq_local_tail - *ring->sq_head, 0, 0,
+			NULL, 0);
+	}
+
+	unsigned int idx = ring->sq_local_tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof (struct io_uring_sqe));
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+
+	return (sqe);
+}
+
+/*
+ * Submits prepared entries and waits for at least one completion
+ * at most timeout ms (forever if negative) in one system call.
+ * Returns 0, or -1 with errno set (ETIME on timeout).
+ */
+int uring_wait(struct uring *ring, long long timeout) {
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	unsigned int to_submit = ring->sq_local_tail -
+				__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof (arg));
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		arg.ts = (unsigned long long) &ts;
+	}
+
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	unsigned int min_complete = 0;
+	if (!uring_peek(ring)) {
+		flags |= IORING_ENTER_GETEVENTS;
+		min_complete = 1;
+	}
+
+	ring->enters++;
+	if (sys_enter(ring->fd, to_submit, min_complete, flags, &arg,
+			sizeof (arg)) < 0) {
+		return (-1);
+	}
+
+	return (0);
+}
+
+struct io_uring_cqe * uring_peek(struct uring *ring) {
+	unsigned int head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return (NULL);
+	}
+
+	return (&ring->cqes[head & ring->cq_mask]);
+}
+
+void uring_seen(struct uring *ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+char * uring_buffer(struct uring *ring, unsigned int bid) {
+	return (ring->bufs + (size_t) bid * ring->buf_size);
+}
+
+/*
+ * Gives receive buffer (back) to the kernel.
+ */
+void uring_put_buffer(struct uring *ring, unsigned int bid) {
+	struct io_uring_buf *buf =
+	    &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+	buf->addr = (unsigned long) uring_buffer(ring, bid);
+	buf->len = ring->buf_size;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail,
+			__ATOMIC_RELEASE);
+}
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd,
+			unsigned long long data) {
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = data;
+}
+
+/*
+ * Multishot receive into buffers of the provided buffer ring.
+ */
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd,
+			unsigned long long data) {
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = data;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf,
+			size_t len, unsigned long long data) {
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = data;
+}
+
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, short events,
+			unsigned long long data) {
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = (unsigned short) events;
+	sqe->user_data = data;
+}
+
+/*
+ * Changes events armed poll target waits for.
+ */
+void uring_prep_poll_update(struct io_uring_sqe *sqe,
+			unsigned long long target, short events,
+			unsigned long long data) {
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->len = IORING_POLL_UPDATE_EVENTS;
+	sqe->poll32_events = (unsigned short) events;
+	sqe->user_data = data;
+}
+
+void uring_prep_cancel(struct io_uring_sqe *sqe, unsigned long long target,
+			unsigned long long data) {
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = data;
+}
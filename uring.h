@@ -0,0 +1,61 @@
+#ifndef __URING_H
+#define	__URING_H
+
+#include <linux/io_uring.h>
+
+#define	URING_ENTRIES 1024		// Submission queue entries
+#define	URING_BUFFERS 1024		// Provided buffers, power of two
+#define	URING_BUFFER_GROUP 1
+
+/*
+ * Minimal io_uring without liburing: submission and completion rings
+ * mapped from the kernel and one ring of provided receive buffers.
+ */
+struct uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int *sq_array;
+	unsigned int sq_local_tail;	// Entries prepared, not published
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	void *rings;
+	size_t rings_size;
+	size_t sqes_size;
+
+	struct io_uring_buf_ring *buf_ring;
+	char *bufs;
+	unsigned int buf_size;
+	unsigned short buf_tail;
+
+	long long enters;		// Calls of io_uring_enter
+};
+
+int uring_init(struct uring *ring, unsigned int buf_size);
+void uring_free(struct uring *ring);
+struct io_uring_sqe * uring_get_sqe(struct uring *ring);
+int uring_wait(struct uring *ring, long long timeout);
+struct io_uring_cqe * uring_peek(struct uring *ring);
+void uring_seen(struct uring *ring);
+char * uring_buffer(struct uring *ring, unsigned int bid);
+void uring_put_buffer(struct uring *ring, unsigned int bid);
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd,
+			unsigned long long data);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd,
+			unsigned long long data);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf,
+			size_t len, unsigned long long data);
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, short events,
+			unsigned long long data);
+void uring_prep_poll_update(struct io_uring_sqe *sqe,
+			unsigned long long target, short events,
+			unsigned long long data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, unsigned long long target,
+			unsigned long long data);
+#endif
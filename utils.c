@@ -1,14 +1,190 @@
+#define	_XOPEN_SOURCE 600
+
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
 #include <errno.h>
+#include <pthread.h>
 #include "conf.h"
 
+// Source of current time [us], system clock if not set
+static long long (*clock_source)(void);
+
+/*
+ * Pool of buffers in power-of-four size classes. Free buffers are kept on
+ * per-class lists linked through their first bytes, at most POOL_KEEP of
+ * each class, the rest goes back to malloc.
+ */
+static char *pool_free[POOL_CLASSES];
+static int pool_free_count[POOL_CLASSES];
+static struct buffer_pool_stats pool;
+
+// Jobs of run_parallel, taken one by one by worker threads
+struct job_pool {
+	pthread_mutex_t lock;
+	size_t next;
+	size_t count;
+	void (*run)(size_t idx);
+};
+
+static int pool_class(size_t size);
+static void * job_worker(void *arg);
+
+void init_buffer(struct growing_buffer *buffer, size_t max_size) {
+	if (max_size) {
+		buffer->max_size = max_size;
+	} else {
+		buffer->max_size = DFINGER_GBUFFER_MAXSIZE;
+	}
+
+	if (max_size >= 2) {
+		buffer->size = 2;
+	} else {
+		buffer->size = buffer->max_size;
+	}
+
+	buffer->buffer = malloc(buffer->size);
+	if (!buffer->buffer) {
+		exit(ENOMEM);
+	}
+	buffer->offset = 0;
+	buffer->len = 0;
+}
+
+void free_buffer(struct growing_buffer *buffer) {
+	free(buffer->buffer);
+}
+
+void append_buffer(struct growing_buffer *buffer, char *str, size_t str_len) {
+	char *end = reserve_buffer(buffer, str_len);
+	if (!end) {
+		return;
+	}
+
+	memcpy(end, str, str_len);
+	buffer->len += str_len;
+}
+
+/*
+ * Makes room for len more bytes and returns where they go, the caller
+ * moves len past those it wrote. Returns NULL (and empties the buffer)
+ * if they would exceed its maximum size.
+ */
+char *reserve_buffer(struct growing_buffer *buffer, size_t len) {
+	if (buffer->size - buffer->len < len) {
+		if (buffer->max_size - buffer->len < len) {
+			fprintf(stderr, "Buffer overflow\n");
+			buffer->buffer[0] = 0;
+			buffer->len = 0;
+			return (NULL);
+		}
+
+		while (buffer->size - buffer->len < len) {
+			buffer->size = (buffer->size * 2 < buffer->max_size ?
+					buffer->size * 2 : buffer->max_size);
+		}
+		buffer->buffer = realloc(buffer->buffer, buffer->size);
+		if (!buffer->buffer) {
+			exit(ENOMEM);
+		}
+	}
+
+	return (buffer->buffer + buffer->len);
+}
+
+int bind_sock(int port) {
+	struct addrinfo *r, hints;
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	char buf[PORT_SIZE]; snprintf(buf, PORT_SIZE, "%d", port);
+	if (getaddrinfo(NULL, buf, &hints, &r) != 0) {
+		fprintf(stderr, "Could not retrieve address info\n");
+		exit(EINVAL);
+	}
+
+	int fd;
+	if ((fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol)) == -1) {
+		fprintf(stderr, "Could not open socket\n");
+		exit(EINVAL);
+	}
+
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof (reuse));
+
+	if (bind(fd, r->ai_addr, r->ai_addrlen) == -1) {
+		fprintf(stderr, "Could not bind socket\n");
+		exit(EINVAL);
+	}
+	freeaddrinfo(r);
+
+	return (fd);
+}
+
+/*
+ * Opens TCP connection to given host and port, returns the socket
+ * or -1 if no address of the host accepted the connection.
+ */
+int connect_host(const char *host, int port) {
+	int sock = -1;
+	struct addrinfo *r, *rorig, hints;
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	char portstr[PORT_SIZE];
+	snprintf(portstr, PORT_SIZE, "%d", port);
+	if (getaddrinfo(host, portstr, &hints, &rorig) != 0) {
+		return (-1);
+	}
+
+	for (r = rorig; r != NULL; r = r->ai_next) {
+		sock = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+		if (sock < 0) {
+			continue;
+		}
+
+		if (connect(sock, (struct sockaddr *) r->ai_addr,
+				r->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(sock);
+		sock = -1;
+	}
+
+	freeaddrinfo(rorig);
+
+	return (sock);
+}
+
+/*
+ * Fills host with short name (without domain) of the peer on socket fd.
+ */
+void peer_hostname(int fd, char *host, size_t host_size) {
+	struct sockaddr_storage ca;
+	socklen_t sz = sizeof (ca);
+	host[0] = 0;
+
+	if (getpeername(fd, (struct sockaddr *) &ca, &sz) != 0 ||
+	    getnameinfo((struct sockaddr *) &ca, sz, host, host_size,
+			NULL, 0, 0) != 0) {
+		return;
+	}
+
+	char *dot = strchr(host, '.');
+	if (dot) {
+		*dot = 0;
+	}
+}
+
 int flush(int s, char *msg, size_t len) {
-msg[len] = 0;
 	size_t sent = 0;
 
 	while (sent < len) {
@@ -22,6 +198,69 @@ msg[len] = 0;
 	return (0);
 }
 
+static int pool_class(size_t size) {
+	for (int i = 0; i < POOL_CLASSES; i++) {
+		if (size <= (size_t) 1 << (POOL_MIN_SHIFT +
+					i * POOL_CLASS_SHIFT)) {
+			return (i);
+		}
+	}
+
+	return (-1);
+}
+
+/*
+ * Returns buffer of at least size bytes, its real size is stored to got.
+ * Size must not exceed pool_max().
+ */
+char *pool_get(size_t size, size_t *got) {
+	int class = pool_class(size);
+	if (class < 0) {
+		return (NULL);
+	}
+	*got = (size_t) 1 << (POOL_MIN_SHIFT + class * POOL_CLASS_SHIFT);
+
+	char *buffer = pool_free[class];
+	pool.gets++;
+	if (buffer) {
+		memcpy(&pool_free[class], buffer, sizeof (char *));
+		pool_free_count[class]--;
+		pool.free_bytes -= *got;
+		pool.reuses++;
+	} else if (!(buffer = malloc(*got))) {
+		exit(ENOMEM);
+	}
+	pool.used_bytes += *got;
+
+	return (buffer);
+}
+
+/*
+ * Returns buffer got from pool_get() with its real size.
+ */
+void pool_put(char *buffer, size_t size) {
+	int class = pool_class(size);
+	pool.used_bytes -= size;
+	if (pool_free_count[class] >= POOL_KEEP) {
+		free(buffer);
+		return;
+	}
+
+	memcpy(buffer, &pool_free[class], sizeof (char *));
+	pool_free[class] = buffer;
+	pool_free_count[class]++;
+	pool.free_bytes += size;
+}
+
+size_t pool_max(void) {
+	return ((size_t) 1 << (POOL_MIN_SHIFT +
+			(POOL_CLASSES - 1) * POOL_CLASS_SHIFT));
+}
+
+void pool_stats(struct buffer_pool_stats *stats) {
+	*stats = pool;
+}
+
 void move_buffer(char *buffer, size_t buffer_len, size_t *buffer_offset) {
 	memmove(buffer, buffer+*buffer_offset, buffer_len - *buffer_offset);
 	*buffer_offset = buffer_len - *buffer_offset;
@@ -54,7 +293,19 @@ enum ret_fetch_line fetch_line(const char *buffer, size_t buffer_len,
 	return (RTL_LINE_FETCHED);
 }
 
+/*
+ * Replaces system clock by the source, NULL restores the system clock.
+ * Simulation uses it to run the server on virtual time.
+ */
+void set_clock(long long (*source)(void)) {
+	clock_source = source;
+}
+
 long long cur_secs(void) {
+	if (clock_source) {
+		return (clock_source() / 1000000);
+	}
+
 	struct timeval cur_time;
 	if (gettimeofday(&cur_time, NULL) != 0) {
 		return (-1);
@@ -62,6 +313,30 @@ long long cur_secs(void) {
 	return (cur_time.tv_sec);
 }
 
+long long cur_msecs(void) {
+	if (clock_source) {
+		return (clock_source() / 1000);
+	}
+
+	struct timeval cur_time;
+	if (gettimeofday(&cur_time, NULL) != 0) {
+		return (-1);
+	}
+	return ((long long) cur_time.tv_sec * 1000 + cur_time.tv_usec / 1000);
+}
+
+long long cur_usecs(void) {
+	if (clock_source) {
+		return (clock_source());
+	}
+
+	struct timeval cur_time;
+	if (gettimeofday(&cur_time, NULL) != 0) {
+		return (-1);
+	}
+	return ((long long) cur_time.tv_sec * 1000000 + cur_time.tv_usec);
+}
+
 char *format_timediff(long long diff) {
 	char *textual = malloc(DFINGER_TIME_SIZE);
 	if (!textual) {
@@ -89,3 +364,58 @@ char *format_timediff(long long diff) {
 
 	return (textual);
 }
+
+static void * job_worker(void *arg) {
+	struct job_pool *jobs = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&jobs->lock);
+		size_t idx = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+
+		if (idx >= jobs->count) {
+			return (NULL);
+		}
+		jobs->run(idx);
+	}
+}
+
+/*
+ * Runs count jobs on all processors.
+ */
+void run_parallel(size_t count, void (*run)(size_t idx)) {
+	struct job_pool jobs;
+	pthread_mutex_init(&jobs.lock, NULL);
+	jobs.next = 0;
+	jobs.count = count;
+	jobs.run = run;
+
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	if ((size_t) num_threads > count) {
+		num_threads = count;
+	}
+
+	pthread_t *threads = malloc(num_threads * sizeof (pthread_t));
+	if (!threads) {
+		exit(ENOMEM);
+	}
+
+	long started = 0;
+	while (started < num_threads && pthread_create(&threads[started],
+						NULL, job_worker, &jobs) == 0) {
+		started++;
+	}
+	if (!started) {
+		job_worker(&jobs);
+	}
+
+	for (long i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	pthread_mutex_destroy(&jobs.lock);
+}
@@ -13,6 +13,18 @@ struct growing_buffer {
 	size_t max_size;
 };
 
+#define	POOL_CLASSES 6			// Buffer sizes 64 B to 64 KB
+#define	POOL_MIN_SHIFT 6		// Smallest class is 64 B
+#define	POOL_CLASS_SHIFT 2		// Each class is 4 times bigger
+#define	POOL_KEEP 64			// Free buffers kept per class
+
+struct buffer_pool_stats {
+	size_t used_bytes;		// Held by callers
+	size_t free_bytes;		// Kept for reuse
+	long long gets;
+	long long reuses;		// Gets served from free lists
+};
+
 enum ret_fetch_line {
 	RTL_LINE_FETCHED,
 	RTL_BLANK_LINE,
@@ -21,9 +33,28 @@ enum ret_fetch_line {
 	RTL_ERROR_OCCURED,
 };
 
+void set_clock(long long (*source)(void));
 long long cur_secs(void);
+long long cur_msecs(void);
+long long cur_usecs(void);
 char *format_timediff(long long secs);
 
+void init_buffer(struct growing_buffer *buffer, size_t max_size);
+void free_buffer(struct growing_buffer *buffer);
+void append_buffer(struct growing_buffer *buffer, char *str, size_t str_len);
+char *reserve_buffer(struct growing_buffer *buffer, size_t len);
+
+char *pool_get(size_t size, size_t *got);
+void pool_put(char *buffer, size_t size);
+size_t pool_max(void);
+void pool_stats(struct buffer_pool_stats *stats);
+
+void run_parallel(size_t count, void (*run)(size_t idx));
+
+int bind_sock(int port);
+int connect_host(const char *host, int port);
+void peer_hostname(int fd, char *host, size_t host_size);
+
 int flush(int s, char *msg, size_t len);
 void move_buffer(char *buffer, size_t buffer_len, size_t *buffer_offset);
 enum ret_fetch_line fetch_line(const char *buffer, size_t buffer_len,